@@ -0,0 +1,298 @@
+/* SPDX-License-Identifier: MIT */
+#include "boids.h"
+
+static void bench_print_counter(PerfStats *stats, PerfCounter counter,
+				guint num_boids)
+{
+	if (perf_counter_available(counter))
+		g_printf(" %10.2f", perf_per_boid(stats, counter, num_boids));
+	else
+		g_printf(" %10s", "n/a");
+}
+
+static void bench_print_perf(guint num_boids)
+{
+	PerfStats stats;
+	int i;
+
+	if (!perf_enabled)
+		return;
+
+	g_printf("%-10s %6s %10s %10s %10s\n", "phase", "IPC",
+		 "L1D/boid", "LLC/boid", "BrMs/boid");
+
+	for (i = 0; i < PERF_NUM_PHASES; i++) {
+		perf_get_total(i, &stats);
+		if (!stats.samples)
+			continue;
+
+		g_printf("%-10s", perf_phase_name(i));
+
+		if (perf_counter_available(PERF_CYCLES) &&
+		    perf_counter_available(PERF_INSTRUCTIONS))
+			g_printf(" %6.2f", perf_ipc(&stats));
+		else
+			g_printf(" %6s", "n/a");
+
+		bench_print_counter(&stats, PERF_L1D_MISSES, num_boids);
+		bench_print_counter(&stats, PERF_LLC_MISSES, num_boids);
+		bench_print_counter(&stats, PERF_BRANCH_MISSES, num_boids);
+		g_printf("\n");
+	}
+}
+
+static void bench_print_approx_error(Swarm *swarm)
+{
+	ApproxError err;
+
+	swarm_get_approx_error(swarm, &err);
+
+	g_printf("Approximation error vs exact:\n");
+	g_printf("  align:    mean %5.1f deg, max %5.1f deg, missed %4.1f%%\n",
+		 err.align_mean, err.align_max, err.align_missed * 100);
+	g_printf("  cohesion: mean %5.1f deg, max %5.1f deg, missed %4.1f%%\n",
+		 err.cohesion_mean, err.cohesion_max, err.cohesion_missed * 100);
+	g_printf("  steering: RMS %.3f\n", err.steer_rms);
+}
+
+static void bench_print_verlet(Swarm *swarm, guint64 builds, guint64 steps)
+{
+	guint64 end_builds, end_steps;
+
+	swarm_get_verlet_stats(swarm, &end_builds, &end_steps);
+	builds = end_builds - builds;
+	steps = end_steps - steps;
+
+	if (!steps)
+		return;
+
+	g_printf("Verlet lists: skin %u, %" G_GUINT64_FORMAT " builds, "
+		 "%.1f steps/build\n", swarm_get_verlet_skin(swarm), builds,
+		 builds ? (gdouble)steps / builds : 0);
+}
+
+static void bench_print_domains(Swarm *swarm)
+{
+	DomainStats stats;
+	guint min = G_MAXUINT;
+	guint max = 0;
+	guint d;
+
+	if (!swarm->domains)
+		return;
+
+	domain_get_stats(swarm, &stats);
+
+	for (d = 0; d < stats.num_domains; d++) {
+		min = MIN(min, stats.num_boids[d]);
+		max = MAX(max, stats.num_boids[d]);
+	}
+
+	g_printf("Domains: %u, boids per domain %u to %u, "
+		 "%.1f halo boids/step, %.1f migrations/step\n",
+		 stats.num_domains, min, max,
+		 stats.steps ? (gdouble)stats.halo / stats.steps : 0,
+		 stats.steps ? (gdouble)stats.migrated / stats.steps : 0);
+}
+
+int bench_run(Swarm *swarm, guint steps)
+{
+	guint num_boids = swarm_get_num_boids(swarm);
+	guint64 verlet_builds, verlet_steps;
+	gint64 start;
+	gint64 time;
+	guint i;
+
+	if (!steps)
+		return -1;
+
+	perf_reset();
+	swarm_get_verlet_stats(swarm, &verlet_builds, &verlet_steps);
+
+	start = g_get_monotonic_time();
+
+	for (i = 0; i < steps; i++)
+		swarm_move(swarm);
+
+	time = g_get_monotonic_time() - start;
+
+	g_printf("Boids: %u, Steps: %u\n", num_boids, steps);
+	g_printf("Time: %.3f ms/step, %.1f steps/s\n",
+		 (gdouble)time / steps / 1000,
+		 time ? (gdouble)steps * G_USEC_PER_SEC / time : 0);
+
+	bench_print_perf(num_boids);
+	bench_print_verlet(swarm, verlet_builds, verlet_steps);
+	bench_print_domains(swarm);
+
+	if (swarm_get_interaction_mode(swarm) == INTERACTION_APPROXIMATE)
+		bench_print_approx_error(swarm);
+
+	return 0;
+}
+
+typedef struct {
+	const gchar *name;
+	gboolean rules;
+	guint cohesion_dist;
+} BenchScenario;
+
+static const BenchScenario bench_scenarios[] = {
+	/* Boids spread evenly over the field */
+	{ "uniform",   FALSE, COHESION_DIST_DFLT },
+	{ "flocking",  TRUE,  COHESION_DIST_DFLT },
+	/* Long range cohesion collapses the flocks into a few clumps */
+	{ "clustered", TRUE,  COHESION_DIST_MAX },
+};
+
+static const gchar *bench_index_names[NEIGHBOR_NUM_INDEXES] = {
+	[NEIGHBOR_INDEX_BRUTE_FORCE] = "brute",
+	[NEIGHBOR_INDEX_VERLET]      = "verlet",
+	[NEIGHBOR_INDEX_QUADTREE]    = "quadtree",
+};
+
+#define BENCH_WARMUP_STEPS 200
+
+static gdouble bench_scenario(const BenchScenario *sc, NeighborIndex index,
+			      guint num_boids, guint steps)
+{
+	Swarm *swarm;
+	gint64 start;
+	gint64 time;
+	guint i;
+
+	/* Same initial boids for all the indexes */
+	g_random_set_seed(num_boids);
+
+	swarm = swarm_alloc();
+	swarm_set_num_boids(swarm, num_boids);
+	swarm_set_rule_active(swarm, RULE_AVOID, sc->rules);
+	swarm_set_rule_active(swarm, RULE_ALIGN, sc->rules);
+	swarm_set_rule_active(swarm, RULE_COHESION, sc->rules);
+	swarm_set_rule_dist(swarm, RULE_COHESION, sc->cohesion_dist);
+	swarm_set_neighbor_index(swarm, index);
+
+	for (i = 0; i < BENCH_WARMUP_STEPS; i++)
+		swarm_move(swarm);
+
+	start = g_get_monotonic_time();
+
+	for (i = 0; i < steps; i++)
+		swarm_move(swarm);
+
+	time = g_get_monotonic_time() - start;
+
+	swarm_free(swarm);
+
+	return (gdouble)time / steps / 1000;
+}
+
+/*
+ * Time the neighbor indexes of the metric interaction on a few typical
+ * boid distributions, after letting the flocks form.
+ */
+int bench_compare_indexes(guint num_boids, guint steps)
+{
+	gdouble time[NEIGHBOR_NUM_INDEXES];
+	guint best;
+	guint s;
+	guint i;
+
+	if (!steps)
+		return -1;
+
+	g_printf("Boids: %u, Steps: %u, ms/step\n", num_boids, steps);
+	g_printf("%-10s", "scenario");
+	for (i = 0; i < NEIGHBOR_NUM_INDEXES; i++)
+		g_printf(" %9s", bench_index_names[i]);
+	g_printf("  %s\n", "best");
+
+	for (s = 0; s < G_N_ELEMENTS(bench_scenarios); s++) {
+		g_printf("%-10s", bench_scenarios[s].name);
+
+		for (i = 0, best = 0; i < NEIGHBOR_NUM_INDEXES; i++) {
+			time[i] = bench_scenario(&bench_scenarios[s], i,
+						 num_boids, steps);
+			if (time[i] < time[best])
+				best = i;
+
+			g_printf(" %9.3f", time[i]);
+		}
+
+		g_printf("  %s\n", bench_index_names[best]);
+	}
+
+	return 0;
+}
+
+#define BENCH_ERROR_STEPS 50
+
+static gdouble bench_steer_interval(guint interval, guint num_boids,
+				    guint steps, SteerError *err)
+{
+	Swarm *swarm;
+	gint64 start;
+	gint64 time;
+	guint i;
+
+	g_random_set_seed(num_boids);
+
+	swarm = swarm_alloc();
+	swarm_set_num_boids(swarm, num_boids);
+	swarm_set_rule_active(swarm, RULE_AVOID, TRUE);
+	swarm_set_rule_active(swarm, RULE_ALIGN, TRUE);
+	swarm_set_rule_active(swarm, RULE_COHESION, TRUE);
+	swarm_set_rule_active(swarm, RULE_DEAD_ANGLE, TRUE);
+	swarm_set_steer_interval(swarm, interval);
+
+	for (i = 0; i < BENCH_WARMUP_STEPS; i++)
+		swarm_move(swarm);
+
+	start = g_get_monotonic_time();
+
+	for (i = 0; i < steps; i++)
+		swarm_move(swarm);
+
+	time = g_get_monotonic_time() - start;
+
+	/* The measure steers the stale boids too, keep it out of the timing */
+	swarm_measure_steer_error(swarm, TRUE);
+	for (i = 0; i < BENCH_ERROR_STEPS; i++)
+		swarm_move(swarm);
+	swarm_get_steer_error(swarm, err);
+
+	swarm_free(swarm);
+
+	return (gdouble)time / steps / 1000;
+}
+
+/*
+ * Time the multi-rate steering for each steer interval and measure the
+ * error of the stale steerings against the ones computed at each step.
+ */
+int bench_compare_steer_intervals(guint num_boids, guint steps)
+{
+	SteerError err;
+	gdouble time;
+	gdouble ref = 0;
+	guint k;
+
+	if (!steps)
+		return -1;
+
+	g_printf("Boids: %u, Steps: %u\n", num_boids, steps);
+	g_printf("%-8s %9s %8s %9s %9s %9s\n", "interval", "ms/step",
+		 "speedup", "mean deg", "max deg", "RMS");
+
+	for (k = 1; k <= STEER_INTERVAL_MAX; k++) {
+		time = bench_steer_interval(k, num_boids, steps, &err);
+		if (k == 1)
+			ref = time;
+
+		g_printf("%-8u %9.3f %7.2fx %9.1f %9.1f %9.3f\n", k, time,
+			 time ? ref / time : 0, err.angle_mean, err.angle_max,
+			 err.steer_rms);
+	}
+
+	return 0;
+}
@@ -33,6 +33,49 @@ static int get_bg_color(const gchar *color)
 	return res;
 }
 
+static int get_neighbor_index(const gchar *index)
+{
+	int res;
+
+	if (!index)
+		return -1;
+
+	switch (*index) {
+	case 'b':
+	case 'B':
+		res = NEIGHBOR_INDEX_BRUTE_FORCE;
+		break;
+	case 'v':
+	case 'V':
+		res = NEIGHBOR_INDEX_VERLET;
+		break;
+	case 'q':
+	case 'Q':
+		res = NEIGHBOR_INDEX_QUADTREE;
+		break;
+	default:
+		res = -1;
+		break;
+	}
+
+	return res;
+}
+
+static gboolean get_world_size(const gchar *size, gint *width, gint *height)
+{
+	if (!size)
+		return FALSE;
+
+	if (sscanf(size, "%dx%d", width, height) != 2 ||
+	    *width <= 0 || *height <= 0 ||
+	    *width > WORLD_SIZE_MAX || *height > WORLD_SIZE_MAX) {
+		g_fprintf(stderr, "Invalid world size %s\n", size);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 static void get_boid_rules(gchar *rules, gboolean *avoid, gboolean *align,
 			   gboolean *cohesion)
 {
@@ -74,16 +117,49 @@ int main(int argc, char **argv)
 	Swarm *swarm;
 	int num_boids = DEFAULT_NUM_BOIDS;
 	int seed = 0;
+	int bench_steps = 0;
+	int knn = 0;
+	int sort_interval = MORTON_SORT_INTERVAL_DFLT;
+	int verlet_skin = VERLET_SKIN_DFLT;
 	int bg_color;
+	int ret;
+	int width, height;
+	gboolean fixed_world;
 	gboolean start = FALSE;
 	gboolean walls = FALSE;
 	gboolean debug = FALSE;
 	gboolean predator = FALSE;
+	gboolean perf_counters = FALSE;
+	gboolean approximate = FALSE;
+	gboolean bench_indexes = FALSE;
+	gboolean bench_steer = FALSE;
+	gboolean microbench = FALSE;
+	int steer_interval = STEER_INTERVAL_DFLT;
+	gboolean symmetric = FALSE;
+	gboolean fast_math = FALSE;
+	int num_threads = 0;
+	int num_domains = 0;
+	int tolerance = 10;
+	gdouble render_scale = 1;
+	int index;
 	gboolean rule_avoid = TRUE;
 	gboolean rule_align = TRUE;
 	gboolean rule_cohesion = TRUE;
 	gchar *rules = NULL;
 	gchar *bg_color_name = NULL;
+	gchar *trace_file = NULL;
+	gchar *index_name = NULL;
+	gchar *world = NULL;
+	gchar *export_name = NULL;
+	gchar *ensemble = NULL;
+	gchar *check = NULL;
+	gchar *check_only = NULL;
+	gboolean update_baselines = FALSE;
+	gchar *scenario_file = NULL;
+	Scenario *scenario;
+	gchar *record_file = NULL;
+	ScenarioRecord *record = NULL;
+	gchar *output = NULL;
 	GError *error = NULL;
 	GOptionContext *context;
 	GOptionEntry entries[] = {
@@ -97,12 +173,66 @@ int main(int argc, char **argv)
 		  "Add a predator in the swarm", NULL },
 		{ "walls", 'w', 0, G_OPTION_ARG_NONE, &walls,
 		  "Add walls to the field", NULL },
+		{ "world", 'W', 0, G_OPTION_ARG_STRING, &world,
+		  "Fixed world size, larger than the window (i.e. 20000x20000)", "WxH" },
+		{ "nearest", 'k', 0, G_OPTION_ARG_INT, &knn,
+		  "Interact with the VAL nearest visible neighbors only", "VAL" },
+		{ "approximate", 'a', 0, G_OPTION_ARG_NONE, &approximate,
+		  "Approximate cohesion and alignment with grid cell aggregates", NULL },
+		{ "sort-interval", 'z', 0, G_OPTION_ARG_INT, &sort_interval,
+		  "Steps between 2 Z-order sorts of the boids in memory (0 to disable)", "VAL" },
+		{ "index", 'i', 0, G_OPTION_ARG_STRING, &index_name,
+		  "Neighbor search of the default mode: brute, verlet or quadtree", "NAME" },
+		{ "verlet-skin", 'V', 0, G_OPTION_ARG_INT, &verlet_skin,
+		  "Skin of the neighbor lists reused across steps (0 to disable)", "VAL" },
+		{ "steer-interval", 'm', 0, G_OPTION_ARG_INT, &steer_interval,
+		  "Steer each boid every VAL steps, a rotating part of the boids at each step", "VAL" },
+		{ "symmetric", 'S', 0, G_OPTION_ARG_NONE, &symmetric,
+		  "Compute each pair of boids once for both boids", NULL },
+		{ "fast-math", 'f', 0, G_OPTION_ARG_NONE, &fast_math,
+		  "Approximate the square roots and the dead angle test, see --check", NULL },
+		{ "threads", 'j', 0, G_OPTION_ARG_INT, &num_threads,
+		  "Threads sharing the pairs with --symmetric, or the runs with --ensemble (all the cores by default)", "VAL" },
+		{ "domains", 'D', 0, G_OPTION_ARG_INT, &num_domains,
+		  "Split the world between VAL processes", "VAL" },
 		{ "rand-seed", 'r', 0, G_OPTION_ARG_INT, &seed,
 		  "Random seed value", "VAL" },
 		{ "bg-color", 'b', 0, G_OPTION_ARG_STRING, &bg_color_name,
 		  "Background color", "red|green|blue" },
+		{ "render-scale", 'x', 0, G_OPTION_ARG_DOUBLE, &render_scale,
+		  "Draw at VAL of the window size, from 0.25 to 1 (0 to lower it when drawing is too slow)", "VAL" },
 		{ "debug-controls", 'd', 0, G_OPTION_ARG_NONE, &debug,
 		  "Enable debug controls", NULL },
+		{ "export", 'e', 0, G_OPTION_ARG_STRING, &export_name,
+		  "Publish each step in the shared memory object NAME (i.e. /boids)", "NAME" },
+		{ "trace", 't', 0, G_OPTION_ARG_FILENAME, &trace_file,
+		  "Record a Chrome trace (JSON) of frames and phases", "FILE" },
+		{ "perf-counters", 'P', 0, G_OPTION_ARG_NONE, &perf_counters,
+		  "Sample hardware performance counters", NULL },
+		{ "bench", 'B', 0, G_OPTION_ARG_INT, &bench_steps,
+		  "Run VAL simulation steps without GUI and print timings", "VAL" },
+		{ "bench-indexes", 'I', 0, G_OPTION_ARG_NONE, &bench_indexes,
+		  "Compare the neighbor searches over a few scenarios with --bench", NULL },
+		{ "bench-steer", 'M', 0, G_OPTION_ARG_NONE, &bench_steer,
+		  "Compare the speed and error of the steer intervals with --bench", NULL },
+		{ "microbench", 'u', 0, G_OPTION_ARG_NONE, &microbench,
+		  "Time the vector primitives and the steering kernels", NULL },
+		{ "scenario", 'c', 0, G_OPTION_ARG_FILENAME, &scenario_file,
+		  "Set up the simulation and replay the changes described in FILE", "FILE" },
+		{ "record", 'R', 0, G_OPTION_ARG_FILENAME, &record_file,
+		  "Record the changes made in the window to the scenario FILE", "FILE" },
+		{ "check", 'C', 0, G_OPTION_ARG_FILENAME, &check,
+		  "Check the accelerated paths and the step times against the baselines of FILE", "FILE" },
+		{ "check-only", 'K', 0, G_OPTION_ARG_STRING, &check_only,
+		  "Run only one of the checks: paths, fast-math or perf", "NAME" },
+		{ "update-baselines", 'U', 0, G_OPTION_ARG_NONE, &update_baselines,
+		  "Save the step times measured by --check as the new baselines", NULL },
+		{ "tolerance", 'T', 0, G_OPTION_ARG_INT, &tolerance,
+		  "Slowdown in percent failing --check (10 by default)", "VAL" },
+		{ "ensemble", 'E', 0, G_OPTION_ARG_FILENAME, &ensemble,
+		  "Run the parameter sweep described in FILE without GUI", "FILE" },
+		{ "output", 'o', 0, G_OPTION_ARG_FILENAME, &output,
+		  "Summary of the --ensemble runs (ensemble.tsv by default)", "FILE" },
 		{ NULL }
 	};
 
@@ -113,25 +243,131 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
+	if (record_file && scenario_file) {
+		g_fprintf(stderr, "--record and --scenario can't be used together\n");
+		return -1;
+	}
+
+	if (microbench)
+		return microbench_run();
+
+	if (check || check_only) {
+		ret = check_run(check, check_only, MAX(tolerance, 0),
+				update_baselines);
+		g_free(check);
+		g_free(check_only);
+		return ret;
+	}
+
+	if (ensemble) {
+		ret = ensemble_run(ensemble, output ? output : "ensemble.tsv",
+				   num_threads > 0 ? num_threads :
+				   g_get_num_processors());
+		g_free(ensemble);
+		g_free(output);
+		return ret;
+	}
+
 	if (seed)
 		g_random_set_seed(seed);
 
+	trace_init(trace_file, TRACE_DEFAULT_EVENTS);
+	g_free(trace_file);
+
+	if (perf_counters)
+		perf_init();
+
 	get_boid_rules(rules, &rule_avoid, &rule_align, &rule_cohesion);
 	g_free(rules);
 
 	swarm = swarm_alloc();
 	swarm_set_debug_controls(swarm, debug);
+
+	/* Before adding the boids, spread over the whole world */
+	fixed_world = get_world_size(world, &width, &height);
+	g_free(world);
+	if (fixed_world)
+		swarm_set_sizes(swarm, width, height);
+
 	swarm_set_num_boids(swarm, num_boids);
 	swarm_set_walls_enable(swarm, walls);
 	swarm_set_predator_enable(swarm, predator);
 	swarm_set_rule_active(swarm, RULE_AVOID, rule_avoid);
 	swarm_set_rule_active(swarm, RULE_ALIGN, rule_align);
 	swarm_set_rule_active(swarm, RULE_COHESION, rule_cohesion);
+	swarm_set_sort_interval(swarm, MAX(sort_interval, 0));
+	swarm_set_verlet_skin(swarm, MAX(verlet_skin, 0));
+
+	swarm_set_steer_interval(swarm, MAX(steer_interval, 1));
+	swarm_set_symmetric(swarm, symmetric);
+	swarm_set_fast_math(swarm, fast_math);
+
+	index = get_neighbor_index(index_name);
+	g_free(index_name);
+	if (index >= 0)
+		swarm_set_neighbor_index(swarm, index);
+	else if (!verlet_skin)
+		swarm_set_neighbor_index(swarm, NEIGHBOR_INDEX_BRUTE_FORCE);
+
+	if (knn > 0) {
+		swarm_set_interaction_mode(swarm, INTERACTION_TOPOLOGICAL);
+		swarm_set_knn(swarm, knn);
+	} else if (approximate) {
+		swarm_set_interaction_mode(swarm, INTERACTION_APPROXIMATE);
+	}
+
+	if (scenario_file) {
+		scenario = scenario_load(scenario_file);
+		g_free(scenario_file);
+		if (!scenario) {
+			swarm_free(swarm);
+			return -1;
+		}
+
+		if (scenario_get_world_size(scenario, &width, &height))
+			fixed_world = TRUE;
+		scenario_setup(scenario, swarm);
+	}
+
+	/* Before the domain processes get the boids */
+	if (record_file && bench_steps <= 0)
+		record = scenario_record_start(swarm);
+
+	/* The threads don't survive the fork of the domain processes */
+	if (num_domains > 0 && !domain_start(swarm, num_domains)) {
+		swarm_free(swarm);
+		return -1;
+	}
+	if (num_domains <= 0)
+		swarm_set_num_threads(swarm, MAX(num_threads, 1));
+
+	if (export_name && !export_start(swarm, export_name)) {
+		g_free(export_name);
+		swarm_free(swarm);
+		return -1;
+	}
+	g_free(export_name);
 
 	bg_color = get_bg_color(bg_color_name);
 	g_free(bg_color_name);
 
-	gui_run(swarm, bg_color, start);
+	if (bench_steps > 0 && bench_indexes)
+		bench_compare_indexes(swarm_get_num_boids(swarm), bench_steps);
+	else if (bench_steps > 0 && bench_steer)
+		bench_compare_steer_intervals(swarm_get_num_boids(swarm), bench_steps);
+	else if (bench_steps > 0)
+		bench_run(swarm, bench_steps);
+	else
+		gui_run(swarm, bg_color, start, fixed_world, record, render_scale);
+
+	if (record) {
+		scenario_record_save(record, record_file);
+		scenario_record_free(record);
+	}
+	g_free(record_file);
+
+	perf_finish();
+	trace_finish();
 
 	swarm_free(swarm);
 
@@ -6,9 +6,13 @@
 #include <glib/gprintf.h>
 
 #include "vector.h"
+#include "trace.h"
+#include "perf.h"
+#include "export.h"
 
 #define DEFAULT_WIDTH  1024
 #define DEFAULT_HEIGHT 576
+#define WORLD_SIZE_MAX 100000
 
 #define BG_COLOR_WHITE    0
 #define BG_COLOR_REDDISH  1
@@ -21,7 +25,7 @@
 
 #define DEFAULT_NUM_BOIDS 300
 #define MIN_BOIDS 1
-#define MAX_BOIDS 1000
+#define MAX_BOIDS 100000
 
 #define DEFAULT_DEAD_ANGLE (60)
 
@@ -45,9 +49,57 @@
 
 #define PROXIMITY_DIST 30
 
+#define KNN_DFLT  7
+#define KNN_MIN   1
+#define KNN_MAX  32
+
+/* Steps between 2 Z-order sorts of the boids array, 0 to disable */
+#define MORTON_SORT_INTERVAL_DFLT 32
+/* Fraction of boids out of their sorted cell triggering an early sort */
+#define MORTON_SORT_DISORDER 0.5
+/* Z-order cells used to track the sort order, 16x16 over the world */
+#define MORTON_CELL_SHIFT 24
+
+/*
+ * Extra radius of the Verlet neighbor lists. They stay valid until a boid
+ * moved by more than half of it. 0 disables the lists.
+ */
+#define VERLET_SKIN_DFLT 30
+#define VERLET_SKIN_MAX  200
+/*
+ * Budget of the lists, 64 MB. Past it the steps fall back to the quadtree,
+ * trying the lists again every VERLET_RETRY_STEPS.
+ */
+#define VERLET_MAX_NEIGHBORS (1 << 24)
+#define VERLET_RETRY_STEPS   100
+
+/* The steering of a boid is recomputed every steer_interval steps */
+#define STEER_INTERVAL_DFLT 1
+#define STEER_INTERVAL_MAX  8
+
+/* Threads sharing the pair-symmetric steering */
+#define STEER_THREADS_MAX 64
+
+/* Quadtree nodes with more boids are split, down to the Z-order resolution */
+#define QUADTREE_LEAF_SIZE 8
+#define QUADTREE_MAX_DEPTH 16
+
+/* Obstacles per leaf of the obstacle hierarchy */
+#define BVH_LEAF_SIZE 4
+/* Median splits, enough for any number of obstacles */
+#define BVH_STACK_SIZE 64
+
+#define GRID_KNN_CELL_SIZE 40
+#define GRID_AGGREGATE_CELL_SIZE 40
+
 typedef struct {
+	/* Stable id, the position in the boids array changes when sorted */
+	guint id;
+
 	Vector pos;
 	Vector velocity;
+	/* Sum of the avoid, align and cohesion vectors of the current step */
+	Vector steer;
 
 	/* For debugging purpose */
 	Vector avoid;
@@ -63,9 +115,19 @@ typedef enum {
 	OBSTACLE_TYPE_PREDATOR,
 } ObstacleType;
 
+typedef enum {
+	OBSTACLE_SHAPE_CIRCLE = 0,
+	OBSTACLE_SHAPE_SEGMENT,
+} ObstacleShape;
+
 typedef struct {
 	ObstacleType type;
+	ObstacleShape shape;
 	Vector pos;
+	/* Other end of a segment, from pos */
+	Vector end;
+	/* The segments of a polygon share its id, 0 for a circle */
+	guint polygon;
 	/* The predator is a moving obstacle and needs a velocity vector */
 	Vector velocity;
 	/*
@@ -90,10 +152,379 @@ typedef enum {
 	MOUSE_MODE_ATTRACTIVE,
 } MouseMode;
 
+typedef enum {
+	/* Interact with all the visible neighbors within the rule distances */
+	INTERACTION_METRIC = 0,
+	/* Interact with the k nearest visible neighbors only */
+	INTERACTION_TOPOLOGICAL,
+	/*
+	 * Exact avoidance, alignment and cohesion approximated from the
+	 * aggregated boids of the grid cells around
+	 */
+	INTERACTION_APPROXIMATE,
+} InteractionMode;
+
+/* Kernels of the steering timed by --microbench */
+typedef enum {
+	KERNEL_AVOID = 0,
+	KERNEL_ALIGN,
+	KERNEL_COHESION,
+	KERNEL_DEAD_ANGLE,
+	KERNEL_OBSTACLE,
+	NUM_KERNELS,
+} SwarmKernel;
+
+/* Neighbor search of the metric interaction */
+typedef enum {
+	NEIGHBOR_INDEX_BRUTE_FORCE = 0,
+	/* Per boid neighbor lists reused across steps */
+	NEIGHBOR_INDEX_VERLET,
+	/* Quadtree adapting to the boid density, rebuilt at each step */
+	NEIGHBOR_INDEX_QUADTREE,
+	NEIGHBOR_NUM_INDEXES,
+} NeighborIndex;
+
+/*
+ * Boids aggregated over a grid cell or a range of cells. The count is a
+ * double so aggregates can be subtracted in the summed-area table.
+ */
+typedef struct {
+	gdouble count;
+	Vector pos;
+	Vector velocity;
+} CellAggregate;
+
+static inline void cell_aggregate_add(CellAggregate *a, CellAggregate *b)
+{
+	a->count += b->count;
+	vector_add(&a->pos, &b->pos);
+	vector_add(&a->velocity, &b->velocity);
+}
+
+static inline void cell_aggregate_sub(CellAggregate *a, CellAggregate *b)
+{
+	a->count -= b->count;
+	vector_sub(&a->pos, &b->pos);
+	vector_sub(&a->velocity, &b->velocity);
+}
+
+typedef struct {
+	gdouble cell_w;
+	gdouble cell_h;
+	/* Smallest of cell_w and cell_h, for distance bounds */
+	gdouble cell_size;
+	gint cols;
+	gint rows;
+	gboolean periodic;
+	/* Cell offsets (backward, forward) covering a periodic grid once */
+	gint wrap_cols[2];
+	gint wrap_rows[2];
+	/* Ring radius covering the whole grid */
+	gint max_ring;
+	/* Boid indices sorted by cell, cell c spans cell_start[c..c+1] */
+	guint *cell_start;
+	guint *cell_boids;
+	guint *boid_cell;
+	guint cells_alloc;
+	guint boids_alloc;
+
+	/* Per cell aggregates and their summed-area table */
+	CellAggregate *cells;
+	CellAggregate *sat;
+	guint aggregates_alloc;
+} Grid;
+
+typedef struct {
+	/* Bounding box of the boids of the node */
+	gdouble x0;
+	gdouble y0;
+	gdouble x1;
+	gdouble y1;
+	/* The node boids are QuadTree.boids[start..end] */
+	guint start;
+	guint end;
+	/* Children are contiguous, a leaf has none */
+	guint first_child;
+	guint num_children;
+} QuadNode;
+
+/*
+ * Quadtree over the Z-order curve: the boids of a node share the prefix of
+ * their Morton code and are contiguous once sorted. Node 0 is the root.
+ */
+typedef struct {
+	gdouble width;
+	gdouble height;
+	gboolean periodic;
+
+	/* Boid indices and Morton codes sorted in Z-order */
+	guint *boids;
+	guint32 *codes;
+	guint *tmp_boids;
+	guint32 *tmp_codes;
+	guint boids_alloc;
+
+	QuadNode *nodes;
+	guint num_nodes;
+	guint nodes_alloc;
+} QuadTree;
+
+typedef struct {
+	/* Bounding box of the obstacles grown by their avoid radius */
+	gdouble x0;
+	gdouble y0;
+	gdouble x1;
+	gdouble y1;
+	/* A leaf holds Bvh.items[first..first + count], a node has none */
+	guint first;
+	guint count;
+} BvhNode;
+
+/*
+ * Bounding volume hierarchy over the obstacles which don't move, the
+ * items are obstacle indices. Node 0 is the root, the children of a node
+ * are nodes first and first + 1.
+ */
+typedef struct {
+	guint *items;
+	guint num_items;
+	guint items_alloc;
+
+	BvhNode *nodes;
+	guint num_nodes;
+	guint nodes_alloc;
+} Bvh;
+
+typedef struct {
+	guint stack[BVH_STACK_SIZE];
+	guint sp;
+} BvhIter;
+
+static inline void bvh_iter_init(Bvh *bvh, BvhIter *it)
+{
+	it->sp = 0;
+	if (bvh->num_nodes)
+		it->stack[it->sp++] = 0;
+}
+
+/* Next leaf whose box holds (x, y), NULL once all are visited */
+static inline BvhNode *bvh_iter_next(Bvh *bvh, BvhIter *it,
+				     gdouble x, gdouble y)
+{
+	BvhNode *node;
+
+	while (it->sp) {
+		node = &bvh->nodes[it->stack[--it->sp]];
+		if (x < node->x0 || x > node->x1 ||
+		    y < node->y0 || y > node->y1)
+			continue;
+
+		if (node->count)
+			return node;
+
+		it->stack[it->sp++] = node->first + 1;
+		it->stack[it->sp++] = node->first;
+	}
+
+	return NULL;
+}
+
+/* Depth first traversal stack, each level pushes at most 4 nodes */
+#define QUADTREE_STACK_SIZE (3 * QUADTREE_MAX_DEPTH + 4)
+
+static inline gdouble quadtree_axis_dist(gdouble v, gdouble lo, gdouble hi,
+					 gdouble size, gboolean periodic)
+{
+	gdouble d;
+
+	if (v < lo)
+		d = lo - v;
+	else if (v > hi)
+		d = v - hi;
+	else
+		return 0;
+
+	/* The way around the periodic edge may be shorter */
+	if (periodic)
+		d = MIN(d, size - (hi - lo) - d);
+
+	return d;
+}
+
+/* Squared distance from (x, y) to the bounding box of a node */
+static inline gdouble quadtree_node_dist(QuadTree *qt, QuadNode *node,
+					 gdouble x, gdouble y)
+{
+	gdouble dx = quadtree_axis_dist(x, node->x0, node->x1, qt->width,
+					qt->periodic);
+	gdouble dy = quadtree_axis_dist(y, node->y0, node->y1, qt->height,
+					qt->periodic);
+
+	return dx * dx + dy * dy;
+}
+
+static inline guint32 morton_part1by1(guint32 v)
+{
+	v &= 0xffff;
+	v = (v | (v << 8)) & 0x00ff00ff;
+	v = (v | (v << 4)) & 0x0f0f0f0f;
+	v = (v | (v << 2)) & 0x33333333;
+	v = (v | (v << 1)) & 0x55555555;
+
+	return v;
+}
+
+/* Z-order curve index of a position quantized to 16 bits per axis */
+static inline guint32 morton_code(gdouble x, gdouble y,
+				  gdouble width, gdouble height)
+{
+	guint32 qx = CLAMP(x / width, 0.0, 1.0) * 0xffff;
+	guint32 qy = CLAMP(y / height, 0.0, 1.0) * 0xffff;
+
+	return morton_part1by1(qx) | (morton_part1by1(qy) << 1);
+}
+
+/* Sort key of the boid at idx in the boids array */
+typedef struct {
+	guint32 code;
+	guint idx;
+} MortonKey;
+
+/* Thread of the pair-symmetric steering, defined in swarm.c */
+typedef struct _SteerWorker SteerWorker;
+
+/* Shared memory export of the boids, see export.h */
+typedef struct _Export Export;
+
+/* Scripted setup and timeline of changes, see scenario.c */
+typedef struct _Scenario Scenario;
+typedef struct _ScenarioRecord ScenarioRecord;
+
+/* Worker processes of the domain-decomposed simulation, see domain.c */
+typedef struct _Domains Domains;
+
+#define DOMAIN_MAX 64
+
+typedef struct {
+	guint num_domains;
+	guint64 steps;
+	/* Boids owned by each domain at the last frame */
+	guint num_boids[DOMAIN_MAX];
+	/* Boids sent as halo and moved to another domain, over all steps */
+	guint64 halo;
+	guint64 migrated;
+} DomainStats;
+
+/*
+ * Verlet lists of the metric interaction: the boids within radius of boid i
+ * at the last build are neighbors[start[i]..start[i + 1]], in array order.
+ */
+typedef struct {
+	gdouble skin;
+	gboolean valid;
+	/* The last build went over VERLET_MAX_NEIGHBORS at step overflow_step */
+	gboolean overflow;
+	guint64 overflow_step;
+
+	/* Parameters of the last build */
+	gdouble radius;
+	gboolean periodic;
+	gint width;
+	gint height;
+
+	guint *start;
+	guint *neighbors;
+	/* Boid positions at the last build */
+	Vector *build_pos;
+	guint boids_alloc;
+	guint neighbors_alloc;
+
+	/* Spare lists the sorts renumber into, then swapped with the above */
+	guint *spare_start;
+	guint *spare_neighbors;
+	Vector *spare_build_pos;
+	guint spare_boids_alloc;
+	guint spare_neighbors_alloc;
+
+	/* Number of builds and of steps using the lists */
+	guint64 builds;
+	guint64 steps;
+} VerletList;
+
+/* Error of INTERACTION_APPROXIMATE vs the exact metric interaction */
+typedef struct {
+	/* Angle errors in degrees, over the boids steered by both modes */
+	gdouble align_mean;
+	gdouble align_max;
+	gdouble cohesion_mean;
+	gdouble cohesion_max;
+	/* Fraction of boids steered by only one of the 2 modes */
+	gdouble align_missed;
+	gdouble cohesion_missed;
+	/* RMS of the difference of the total steering vectors */
+	gdouble steer_rms;
+} ApproxError;
+
+/*
+ * Error of the stale steering of the boids not updated at a step, vs the
+ * steering they would have got. Accumulated while measured.
+ */
+typedef struct {
+	/* Angle errors in degrees, over the boids steered both ways */
+	gdouble angle_mean;
+	gdouble angle_max;
+	guint64 angle_samples;
+	/* RMS of the difference of the steering vectors */
+	gdouble steer_rms;
+	/* Number of stale steerings compared */
+	guint64 samples;
+} SteerError;
+
+#define grid_cell_index(grid, col, row) ((row) * (grid)->cols + (col))
+
+/*
+ * Index of the cell at offset (dcol, drow) from the cell (col, row), or -1
+ * if it is out of the grid. On a periodic grid, the offsets wrap around and
+ * only the offsets reaching each cell once are valid.
+ */
+static inline gint grid_neighbor_cell(Grid *grid, gint col, gint row,
+				      gint dcol, gint drow)
+{
+	if (grid->periodic) {
+		if (dcol < -grid->wrap_cols[0] || dcol > grid->wrap_cols[1] ||
+		    drow < -grid->wrap_rows[0] || drow > grid->wrap_rows[1])
+			return -1;
+
+		col = (col + dcol + grid->cols) % grid->cols;
+		row = (row + drow + grid->rows) % grid->rows;
+	} else {
+		col += dcol;
+		row += drow;
+		if (col < 0 || col >= grid->cols || row < 0 || row >= grid->rows)
+			return -1;
+	}
+
+	return grid_cell_index(grid, col, row);
+}
+
 typedef struct _Swarm {
 	GArray *boids;
 	GArray *obstacles;
 
+	/* Boid id to index in the boids array */
+	guint *boid_index;
+	/* Z-order code of each boid position at the last sort, in array order */
+	guint32 *morton;
+	guint boids_alloc;
+	/* Scratch of the sorts, the sorted array is swapped with boids */
+	GArray *sorted;
+	MortonKey *sort_keys;
+	guint *sort_index;
+	guint sort_alloc;
+	guint sort_interval;
+	guint steps_since_sort;
+	gdouble disorder;
+
 	gint width;
 	gint height;
 
@@ -110,6 +541,44 @@ typedef struct _Swarm {
 	guint align_dist;
 	guint cohesion_dist;
 
+	InteractionMode interaction;
+	guint knn;
+	NeighborIndex index;
+	Grid grid;
+	VerletList verlet;
+	QuadTree quadtree;
+
+	/* Hierarchy of the static obstacles, rebuilt after any change */
+	Bvh bvh;
+	gboolean bvh_dirty;
+	guint num_polygons;
+
+	/*
+	 * Pair-symmetric steering of the metric interaction, each pair being
+	 * split between num_threads threads, the calling one included.
+	 */
+	gboolean symmetric;
+	guint num_threads;
+
+	/* Multi-rate steering, see STEER_INTERVAL_DFLT */
+	guint steer_interval;
+	guint64 step;
+	gboolean measure_steer_error;
+	SteerError steer_error;
+
+	SteerWorker *workers;
+	GThreadPool *pool;
+	GMutex pool_lock;
+	GCond pool_done;
+	guint pool_pending;
+
+	/* When set, the boids are moved by the domain processes */
+	Domains *domains;
+	/* When set, each step is published, see export_publish() */
+	Export *export;
+	/* When set, replayed by swarm_move() */
+	Scenario *scenario;
+
 	Vector mouse_pos;
 	MouseMode mouse_mode;
 
@@ -117,6 +586,12 @@ typedef struct _Swarm {
 
 	gboolean debug_controls;
 	gboolean debug_vectors;
+
+	/* Approximate sqrt and dead angle, see vector_rsqrt() */
+	gboolean fast_math;
+
+	/* Rules of the current step, select the steering kernel */
+	guint steer_flags;
 } Swarm;
 
 static inline gdouble deg2rad(gdouble deg)
@@ -154,8 +629,15 @@ void swarm_set_walls_enable(Swarm *swarm, gboolean enable);
 
 #define swarm_get_num_boids(swarm) ((swarm)->boids->len)
 void swarm_set_num_boids(Swarm *swarm, guint num);
+void swarm_boids_changed(Swarm *swarm);
+void swarm_init_boid(Swarm *swarm, Boid *boid);
+void swarm_reset_boids(Swarm *swarm);
 
 #define swarm_get_boid(swarm, n) (&g_array_index((swarm)->boids, Boid, n))
+#define swarm_get_boid_by_id(swarm, id) swarm_get_boid(swarm, (swarm)->boid_index[id])
+
+guint swarm_get_sort_interval(Swarm *swarm);
+void swarm_set_sort_interval(Swarm *swarm, guint steps);
 
 guint swarm_get_dead_angle(Swarm *swarm);
 void swarm_set_dead_angle(Swarm *swarm, guint angle);
@@ -169,11 +651,42 @@ MouseMode swarm_get_mouse_mode(Swarm *swarm);
 void swarm_set_mouse_mode(Swarm *swarm, MouseMode mode);
 
 void swarm_add_obstacle(Swarm *swarm, gdouble x, gdouble y, guint flags);
+void swarm_add_polygon(Swarm *swarm, const Vector *points, guint num);
 gboolean swarm_remove_obstacle(Swarm *swarm, gdouble x, gdouble y);
 
 void swarm_set_predator_enable(Swarm *swarm, gboolean enable);
 gboolean swarm_get_predator_enable(Swarm *swarm);
 
+InteractionMode swarm_get_interaction_mode(Swarm *swarm);
+void swarm_set_interaction_mode(Swarm *swarm, InteractionMode mode);
+
+NeighborIndex swarm_get_neighbor_index(Swarm *swarm);
+void swarm_set_neighbor_index(Swarm *swarm, NeighborIndex index);
+
+guint swarm_get_steer_interval(Swarm *swarm);
+void swarm_set_steer_interval(Swarm *swarm, guint steps);
+/* Start measuring the steering error from a reset SteerError */
+void swarm_measure_steer_error(Swarm *swarm, gboolean enable);
+void swarm_get_steer_error(Swarm *swarm, SteerError *err);
+
+gboolean swarm_get_fast_math(Swarm *swarm);
+void swarm_set_fast_math(Swarm *swarm, gboolean enable);
+
+gboolean swarm_get_symmetric(Swarm *swarm);
+void swarm_set_symmetric(Swarm *swarm, gboolean symmetric);
+
+guint swarm_get_num_threads(Swarm *swarm);
+void swarm_set_num_threads(Swarm *swarm, guint num);
+
+guint swarm_get_verlet_skin(Swarm *swarm);
+void swarm_set_verlet_skin(Swarm *swarm, guint skin);
+void swarm_get_verlet_stats(Swarm *swarm, guint64 *builds, guint64 *steps);
+
+guint swarm_get_knn(Swarm *swarm);
+void swarm_set_knn(Swarm *swarm, guint k);
+
+void swarm_get_approx_error(Swarm *swarm, ApproxError *err);
+
 #define swarm_get_obstacle(swarm, n) (&(g_array_index((swarm)->obstacles, Obstacle, n)))
 #define swarm_get_obstacle_pos(swarm, n) (&(g_array_index((swarm)->obstacles, Obstacle, n).pos))
 #define swarm_get_obstacle_type(swarm, n) (g_array_index((swarm)->obstacles, Obstacle, n).type)
@@ -181,7 +694,57 @@ gboolean swarm_get_predator_enable(Swarm *swarm);
 Obstacle *swarm_get_obstacle_by_type(Swarm *swarm, guint type);
 
 void swarm_move(Swarm *swarm);
-
-int gui_run(Swarm *swarm, gint bg_color, gboolean start);
+gdouble swarm_run_kernel(Swarm *swarm, SwarmKernel kernel, Boid *boids,
+			 guint num);
+
+void grid_build(Grid *grid, GArray *boids, gint width, gint height,
+		gdouble cell_size, gboolean periodic);
+void grid_get_cell(Grid *grid, gdouble x, gdouble y, gint *col, gint *row);
+void grid_build_aggregates(Grid *grid, GArray *boids);
+void grid_aggregate_box(Grid *grid, gdouble x0, gdouble y0,
+			gdouble x1, gdouble y1, CellAggregate *agg);
+void grid_free(Grid *grid);
+
+void quadtree_build(QuadTree *qt, GArray *boids, gint width, gint height,
+		    gboolean periodic);
+void quadtree_free(QuadTree *qt);
+
+void bvh_build(Bvh *bvh, GArray *obstacles);
+void bvh_free(Bvh *bvh);
+
+gboolean domain_start(Swarm *swarm, guint num_domains);
+void domain_step(Swarm *swarm);
+void domain_get_stats(Swarm *swarm, DomainStats *stats);
+void domain_stop(Swarm *swarm);
+
+gboolean export_start(Swarm *swarm, const gchar *name);
+void export_publish(Swarm *swarm);
+void export_stop(Swarm *swarm);
+
+Scenario *scenario_load(const gchar *filename);
+gboolean scenario_get_world_size(Scenario *sc, gint *width, gint *height);
+void scenario_setup(Scenario *sc, Swarm *swarm);
+void scenario_update(Swarm *swarm);
+void scenario_free(Scenario *sc);
+ScenarioRecord *scenario_record_start(Swarm *swarm);
+void scenario_record(ScenarioRecord *rec, Swarm *swarm, const gchar *key);
+void scenario_record_obstacle(ScenarioRecord *rec, Swarm *swarm,
+			      gdouble x, gdouble y, gboolean removed);
+gboolean scenario_record_save(ScenarioRecord *rec, const gchar *filename);
+void scenario_record_free(ScenarioRecord *rec);
+
+int ensemble_run(const gchar *spec, const gchar *output, guint num_threads);
+
+int check_run(const gchar *baseline, const gchar *only, guint tolerance,
+	      gboolean update);
+
+int microbench_run(void);
+
+int gui_run(Swarm *swarm, gint bg_color, gboolean start, gboolean fixed_world,
+	    ScenarioRecord *record, gdouble render_scale);
+
+int bench_run(Swarm *swarm, guint steps);
+int bench_compare_indexes(guint num_boids, guint steps);
+int bench_compare_steer_intervals(guint num_boids, guint steps);
 
 #endif /* __BOIDS_H__ */
@@ -0,0 +1,165 @@
+/* SPDX-License-Identifier: MIT */
+#include "boids.h"
+
+/*
+ * Bounding volume hierarchy of the obstacles.
+ * Only the field obstacles and the walls are in the tree, the scary mouse
+ * and the predator move at each step. The box of an obstacle is grown by
+ * its avoid radius, so the obstacles a boid has to avoid are in the leaves
+ * whose box holds the boid position. The tree is built top down: the
+ * obstacles of a node are sorted along the longest side of the box of
+ * their centers and split in 2 halves, down to BVH_LEAF_SIZE obstacles.
+ */
+
+typedef struct {
+	guint obstacle;
+	gdouble cx;
+	gdouble cy;
+	BvhNode box;
+} BvhItem;
+
+static void bvh_obstacle_box(Obstacle *o, BvhNode *box)
+{
+	gdouble r = sqrt(o->avoid_radius);
+	Vector end = o->shape == OBSTACLE_SHAPE_SEGMENT ? o->end : o->pos;
+
+	box->x0 = MIN(o->pos.x, end.x) - r;
+	box->y0 = MIN(o->pos.y, end.y) - r;
+	box->x1 = MAX(o->pos.x, end.x) + r;
+	box->y1 = MAX(o->pos.y, end.y) + r;
+}
+
+static void bvh_box_union(BvhNode *box, BvhNode *other)
+{
+	box->x0 = MIN(box->x0, other->x0);
+	box->y0 = MIN(box->y0, other->y0);
+	box->x1 = MAX(box->x1, other->x1);
+	box->y1 = MAX(box->y1, other->y1);
+}
+
+static int bvh_item_cmp_x(const void *a, const void *b)
+{
+	const BvhItem *ia = a;
+	const BvhItem *ib = b;
+
+	return ia->cx < ib->cx ? -1 : ia->cx > ib->cx;
+}
+
+static int bvh_item_cmp_y(const void *a, const void *b)
+{
+	const BvhItem *ia = a;
+	const BvhItem *ib = b;
+
+	return ia->cy < ib->cy ? -1 : ia->cy > ib->cy;
+}
+
+static guint bvh_alloc_nodes(Bvh *bvh, guint num)
+{
+	guint first = bvh->num_nodes;
+
+	if (bvh->num_nodes + num > bvh->nodes_alloc) {
+		bvh->nodes_alloc = MAX(bvh->nodes_alloc * 2, bvh->num_nodes + num);
+		bvh->nodes = g_renew(BvhNode, bvh->nodes, bvh->nodes_alloc);
+	}
+
+	bvh->num_nodes += num;
+
+	return first;
+}
+
+/*
+ * The nodes array may be reallocated, nodes are referenced by index.
+ * The node holds items[start..start + num].
+ */
+static void bvh_build_node(Bvh *bvh, guint idx, BvhItem *items,
+			   guint start, guint num)
+{
+	gdouble x0 = G_MAXDOUBLE, y0 = G_MAXDOUBLE;
+	gdouble x1 = -G_MAXDOUBLE, y1 = -G_MAXDOUBLE;
+	BvhItem *it = items + start;
+	BvhNode *node;
+	guint first;
+	guint half;
+	guint i;
+
+	if (num <= BVH_LEAF_SIZE) {
+		node = &bvh->nodes[idx];
+		*node = it[0].box;
+		for (i = 1; i < num; i++)
+			bvh_box_union(node, &it[i].box);
+		node->first = start;
+		node->count = num;
+		return;
+	}
+
+	for (i = 0; i < num; i++) {
+		x0 = MIN(x0, it[i].cx);
+		y0 = MIN(y0, it[i].cy);
+		x1 = MAX(x1, it[i].cx);
+		y1 = MAX(y1, it[i].cy);
+	}
+
+	qsort(it, num, sizeof(BvhItem),
+	      x1 - x0 >= y1 - y0 ? bvh_item_cmp_x : bvh_item_cmp_y);
+
+	half = num / 2;
+	first = bvh_alloc_nodes(bvh, 2);
+
+	bvh_build_node(bvh, first, items, start, half);
+	bvh_build_node(bvh, first + 1, items, start + half, num - half);
+
+	node = &bvh->nodes[idx];
+	*node = bvh->nodes[first];
+	bvh_box_union(node, &bvh->nodes[first + 1]);
+	node->first = first;
+	node->count = 0;
+}
+
+void bvh_build(Bvh *bvh, GArray *obstacles)
+{
+	BvhItem *items;
+	Obstacle *o;
+	guint num = 0;
+	guint i;
+
+	items = g_new(BvhItem, obstacles->len);
+
+	for (i = 0; i < obstacles->len; i++) {
+		o = &g_array_index(obstacles, Obstacle, i);
+		if (o->type != OBSTACLE_TYPE_IN_FIELD &&
+		    o->type != OBSTACLE_TYPE_WALL)
+			continue;
+
+		items[num].obstacle = i;
+		bvh_obstacle_box(o, &items[num].box);
+		items[num].cx = (items[num].box.x0 + items[num].box.x1) * 0.5;
+		items[num].cy = (items[num].box.y0 + items[num].box.y1) * 0.5;
+		num++;
+	}
+
+	bvh->num_nodes = 0;
+	bvh->num_items = num;
+
+	if (num) {
+		bvh_alloc_nodes(bvh, 1);
+		bvh_build_node(bvh, 0, items, 0, num);
+	}
+
+	if (num > bvh->items_alloc) {
+		bvh->items_alloc = num;
+		bvh->items = g_renew(guint, bvh->items, bvh->items_alloc);
+	}
+
+	/* In leaf order */
+	for (i = 0; i < num; i++)
+		bvh->items[i] = items[i].obstacle;
+
+	g_free(items);
+}
+
+void bvh_free(Bvh *bvh)
+{
+	g_free(bvh->items);
+	g_free(bvh->nodes);
+	memset(bvh, 0, sizeof(*bvh));
+}
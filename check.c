@@ -0,0 +1,440 @@
+/* SPDX-License-Identifier: MIT */
+#include "boids.h"
+
+/*
+ * Regression checks of --check, each one also run alone by ctest. The
+ * accelerated paths must move the boids like the brute force search, the
+ * fast math must stay within its error bounds, and the step time of a few
+ * fixed workloads must stay within a tolerance of the baselines of a key
+ * file:
+ *
+ *   [baseline]
+ *   flocking=1.234
+ *
+ * in ms/step. A missing baseline fails, they are measured and saved with
+ * --update-baselines, i.e. on another machine.
+ */
+
+#define CHECK_GROUP "baseline"
+
+#define CHECK_BOIDS 1000
+#define CHECK_STEPS 20
+/* Largest position difference with the reference, in world units */
+#define CHECK_MAX_DIFF 1e-6
+
+/* Fast math: relative error of vector_rsqrt() over 1e-6..1e6 */
+#define CHECK_RSQRT_SAMPLES   1000000
+#define CHECK_RSQRT_MAX_ERROR 2e-3
+/* Dead angle decisions differing from the exact test, in pairs */
+#define CHECK_SEES_BOIDS      1000
+#define CHECK_SEES_PAIRS      1000000
+#define CHECK_SEES_MAX_DIFF   0
+/*
+ * Largest position difference with the exact math after one step, the
+ * boids move by DEFAULT_SPEED at each step
+ */
+#define CHECK_FAST_MAX_DIFF   0.2
+
+#define CHECK_WARMUP_STEPS 50
+#define CHECK_PERF_STEPS   100
+/* Best of the repeats, to leave out the noise of the other processes */
+#define CHECK_PERF_REPEATS 3
+
+typedef struct {
+	const gchar *name;
+	NeighborIndex index;
+	guint sort_interval;
+	gboolean symmetric;
+	guint num_threads;
+	guint num_domains;
+	gboolean walls;
+} CheckPath;
+
+/*
+ * The first one is the reference, run with the walls for the paths which
+ * have them. At MAX_SPEED, some boids go through the walls and wrap
+ * around, with 3 domains from the first to the last one.
+ */
+static const CheckPath check_paths[] = {
+	{ "brute",     NEIGHBOR_INDEX_BRUTE_FORCE, 0, FALSE, 1, 0, FALSE },
+	{ "verlet",    NEIGHBOR_INDEX_VERLET,      0, FALSE, 1, 0, FALSE },
+	{ "quadtree",  NEIGHBOR_INDEX_QUADTREE,    0, FALSE, 1, 0, FALSE },
+	{ "sorted",    NEIGHBOR_INDEX_BRUTE_FORCE, 1, FALSE, 1, 0, FALSE },
+	{ "symmetric", NEIGHBOR_INDEX_BRUTE_FORCE, 0, TRUE,  1, 0, FALSE },
+	{ "threads",   NEIGHBOR_INDEX_BRUTE_FORCE, 0, TRUE,  4, 0, FALSE },
+	{ "domains",   NEIGHBOR_INDEX_BRUTE_FORCE, 0, FALSE, 1, 2, FALSE },
+	{ "walls",     NEIGHBOR_INDEX_BRUTE_FORCE, 0, FALSE, 1, 3, TRUE  },
+};
+
+typedef struct {
+	const gchar *name;
+	guint num_boids;
+	guint cohesion_dist;
+} CheckWorkload;
+
+static const CheckWorkload check_workloads[] = {
+	{ "flocking",  1000, COHESION_DIST_DFLT },
+	{ "clustered", 1000, COHESION_DIST_MAX },
+	{ "large",     4000, COHESION_DIST_DFLT },
+};
+
+static Swarm *check_swarm_alloc(guint num_boids, guint cohesion_dist)
+{
+	Swarm *swarm;
+
+	/* Same initial boids for all the paths */
+	g_random_set_seed(num_boids);
+
+	swarm = swarm_alloc();
+	swarm_set_num_boids(swarm, num_boids);
+	swarm_set_rule_active(swarm, RULE_AVOID, TRUE);
+	swarm_set_rule_active(swarm, RULE_ALIGN, TRUE);
+	swarm_set_rule_active(swarm, RULE_COHESION, TRUE);
+	swarm_set_rule_active(swarm, RULE_DEAD_ANGLE, TRUE);
+	swarm_set_rule_dist(swarm, RULE_COHESION, cohesion_dist);
+
+	return swarm;
+}
+
+/* Positions by boid id */
+static Vector *check_positions(Swarm *swarm)
+{
+	Vector *pos = g_new0(Vector, CHECK_BOIDS);
+	Boid *b;
+	guint i;
+
+	for (i = 0; i < swarm_get_num_boids(swarm); i++) {
+		b = swarm_get_boid(swarm, i);
+		if (b->id < CHECK_BOIDS)
+			pos[b->id] = b->pos;
+	}
+
+	return pos;
+}
+
+/* Positions by boid id after CHECK_STEPS steps */
+static Vector *check_path_run(const CheckPath *path, gboolean walls)
+{
+	guint steps = CHECK_STEPS;
+	Swarm *swarm;
+	Vector *pos;
+	guint i;
+
+	swarm = check_swarm_alloc(CHECK_BOIDS, COHESION_DIST_DFLT);
+	swarm_set_neighbor_index(swarm, path->index);
+	swarm_set_sort_interval(swarm, path->sort_interval);
+	swarm_set_symmetric(swarm, path->symmetric);
+	swarm_set_walls_enable(swarm, walls);
+	if (walls)
+		swarm_set_speed(swarm, MAX_SPEED);
+
+	if (path->num_domains && !domain_start(swarm, path->num_domains)) {
+		swarm_free(swarm);
+		return NULL;
+	}
+	if (!path->num_domains)
+		swarm_set_num_threads(swarm, path->num_threads);
+
+	/* The frame gathered from the domains lags one step behind */
+	if (path->num_domains)
+		steps++;
+
+	for (i = 0; i < steps; i++)
+		swarm_move(swarm);
+
+	pos = check_positions(swarm);
+	swarm_free(swarm);
+
+	return pos;
+}
+
+static gboolean check_paths_run(void)
+{
+	Vector *ref[2];
+	Vector *pos;
+	gdouble dx, dy;
+	gdouble max;
+	gboolean ok = TRUE;
+	guint p;
+	guint i;
+
+	g_printf("Paths vs %s, %u boids, %u steps:\n", check_paths[0].name,
+		 CHECK_BOIDS, CHECK_STEPS);
+
+	ref[FALSE] = check_path_run(&check_paths[0], FALSE);
+	ref[TRUE] = check_path_run(&check_paths[0], TRUE);
+
+	for (p = 1; p < G_N_ELEMENTS(check_paths); p++) {
+		pos = check_path_run(&check_paths[p], check_paths[p].walls);
+		if (!pos) {
+			g_printf("  %-10s %12s  FAIL\n", check_paths[p].name,
+				 "n/a");
+			ok = FALSE;
+			continue;
+		}
+
+		/* The field wraps around */
+		for (i = 0, max = 0; i < CHECK_BOIDS; i++) {
+			dx = fabs(pos[i].x - ref[check_paths[p].walls][i].x);
+			dy = fabs(pos[i].y - ref[check_paths[p].walls][i].y);
+			dx = MIN(dx, DEFAULT_WIDTH - dx);
+			dy = MIN(dy, DEFAULT_HEIGHT - dy);
+			max = MAX(max, sqrt(POW2(dx) + POW2(dy)));
+		}
+
+		g_printf("  %-10s %12.3g  %s\n", check_paths[p].name, max,
+			 max <= CHECK_MAX_DIFF ? "ok" : "FAIL");
+		if (max > CHECK_MAX_DIFF)
+			ok = FALSE;
+
+		g_free(pos);
+	}
+
+	g_free(ref[FALSE]);
+	g_free(ref[TRUE]);
+
+	return ok;
+}
+
+static gdouble check_rsqrt_error(void)
+{
+	gdouble max = 0;
+	gdouble x;
+	guint i;
+
+	for (i = 0; i < CHECK_RSQRT_SAMPLES; i++) {
+		x = pow(10, -6 + 12.0 * i / CHECK_RSQRT_SAMPLES);
+		max = MAX(max, fabs(vector_rsqrt(x) * sqrt(x) - 1));
+	}
+
+	return max;
+}
+
+/* Pairs seen differently by the exact and the squared cosine tests */
+static guint check_sees_diff(void)
+{
+	Boid *boids = g_new0(Boid, CHECK_SEES_BOIDS);
+	Boid pair[2];
+	Swarm *swarm;
+	gboolean exact;
+	guint diff = 0;
+	guint n;
+	guint i;
+
+	g_random_set_seed(1);
+
+	swarm = swarm_alloc();
+	swarm_set_rule_active(swarm, RULE_DEAD_ANGLE, TRUE);
+
+	for (n = 0; n < CHECK_SEES_PAIRS / CHECK_SEES_BOIDS; n++) {
+		for (i = 0; i < CHECK_SEES_BOIDS; i++) {
+			vector_set(&boids[i].pos, g_random_double_range(-100, 100),
+				   g_random_double_range(-100, 100));
+			vector_set(&boids[i].velocity, g_random_double_range(-5, 5),
+				   g_random_double_range(-5, 5));
+		}
+
+		/* A new dead angle for each batch */
+		swarm_set_dead_angle(swarm, n % 360);
+
+		/* boids[0] with each of the others */
+		pair[0] = boids[0];
+		for (i = 1; i < CHECK_SEES_BOIDS; i++) {
+			pair[1] = boids[i];
+
+			swarm_set_fast_math(swarm, FALSE);
+			exact = swarm_run_kernel(swarm, KERNEL_DEAD_ANGLE,
+						 pair, 2);
+			swarm_set_fast_math(swarm, TRUE);
+			if (exact != swarm_run_kernel(swarm, KERNEL_DEAD_ANGLE,
+						      pair, 2))
+				diff++;
+		}
+	}
+
+	swarm_free(swarm);
+	g_free(boids);
+
+	return diff;
+}
+
+static gdouble check_fast_step_diff(void)
+{
+	Swarm *swarm;
+	Vector *exact;
+	Vector *fast;
+	gdouble max = 0;
+	gdouble dx, dy;
+	guint i;
+
+	swarm = check_swarm_alloc(CHECK_BOIDS, COHESION_DIST_DFLT);
+	swarm_move(swarm);
+	exact = check_positions(swarm);
+	swarm_free(swarm);
+
+	swarm = check_swarm_alloc(CHECK_BOIDS, COHESION_DIST_DFLT);
+	swarm_set_fast_math(swarm, TRUE);
+	swarm_move(swarm);
+	fast = check_positions(swarm);
+	swarm_free(swarm);
+
+	/* The field wraps around */
+	for (i = 0; i < CHECK_BOIDS; i++) {
+		dx = fabs(fast[i].x - exact[i].x);
+		dy = fabs(fast[i].y - exact[i].y);
+		dx = MIN(dx, DEFAULT_WIDTH - dx);
+		dy = MIN(dy, DEFAULT_HEIGHT - dy);
+		max = MAX(max, sqrt(POW2(dx) + POW2(dy)));
+	}
+
+	g_free(exact);
+	g_free(fast);
+
+	return max;
+}
+
+static gboolean check_fast_math_run(void)
+{
+	gdouble rsqrt = check_rsqrt_error();
+	guint sees = check_sees_diff();
+	gdouble step = check_fast_step_diff();
+	gboolean ok = TRUE;
+
+	g_printf("Fast math vs exact:\n");
+	g_printf("  %-10s %12.3g  %s\n", "rsqrt", rsqrt,
+		 rsqrt <= CHECK_RSQRT_MAX_ERROR ? "ok" : "FAIL");
+	g_printf("  %-10s %12u  %s\n", "dead angle", sees,
+		 sees <= CHECK_SEES_MAX_DIFF ? "ok" : "FAIL");
+	g_printf("  %-10s %12.3g  %s\n", "step", step,
+		 step <= CHECK_FAST_MAX_DIFF ? "ok" : "FAIL");
+
+	if (rsqrt > CHECK_RSQRT_MAX_ERROR || sees > CHECK_SEES_MAX_DIFF ||
+	    step > CHECK_FAST_MAX_DIFF)
+		ok = FALSE;
+
+	return ok;
+}
+
+static gdouble check_workload_time(const CheckWorkload *w)
+{
+	gdouble best = G_MAXDOUBLE;
+	Swarm *swarm;
+	gint64 start;
+	guint r;
+	guint i;
+
+	for (r = 0; r < CHECK_PERF_REPEATS; r++) {
+		swarm = check_swarm_alloc(w->num_boids, w->cohesion_dist);
+
+		for (i = 0; i < CHECK_WARMUP_STEPS; i++)
+			swarm_move(swarm);
+
+		start = g_get_monotonic_time();
+		for (i = 0; i < CHECK_PERF_STEPS; i++)
+			swarm_move(swarm);
+		best = MIN(best, (gdouble)(g_get_monotonic_time() - start) /
+				 CHECK_PERF_STEPS / 1000);
+
+		swarm_free(swarm);
+	}
+
+	return best;
+}
+
+static gboolean check_perf_run(const gchar *baseline, guint tolerance,
+			       gboolean update)
+{
+	GKeyFile *kf = g_key_file_new();
+	GError *error = NULL;
+	gboolean ok = TRUE;
+	gdouble base;
+	gdouble time;
+	guint w;
+
+	if (!baseline) {
+		g_fprintf(stderr, "The step times need a baselines file\n");
+		return FALSE;
+	}
+
+	/* Only the baselines being updated may be missing */
+	if (!g_key_file_load_from_file(kf, baseline, G_KEY_FILE_KEEP_COMMENTS,
+				       &error) && !update) {
+		g_fprintf(stderr, "Failed to read %s: %s\n", baseline,
+			  error->message);
+		g_error_free(error);
+		g_key_file_free(kf);
+		return FALSE;
+	}
+	g_clear_error(&error);
+
+	g_printf("Step times vs %s, tolerance %u%%:\n", baseline, tolerance);
+	g_printf("  %-10s %6s %10s %10s %8s\n", "workload", "boids",
+		 "baseline", "ms/step", "change");
+
+	for (w = 0; w < G_N_ELEMENTS(check_workloads); w++) {
+		time = check_workload_time(&check_workloads[w]);
+
+		g_printf("  %-10s %6u", check_workloads[w].name,
+			 check_workloads[w].num_boids);
+
+		if (update) {
+			g_key_file_set_double(kf, CHECK_GROUP,
+					      check_workloads[w].name, time);
+			g_printf(" %10s %10.3f %8s  saved\n", "-", time, "-");
+			continue;
+		}
+
+		base = g_key_file_get_double(kf, CHECK_GROUP,
+					     check_workloads[w].name, &error);
+		if (error || base <= 0) {
+			g_clear_error(&error);
+			g_printf(" %10s %10.3f %8s  FAIL\n", "-", time, "-");
+			ok = FALSE;
+			continue;
+		}
+
+		g_printf(" %10.3f %10.3f %+7.1f%%  %s\n", base, time,
+			 (time / base - 1) * 100,
+			 time <= base * (1 + tolerance / 100.0) ? "ok" : "FAIL");
+		if (time > base * (1 + tolerance / 100.0))
+			ok = FALSE;
+	}
+
+	if (update && !g_key_file_save_to_file(kf, baseline, &error)) {
+		g_fprintf(stderr, "Failed to write %s: %s\n", baseline,
+			  error->message);
+		g_error_free(error);
+		ok = FALSE;
+	}
+
+	g_key_file_free(kf);
+
+	return ok;
+}
+
+/*
+ * 0 when all the checks pass. only is NULL for all of them, or paths,
+ * fast-math or perf. The step times need the baselines file.
+ */
+int check_run(const gchar *baseline, const gchar *only, guint tolerance,
+	      gboolean update)
+{
+	gboolean ok = TRUE;
+
+	if (only && g_strcmp0(only, "paths") &&
+	    g_strcmp0(only, "fast-math") && g_strcmp0(only, "perf")) {
+		g_fprintf(stderr, "Unknown check %s\n", only);
+		return 1;
+	}
+
+	if (!only || !g_strcmp0(only, "paths"))
+		ok &= check_paths_run();
+	if (!only || !g_strcmp0(only, "fast-math"))
+		ok &= check_fast_math_run();
+	if (!only || !g_strcmp0(only, "perf"))
+		ok &= check_perf_run(baseline, tolerance, update);
+
+	g_printf("%s\n", ok ? "All checks passed" : "Some checks FAILED");
+
+	return ok ? 0 : 1;
+}
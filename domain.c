@@ -0,0 +1,556 @@
+/* SPDX-License-Identifier: MIT */
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "boids.h"
+
+/*
+ * Domain-decomposed simulation.
+ * The world is split into num_domains vertical slabs, each owned by a
+ * forked worker process running its own copy of the swarm. All the
+ * exchanges go through one POSIX shared memory object holding, for each
+ * domain, a frame box and one halo and one migration box per side.
+ *
+ * Each step, between 2 process-shared barriers:
+ * - a worker posts in its halo boxes the boids within the interaction
+ *   distance of its borders, then gets the ones of its neighbors as
+ *   ghosts, steers and moves its boids and ghosts and drops the ghosts,
+ * - a worker posts in its migration boxes the boids which moved to a
+ *   neighbor slab, then adds the ones which moved in and writes its
+ *   boids in its frame box.
+ * The coordinator, the original process, takes part in the barriers and
+ * gathers the frames in its own swarm, one step behind the workers.
+ *
+ * The workers are killed with the coordinator. When a worker dies, the
+ * coordinator stops the others and goes on with the boids of the last
+ * frame in its own process.
+ *
+ * Each box can hold all the boids, its pages are only backed once used.
+ */
+
+#define DOMAIN_LEFT  0
+#define DOMAIN_RIGHT 1
+
+/* Period of the checks for a dead process while waiting on a barrier */
+#define DOMAIN_POLL_MS 100
+
+enum {
+	DOMAIN_BOX_FRAME = 0,
+	DOMAIN_BOX_HALO,
+	DOMAIN_BOX_MIGRATE = DOMAIN_BOX_HALO + 2,
+	DOMAIN_NUM_BOXES = DOMAIN_BOX_MIGRATE + 2,
+};
+
+typedef struct {
+	guint count;
+	Boid boids[];
+} DomainBox;
+
+typedef struct {
+	/* Barrier of the workers and the coordinator, see domain_barrier() */
+	gint arrived;
+	gint generation;
+	guint num_procs;
+	/* Set once a process died, the barriers don't wait anymore */
+	volatile gint failed;
+	pid_t coordinator;
+
+	volatile gint quit;
+	guint num_domains;
+	guint capacity;
+	gsize box_size;
+
+	guint64 steps;
+	guint64 halo[DOMAIN_MAX];
+	guint64 migrated[DOMAIN_MAX];
+} DomainShared;
+
+struct _Domains {
+	DomainShared *shm;
+	gsize shm_size;
+	guint num_domains;
+	/* 0 once the worker is reaped */
+	pid_t pid[DOMAIN_MAX];
+};
+
+static DomainBox *domain_box(DomainShared *shm, guint d, guint box)
+{
+	return (DomainBox *)((guchar *)shm + sizeof(DomainShared) +
+			     (d * DOMAIN_NUM_BOXES + box) * shm->box_size);
+}
+
+static guint domain_of(Swarm *swarm, DomainShared *shm, gdouble x)
+{
+	guint d = x * shm->num_domains / swarm->width;
+
+	return MIN(d, shm->num_domains - 1);
+}
+
+/* Neighbor domain on a side across the periodic boundary */
+static guint domain_wrap_neighbor(DomainShared *shm, guint d, gint side)
+{
+	guint n = shm->num_domains;
+
+	return side == DOMAIN_LEFT ? (d + n - 1) % n : (d + 1) % n;
+}
+
+/* Neighbor domain on a side, -1 against the walls */
+static gint domain_neighbor(Swarm *swarm, DomainShared *shm, guint d,
+			    gint side)
+{
+	guint n = shm->num_domains;
+
+	if (swarm->walls &&
+	    ((side == DOMAIN_LEFT && d == 0) ||
+	     (side == DOMAIN_RIGHT && d == n - 1)))
+		return -1;
+
+	return domain_wrap_neighbor(shm, d, side);
+}
+
+/* Largest distance at which 2 boids interact, the halo width */
+static gdouble domain_halo(Swarm *swarm)
+{
+	return MAX(swarm->avoid_dist,
+		   MAX(swarm->align_dist, swarm->cohesion_dist));
+}
+
+static gint domain_futex(gint *addr, gint op, gint val,
+			 const struct timespec *timeout)
+{
+	return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+/*
+ * A worker checks that the coordinator is still there, the coordinator
+ * that all the workers are.
+ */
+static gboolean domain_alive(DomainShared *shm, Domains *dom)
+{
+	gboolean alive = TRUE;
+	guint d;
+
+	if (!dom)
+		return getppid() == shm->coordinator;
+
+	for (d = 0; d < dom->num_domains; d++) {
+		if (dom->pid[d] > 0 &&
+		    waitpid(dom->pid[d], NULL, WNOHANG) == dom->pid[d]) {
+			g_fprintf(stderr, "Domain %u worker died\n", d);
+			dom->pid[d] = 0;
+			alive = FALSE;
+		}
+	}
+
+	return alive;
+}
+
+/*
+ * Process-shared barrier on a futex. Unlike a pthread barrier, the wait
+ * times out every DOMAIN_POLL_MS to check that no process died, it would
+ * never arrive. Returns FALSE once one did. dom is NULL in the workers.
+ */
+static gboolean domain_barrier(DomainShared *shm, Domains *dom)
+{
+	struct timespec timeout = { 0, DOMAIN_POLL_MS * 1000000 };
+	gint gen = __atomic_load_n(&shm->generation, __ATOMIC_ACQUIRE);
+
+	if (shm->failed)
+		return FALSE;
+
+	if (__atomic_add_fetch(&shm->arrived, 1, __ATOMIC_ACQ_REL) ==
+	    (gint)shm->num_procs) {
+		__atomic_store_n(&shm->arrived, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&shm->generation, gen + 1, __ATOMIC_RELEASE);
+		domain_futex(&shm->generation, FUTEX_WAKE, G_MAXINT, NULL);
+		return TRUE;
+	}
+
+	while (__atomic_load_n(&shm->generation, __ATOMIC_ACQUIRE) == gen) {
+		if (shm->failed)
+			return FALSE;
+
+		if (domain_futex(&shm->generation, FUTEX_WAIT, gen,
+				 &timeout) < 0 && errno == ETIMEDOUT &&
+		    !domain_alive(shm, dom)) {
+			shm->failed = 1;
+			domain_futex(&shm->generation, FUTEX_WAKE, G_MAXINT,
+				     NULL);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static void domain_post(DomainBox *box, Boid *b)
+{
+	box->boids[box->count++] = *b;
+}
+
+static void domain_receive(Swarm *swarm, DomainBox *box, guint8 *ghost)
+{
+	guint i;
+
+	g_array_append_vals(swarm->boids, box->boids, box->count);
+
+	if (ghost) {
+		for (i = 0; i < box->count; i++)
+			ghost[box->boids[i].id] = 1;
+	}
+}
+
+static void domain_post_halo(Swarm *swarm, DomainShared *shm, guint d)
+{
+	gdouble slab = (gdouble)swarm->width / shm->num_domains;
+	gdouble x0 = d * slab;
+	gdouble x1 = x0 + slab;
+	gdouble halo = domain_halo(swarm);
+	DomainBox *left = domain_box(shm, d, DOMAIN_BOX_HALO + DOMAIN_LEFT);
+	DomainBox *right = domain_box(shm, d, DOMAIN_BOX_HALO + DOMAIN_RIGHT);
+	Boid *b;
+	guint i;
+
+	left->count = 0;
+	right->count = 0;
+
+	for (i = 0; i < swarm_get_num_boids(swarm); i++) {
+		b = swarm_get_boid(swarm, i);
+
+		if (b->pos.x - x0 < halo &&
+		    domain_neighbor(swarm, shm, d, DOMAIN_LEFT) >= 0)
+			domain_post(left, b);
+		if (x1 - b->pos.x <= halo &&
+		    domain_neighbor(swarm, shm, d, DOMAIN_RIGHT) >= 0)
+			domain_post(right, b);
+	}
+
+	shm->halo[d] += left->count + right->count;
+}
+
+/* Get the halo a neighbor posted on the side facing this domain */
+static void domain_receive_halo(Swarm *swarm, DomainShared *shm, guint d,
+				guint8 *ghost)
+{
+	gint n;
+
+	n = domain_neighbor(swarm, shm, d, DOMAIN_LEFT);
+	if (n >= 0)
+		domain_receive(swarm, domain_box(shm, n, DOMAIN_BOX_HALO +
+						 DOMAIN_RIGHT), ghost);
+
+	n = domain_neighbor(swarm, shm, d, DOMAIN_RIGHT);
+	if (n >= 0)
+		domain_receive(swarm, domain_box(shm, n, DOMAIN_BOX_HALO +
+						 DOMAIN_LEFT), ghost);
+}
+
+/* Drop the ghosts and post the boids which left the slab */
+static void domain_post_migrants(Swarm *swarm, DomainShared *shm, guint d,
+				 guint8 *ghost)
+{
+	DomainBox *left = domain_box(shm, d, DOMAIN_BOX_MIGRATE + DOMAIN_LEFT);
+	DomainBox *right = domain_box(shm, d, DOMAIN_BOX_MIGRATE + DOMAIN_RIGHT);
+	GArray *boids = swarm->boids;
+	Boid *b;
+	guint i, j;
+	guint to;
+
+	left->count = 0;
+	right->count = 0;
+
+	for (i = 0, j = 0; i < boids->len; i++) {
+		b = &g_array_index(boids, Boid, i);
+
+		if (ghost[b->id]) {
+			ghost[b->id] = 0;
+			continue;
+		}
+
+		to = domain_of(swarm, shm, b->pos.x);
+		if (to == d) {
+			g_array_index(boids, Boid, j++) = *b;
+			continue;
+		}
+
+		/*
+		 * The boids move by much less than a slab per step. With 2
+		 * domains, both boxes go to the other one. The positions
+		 * still wrap around with the walls on, so a boid going
+		 * through a wall migrates across it like without them.
+		 */
+		if (to == domain_wrap_neighbor(shm, d, DOMAIN_LEFT))
+			domain_post(left, b);
+		else
+			domain_post(right, b);
+	}
+
+	g_array_set_size(boids, j);
+
+	shm->migrated[d] += left->count + right->count;
+}
+
+/* Unlike the halos, the migrants also come through the walls */
+static void domain_receive_migrants(Swarm *swarm, DomainShared *shm, guint d)
+{
+	guint n;
+
+	n = domain_wrap_neighbor(shm, d, DOMAIN_LEFT);
+	domain_receive(swarm, domain_box(shm, n, DOMAIN_BOX_MIGRATE +
+					 DOMAIN_RIGHT), NULL);
+
+	n = domain_wrap_neighbor(shm, d, DOMAIN_RIGHT);
+	domain_receive(swarm, domain_box(shm, n, DOMAIN_BOX_MIGRATE +
+					 DOMAIN_LEFT), NULL);
+}
+
+static void domain_write_frame(Swarm *swarm, DomainShared *shm, guint d)
+{
+	DomainBox *frame = domain_box(shm, d, DOMAIN_BOX_FRAME);
+
+	frame->count = swarm_get_num_boids(swarm);
+	memcpy(frame->boids, swarm->boids->data, sizeof(Boid) * frame->count);
+}
+
+static void domain_worker(Swarm *swarm, DomainShared *shm, guint d)
+{
+	GArray *boids = swarm->boids;
+	guint8 *ghost;
+	Boid *b;
+	guint i, j;
+
+	/* Don't outlive the coordinator, it may even be gone already */
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	if (getppid() != shm->coordinator)
+		_exit(1);
+
+	/* This copy of the swarm is simulated here, not by the coordinator */
+	swarm->domains = NULL;
+	swarm->export = NULL;
+	swarm->scenario = NULL;
+	trace_enabled = FALSE;
+	perf_enabled = FALSE;
+
+	/* The ghosts change at each step, don't keep Verlet lists */
+	if (swarm->index == NEIGHBOR_INDEX_VERLET)
+		swarm->index = NEIGHBOR_INDEX_QUADTREE;
+
+	ghost = g_new0(guint8, shm->capacity);
+
+	for (i = 0, j = 0; i < boids->len; i++) {
+		b = &g_array_index(boids, Boid, i);
+		if (domain_of(swarm, shm, b->pos.x) == d)
+			g_array_index(boids, Boid, j++) = *b;
+	}
+	g_array_set_size(boids, j);
+
+	domain_write_frame(swarm, shm, d);
+
+	for (;;) {
+		domain_post_halo(swarm, shm, d);
+		if (!domain_barrier(shm, NULL) || shm->quit)
+			break;
+
+		domain_receive_halo(swarm, shm, d, ghost);
+		swarm_boids_changed(swarm);
+		swarm_move(swarm);
+
+		domain_post_migrants(swarm, shm, d, ghost);
+		if (!domain_barrier(shm, NULL))
+			break;
+
+		domain_receive_migrants(swarm, shm, d);
+		domain_write_frame(swarm, shm, d);
+	}
+
+	_exit(0);
+}
+
+/*
+ * Fork the workers, each one keeping the boids of its slab. The swarm
+ * settings are copied at that point: later changes of the coordinator
+ * swarm don't reach the workers.
+ */
+gboolean domain_start(Swarm *swarm, guint num_domains)
+{
+	Domains *dom;
+	DomainShared *shm;
+	gchar *name;
+	gsize box_size;
+	gsize size;
+	guint capacity = swarm_get_num_boids(swarm);
+	guint d;
+	gint fd;
+
+	if (num_domains < 2 || num_domains > DOMAIN_MAX) {
+		g_fprintf(stderr, "Domains must be between 2 and %d\n",
+			  DOMAIN_MAX);
+		return FALSE;
+	}
+
+	/* A slab must not be in the halo of both its neighbors */
+	if ((gdouble)swarm->width / num_domains < 2 * domain_halo(swarm)) {
+		g_fprintf(stderr, "World too narrow for %u domains\n",
+			  num_domains);
+		return FALSE;
+	}
+
+	if (swarm->predator) {
+		g_fprintf(stderr, "The predator is not supported with domains\n");
+		return FALSE;
+	}
+
+	box_size = sizeof(DomainBox) + sizeof(Boid) * capacity;
+	size = sizeof(DomainShared) + num_domains * DOMAIN_NUM_BOXES * box_size;
+
+	name = g_strdup_printf("/boids-%d", getpid());
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd >= 0) {
+		/* The mapping stays shared with the forked workers */
+		shm_unlink(name);
+		if (ftruncate(fd, size) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	g_free(name);
+
+	if (fd < 0) {
+		g_fprintf(stderr, "Failed to create the shared memory: %s\n",
+			  g_strerror(errno));
+		return FALSE;
+	}
+
+	shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		g_fprintf(stderr, "Failed to map the shared memory: %s\n",
+			  g_strerror(errno));
+		return FALSE;
+	}
+
+	shm->num_domains = num_domains;
+	shm->capacity = capacity;
+	shm->box_size = box_size;
+
+	shm->num_procs = num_domains + 1;
+	shm->coordinator = getpid();
+
+	dom = g_new0(Domains, 1);
+	dom->shm = shm;
+	dom->shm_size = size;
+	dom->num_domains = num_domains;
+
+	for (d = 0; d < num_domains; d++) {
+		dom->pid[d] = fork();
+		if (dom->pid[d] == 0)
+			domain_worker(swarm, shm, d);
+
+		if (dom->pid[d] < 0) {
+			g_fprintf(stderr, "Failed to start domain %u: %s\n", d,
+				  g_strerror(errno));
+			/* The started workers wait for the missing ones */
+			while (d--) {
+				kill(dom->pid[d], SIGKILL);
+				waitpid(dom->pid[d], NULL, 0);
+			}
+			munmap(shm, size);
+			g_free(dom);
+			return FALSE;
+		}
+	}
+
+	swarm->domains = dom;
+
+	return TRUE;
+}
+
+/*
+ * One step of the workers, the swarm boids get the last complete frame.
+ * If a worker died, the swarm goes on from the previous frame in this
+ * process.
+ */
+void domain_step(Swarm *swarm)
+{
+	DomainShared *shm = swarm->domains->shm;
+	DomainBox *frame;
+	guint d;
+
+	TRACE_BEGIN("domain_step");
+
+	if (!domain_barrier(shm, swarm->domains))
+		goto failed;
+
+	g_array_set_size(swarm->boids, 0);
+	for (d = 0; d < shm->num_domains; d++) {
+		frame = domain_box(shm, d, DOMAIN_BOX_FRAME);
+		g_array_append_vals(swarm->boids, frame->boids, frame->count);
+	}
+	swarm_boids_changed(swarm);
+
+	if (!domain_barrier(shm, swarm->domains))
+		goto failed;
+
+	shm->steps++;
+	swarm->step++;
+
+	TRACE_END("domain_step");
+	return;
+
+failed:
+	g_fprintf(stderr, "Stopping the domains, going on in one process\n");
+	domain_stop(swarm);
+	TRACE_END("domain_step");
+}
+
+void domain_get_stats(Swarm *swarm, DomainStats *stats)
+{
+	DomainShared *shm = swarm->domains->shm;
+	guint d;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->num_domains = shm->num_domains;
+	stats->steps = shm->steps;
+
+	for (d = 0; d < shm->num_domains; d++) {
+		stats->num_boids[d] = domain_box(shm, d, DOMAIN_BOX_FRAME)->count;
+		stats->halo += shm->halo[d];
+		stats->migrated += shm->migrated[d];
+	}
+}
+
+void domain_stop(Swarm *swarm)
+{
+	Domains *dom = swarm->domains;
+	guint d;
+
+	if (!dom)
+		return;
+
+	dom->shm->quit = 1;
+	if (!domain_barrier(dom->shm, dom)) {
+		/* The workers may be blocked on the barrier, or gone */
+		for (d = 0; d < dom->num_domains; d++) {
+			if (dom->pid[d] > 0)
+				kill(dom->pid[d], SIGKILL);
+		}
+	}
+
+	for (d = 0; d < dom->num_domains; d++) {
+		if (dom->pid[d] > 0)
+			waitpid(dom->pid[d], NULL, 0);
+	}
+
+	munmap(dom->shm, dom->shm_size);
+	g_free(dom);
+
+	swarm->domains = NULL;
+}
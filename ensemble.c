@@ -0,0 +1,458 @@
+/* SPDX-License-Identifier: MIT */
+#include "boids.h"
+
+/*
+ * Headless parameter sweeps.
+ * The sweep is read from the [ensemble] group of a key file, each rule
+ * parameter taking a list of values:
+ *
+ *   [ensemble]
+ *   boids=500
+ *   steps=2000
+ *   repeats=2
+ *   avoid=20;30
+ *   align=60;80;100
+ *   cohesion=100;200
+ *   dead_angle=0;60
+ *   speed=3;4.5
+ *
+ * One run is made for each combination of the values and each repeat,
+ * every run with its own swarm. The runs are split evenly between the
+ * threads; a thread done with its share steals half of the runs left to
+ * another one. The summary of all the runs is written at the end, one
+ * line per run, in run order.
+ */
+
+#define ENSEMBLE_GROUP "ensemble"
+#define ENSEMBLE_STEPS_DFLT 1000
+/* Polarization averaged over the last steps of a run */
+#define ENSEMBLE_MEASURE_FRACTION 0.1
+
+enum {
+	ENSEMBLE_AVOID = 0,
+	ENSEMBLE_ALIGN,
+	ENSEMBLE_COHESION,
+	ENSEMBLE_DEAD_ANGLE,
+	ENSEMBLE_SPEED,
+	ENSEMBLE_NUM_PARAMS,
+};
+
+static const gchar *ensemble_param_names[ENSEMBLE_NUM_PARAMS] = {
+	[ENSEMBLE_AVOID]      = "avoid",
+	[ENSEMBLE_ALIGN]      = "align",
+	[ENSEMBLE_COHESION]   = "cohesion",
+	[ENSEMBLE_DEAD_ANGLE] = "dead_angle",
+	[ENSEMBLE_SPEED]      = "speed",
+};
+
+typedef struct {
+	gdouble param[ENSEMBLE_NUM_PARAMS];
+	guint seed;
+
+	/* Norm of the mean heading, 1 when all the boids head the same way */
+	gdouble polarization;
+	/* Groups of boids chained within the align distance, at the end */
+	guint flocks;
+	gdouble largest_flock;
+	gdouble ms_per_step;
+} EnsembleRun;
+
+typedef struct {
+	GMutex lock;
+	/* Runs left to this thread, from next to end - 1 */
+	guint next;
+	guint end;
+} EnsembleQueue;
+
+typedef struct {
+	guint num_boids;
+	guint steps;
+	gint width;
+	gint height;
+
+	EnsembleRun *runs;
+	guint num_runs;
+
+	EnsembleQueue *queues;
+	guint num_threads;
+
+	/* The boids are placed with the global GLib random generator */
+	GMutex init_lock;
+} Ensemble;
+
+typedef struct {
+	Ensemble *ens;
+	guint id;
+} EnsembleWorker;
+
+static gboolean ensemble_take(Ensemble *ens, guint id, guint *run)
+{
+	EnsembleQueue *own = &ens->queues[id];
+	EnsembleQueue *q;
+	guint next, end;
+	guint t;
+
+	for (;;) {
+		g_mutex_lock(&own->lock);
+		if (own->next < own->end) {
+			*run = own->next++;
+			g_mutex_unlock(&own->lock);
+			return TRUE;
+		}
+		g_mutex_unlock(&own->lock);
+
+		/* Steal the upper half of the first non empty queue */
+		for (t = 1; t < ens->num_threads; t++) {
+			q = &ens->queues[(id + t) % ens->num_threads];
+
+			g_mutex_lock(&q->lock);
+			next = q->next + (q->end - q->next) / 2;
+			end = q->end;
+			q->end = next;
+			g_mutex_unlock(&q->lock);
+
+			/* Only one lock at a time, the thieves skip empty queues */
+			if (next < end) {
+				g_mutex_lock(&own->lock);
+				own->next = next;
+				own->end = end;
+				g_mutex_unlock(&own->lock);
+				break;
+			}
+		}
+
+		if (t == ens->num_threads)
+			return FALSE;
+	}
+}
+
+static inline gdouble ensemble_wrap(gdouble d, gdouble size)
+{
+	if (d > size / 2)
+		return d - size;
+	if (d < -size / 2)
+		return d + size;
+	return d;
+}
+
+static guint ensemble_find(guint *parent, guint i)
+{
+	while (parent[i] != i) {
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+
+	return i;
+}
+
+/* Group the boids within the align distance of each other */
+static void ensemble_count_flocks(Swarm *swarm, EnsembleRun *r)
+{
+	guint num_boids = swarm_get_num_boids(swarm);
+	gdouble dist2 = POW2(swarm_get_rule_dist(swarm, RULE_ALIGN));
+	Grid grid = { 0 };
+	guint *parent;
+	guint *size;
+	guint largest = 0;
+	gint col, row;
+	gint dc, dr;
+	gint c;
+	guint i, j, k;
+	Boid *b, *b2;
+
+	grid_build(&grid, swarm->boids, swarm->width, swarm->height,
+		   swarm_get_rule_dist(swarm, RULE_ALIGN), TRUE);
+
+	parent = g_new(guint, num_boids);
+	size = g_new0(guint, num_boids);
+	for (i = 0; i < num_boids; i++)
+		parent[i] = i;
+
+	for (i = 0; i < num_boids; i++) {
+		b = swarm_get_boid(swarm, i);
+		grid_get_cell(&grid, b->pos.x, b->pos.y, &col, &row);
+
+		for (dr = -1; dr <= 1; dr++) {
+			for (dc = -1; dc <= 1; dc++) {
+				c = grid_neighbor_cell(&grid, col, row, dc, dr);
+				if (c < 0)
+					continue;
+
+				for (k = grid.cell_start[c];
+				     k < grid.cell_start[c + 1]; k++) {
+					j = grid.cell_boids[k];
+					if (j <= i)
+						continue;
+
+					b2 = swarm_get_boid(swarm, j);
+					if (POW2(ensemble_wrap(b2->pos.x - b->pos.x, swarm->width)) +
+					    POW2(ensemble_wrap(b2->pos.y - b->pos.y, swarm->height)) < dist2)
+						parent[ensemble_find(parent, i)] =
+							ensemble_find(parent, j);
+				}
+			}
+		}
+	}
+
+	r->flocks = 0;
+	for (i = 0; i < num_boids; i++) {
+		j = ensemble_find(parent, i);
+		if (!size[j]++)
+			r->flocks++;
+		largest = MAX(largest, size[j]);
+	}
+	r->largest_flock = num_boids ? (gdouble)largest / num_boids : 0;
+
+	g_free(parent);
+	g_free(size);
+	grid_free(&grid);
+}
+
+static gdouble ensemble_polarization(Swarm *swarm)
+{
+	Vector sum = { 0 };
+	Vector v;
+	guint i;
+
+	for (i = 0; i < swarm_get_num_boids(swarm); i++) {
+		v = swarm_get_boid(swarm, i)->velocity;
+		vector_normalize(&v);
+		vector_add(&sum, &v);
+	}
+
+	return vector_mag(&sum) / MAX(swarm_get_num_boids(swarm), 1);
+}
+
+static void ensemble_run_one(Ensemble *ens, EnsembleRun *r)
+{
+	guint measure = MAX(ens->steps * ENSEMBLE_MEASURE_FRACTION, 1);
+	Swarm *swarm;
+	gint64 start;
+	guint i;
+
+	/* Same boids for a seed whatever the other runs going on */
+	g_mutex_lock(&ens->init_lock);
+	swarm = swarm_alloc();
+	swarm_set_sizes(swarm, ens->width, ens->height);
+	g_random_set_seed(r->seed);
+	swarm_set_num_boids(swarm, ens->num_boids);
+	swarm_reset_boids(swarm);
+	g_mutex_unlock(&ens->init_lock);
+
+	swarm_set_rule_active(swarm, RULE_AVOID, TRUE);
+	swarm_set_rule_active(swarm, RULE_ALIGN, TRUE);
+	swarm_set_rule_active(swarm, RULE_COHESION, TRUE);
+	swarm_set_rule_dist(swarm, RULE_AVOID, r->param[ENSEMBLE_AVOID]);
+	swarm_set_rule_dist(swarm, RULE_ALIGN, r->param[ENSEMBLE_ALIGN]);
+	swarm_set_rule_dist(swarm, RULE_COHESION, r->param[ENSEMBLE_COHESION]);
+	swarm_set_dead_angle(swarm, r->param[ENSEMBLE_DEAD_ANGLE]);
+	swarm_set_rule_active(swarm, RULE_DEAD_ANGLE,
+			      r->param[ENSEMBLE_DEAD_ANGLE] > 0);
+	swarm_set_speed(swarm, r->param[ENSEMBLE_SPEED]);
+
+	start = g_get_monotonic_time();
+
+	for (i = 0; i < ens->steps; i++) {
+		swarm_move(swarm);
+		if (i >= ens->steps - measure)
+			r->polarization += ensemble_polarization(swarm);
+	}
+
+	r->ms_per_step = (gdouble)(g_get_monotonic_time() - start) /
+			 ens->steps / 1000;
+	r->polarization /= measure;
+
+	ensemble_count_flocks(swarm, r);
+
+	swarm_free(swarm);
+}
+
+static gpointer ensemble_worker(gpointer data)
+{
+	EnsembleWorker *w = data;
+	guint run;
+
+	while (ensemble_take(w->ens, w->id, &run))
+		ensemble_run_one(w->ens, &w->ens->runs[run]);
+
+	return NULL;
+}
+
+static gdouble *ensemble_get_values(GKeyFile *kf, guint param, gdouble dflt,
+				    gsize *num)
+{
+	gdouble *values;
+
+	values = g_key_file_get_double_list(kf, ENSEMBLE_GROUP,
+					    ensemble_param_names[param], num,
+					    NULL);
+	if (!values || !*num) {
+		g_free(values);
+		values = g_new(gdouble, 1);
+		values[0] = dflt;
+		*num = 1;
+	}
+
+	return values;
+}
+
+static gint ensemble_get_int(GKeyFile *kf, const gchar *key, gint dflt)
+{
+	GError *error = NULL;
+	gint val;
+
+	val = g_key_file_get_integer(kf, ENSEMBLE_GROUP, key, &error);
+	if (error) {
+		g_error_free(error);
+		return dflt;
+	}
+
+	return val;
+}
+
+/* Expand the sweep into its runs, the last parameter varying fastest */
+static gboolean ensemble_load(Ensemble *ens, const gchar *spec)
+{
+	const gdouble dflt[ENSEMBLE_NUM_PARAMS] = {
+		[ENSEMBLE_AVOID]      = AVOID_DIST_DFLT,
+		[ENSEMBLE_ALIGN]      = ALIGN_DIST_DFLT,
+		[ENSEMBLE_COHESION]   = COHESION_DIST_DFLT,
+		[ENSEMBLE_DEAD_ANGLE] = DEFAULT_DEAD_ANGLE,
+		[ENSEMBLE_SPEED]      = DEFAULT_SPEED,
+	};
+	gdouble *values[ENSEMBLE_NUM_PARAMS];
+	gsize num[ENSEMBLE_NUM_PARAMS];
+	GError *error = NULL;
+	GKeyFile *kf;
+	guint repeats;
+	guint seed;
+	guint r, p, n;
+
+	kf = g_key_file_new();
+	if (!g_key_file_load_from_file(kf, spec, G_KEY_FILE_NONE, &error)) {
+		g_fprintf(stderr, "Failed to read %s: %s\n", spec,
+			  error->message);
+		g_error_free(error);
+		g_key_file_free(kf);
+		return FALSE;
+	}
+
+	ens->num_boids = CLAMP(ensemble_get_int(kf, "boids", DEFAULT_NUM_BOIDS),
+			       MIN_BOIDS, MAX_BOIDS);
+	ens->steps = MAX(ensemble_get_int(kf, "steps", ENSEMBLE_STEPS_DFLT), 1);
+	ens->width = CLAMP(ensemble_get_int(kf, "width", DEFAULT_WIDTH),
+			   1, WORLD_SIZE_MAX);
+	ens->height = CLAMP(ensemble_get_int(kf, "height", DEFAULT_HEIGHT),
+			    1, WORLD_SIZE_MAX);
+	repeats = MAX(ensemble_get_int(kf, "repeats", 1), 1);
+	seed = ensemble_get_int(kf, "seed", 1);
+
+	ens->num_runs = repeats;
+	for (p = 0; p < ENSEMBLE_NUM_PARAMS; p++) {
+		values[p] = ensemble_get_values(kf, p, dflt[p], &num[p]);
+		ens->num_runs *= num[p];
+	}
+
+	ens->runs = g_new0(EnsembleRun, ens->num_runs);
+	for (r = 0; r < ens->num_runs; r++) {
+		n = r / repeats;
+		for (p = ENSEMBLE_NUM_PARAMS; p-- > 0;) {
+			ens->runs[r].param[p] = values[p][n % num[p]];
+			n /= num[p];
+		}
+		ens->runs[r].seed = seed + r % repeats;
+	}
+
+	for (p = 0; p < ENSEMBLE_NUM_PARAMS; p++)
+		g_free(values[p]);
+	g_key_file_free(kf);
+
+	return TRUE;
+}
+
+static gboolean ensemble_write(Ensemble *ens, const gchar *output)
+{
+	EnsembleRun *r;
+	FILE *f;
+	guint i, p;
+
+	f = fopen(output, "w");
+	if (!f) {
+		g_fprintf(stderr, "Failed to write %s\n", output);
+		return FALSE;
+	}
+
+	g_fprintf(f, "run");
+	for (p = 0; p < ENSEMBLE_NUM_PARAMS; p++)
+		g_fprintf(f, "\t%s", ensemble_param_names[p]);
+	g_fprintf(f, "\tseed\tpolarization\tflocks\tlargest_flock\tms_per_step\n");
+
+	for (i = 0; i < ens->num_runs; i++) {
+		r = &ens->runs[i];
+
+		g_fprintf(f, "%u", i);
+		for (p = 0; p < ENSEMBLE_NUM_PARAMS; p++)
+			g_fprintf(f, "\t%g", r->param[p]);
+		g_fprintf(f, "\t%u\t%.4f\t%u\t%.4f\t%.3f\n", r->seed,
+			  r->polarization, r->flocks, r->largest_flock,
+			  r->ms_per_step);
+	}
+
+	fclose(f);
+
+	return TRUE;
+}
+
+int ensemble_run(const gchar *spec, const gchar *output, guint num_threads)
+{
+	Ensemble ens = { 0 };
+	EnsembleWorker *workers;
+	GThread **threads;
+	gint64 start;
+	guint t;
+	int ret = 0;
+
+	if (!ensemble_load(&ens, spec))
+		return -1;
+
+	ens.num_threads = CLAMP(num_threads, 1, ens.num_runs);
+	ens.queues = g_new0(EnsembleQueue, ens.num_threads);
+	workers = g_new0(EnsembleWorker, ens.num_threads);
+	threads = g_new0(GThread *, ens.num_threads);
+	g_mutex_init(&ens.init_lock);
+
+	for (t = 0; t < ens.num_threads; t++) {
+		g_mutex_init(&ens.queues[t].lock);
+		ens.queues[t].next = ens.num_runs * t / ens.num_threads;
+		ens.queues[t].end = ens.num_runs * (t + 1) / ens.num_threads;
+		workers[t].ens = &ens;
+		workers[t].id = t;
+	}
+
+	g_printf("Runs: %u, Boids: %u, Steps: %u, Threads: %u\n", ens.num_runs,
+		 ens.num_boids, ens.steps, ens.num_threads);
+
+	start = g_get_monotonic_time();
+
+	for (t = 0; t < ens.num_threads; t++)
+		threads[t] = g_thread_new("ensemble", ensemble_worker,
+					  &workers[t]);
+	for (t = 0; t < ens.num_threads; t++)
+		g_thread_join(threads[t]);
+
+	g_printf("Time: %.1f s\n",
+		 (gdouble)(g_get_monotonic_time() - start) / G_USEC_PER_SEC);
+
+	if (!ensemble_write(&ens, output))
+		ret = -1;
+
+	for (t = 0; t < ens.num_threads; t++)
+		g_mutex_clear(&ens.queues[t].lock);
+	g_mutex_clear(&ens.init_lock);
+	g_free(ens.queues);
+	g_free(workers);
+	g_free(threads);
+	g_free(ens.runs);
+
+	return ret;
+}
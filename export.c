@@ -0,0 +1,129 @@
+/* SPDX-License-Identifier: MIT */
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "boids.h"
+
+/* Live state export, see export.h for the layout */
+
+struct _Export {
+	gchar *name;
+	ExportHeader *hdr;
+	gsize size;
+};
+
+gboolean export_start(Swarm *swarm, const gchar *name)
+{
+	Export *exp;
+	ExportHeader *hdr;
+	gsize frame_size;
+	gsize size;
+	gint fd;
+
+	/* Frames of 8 byte aligned size, for the step counts */
+	frame_size = sizeof(ExportFrame) + sizeof(ExportBoid) * MAX_BOIDS;
+	frame_size = (frame_size + 7) & ~(gsize)7;
+	size = sizeof(ExportHeader) + EXPORT_NUM_FRAMES * frame_size;
+
+	/* Don't take over the export of another instance */
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0 && errno == EEXIST) {
+		g_fprintf(stderr, "The export %s already exists, remove it "
+			  "from /dev/shm if no other instance uses it\n", name);
+		return FALSE;
+	}
+	if (fd < 0 || ftruncate(fd, size) < 0) {
+		g_fprintf(stderr, "Failed to create the export %s: %s\n", name,
+			  g_strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+			shm_unlink(name);
+		}
+		return FALSE;
+	}
+
+	hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		g_fprintf(stderr, "Failed to map the export %s: %s\n", name,
+			  g_strerror(errno));
+		shm_unlink(name);
+		return FALSE;
+	}
+
+	hdr->version = EXPORT_VERSION;
+	hdr->num_frames = EXPORT_NUM_FRAMES;
+	hdr->max_boids = MAX_BOIDS;
+	hdr->frame_offset = sizeof(ExportHeader);
+	hdr->frame_size = frame_size;
+	hdr->head = 0;
+	/* Readers check the magic last */
+	__atomic_store_n(&hdr->magic, EXPORT_MAGIC, __ATOMIC_RELEASE);
+
+	exp = g_new0(Export, 1);
+	exp->name = g_strdup(name);
+	exp->hdr = hdr;
+	exp->size = size;
+
+	swarm->export = exp;
+
+	return TRUE;
+}
+
+/*
+ * Copy the boids in the next frame of the ring. The frame sequence count is
+ * odd while the frame is written so the readers can tell a torn frame.
+ */
+void export_publish(Swarm *swarm)
+{
+	ExportHeader *hdr = swarm->export->hdr;
+	ExportFrame *frame = export_frame(hdr, hdr->head);
+	ExportBoid *e;
+	Boid *b;
+	guint32 seq = frame->seq;
+	guint i;
+
+	TRACE_BEGIN("export");
+
+	__atomic_store_n(&frame->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	frame->num_boids = swarm_get_num_boids(swarm);
+	/* The boids gathered from the domains are one step behind */
+	frame->step = swarm->domains ? swarm->step - 1 : swarm->step;
+	frame->width = swarm->width;
+	frame->height = swarm->height;
+
+	for (i = 0; i < frame->num_boids; i++) {
+		b = swarm_get_boid(swarm, i);
+		e = &frame->boids[i];
+		e->id = b->id;
+		e->x = b->pos.x;
+		e->y = b->pos.y;
+		e->vx = b->velocity.x;
+		e->vy = b->velocity.y;
+	}
+
+	__atomic_store_n(&frame->seq, seq + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&hdr->head, hdr->head + 1, __ATOMIC_RELEASE);
+
+	TRACE_END("export");
+}
+
+void export_stop(Swarm *swarm)
+{
+	Export *exp = swarm->export;
+
+	if (!exp)
+		return;
+
+	munmap(exp->hdr, exp->size);
+	shm_unlink(exp->name);
+	g_free(exp->name);
+	g_free(exp);
+
+	swarm->export = NULL;
+}
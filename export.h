@@ -0,0 +1,81 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef __EXPORT_H__
+#define __EXPORT_H__
+
+#include <glib.h>
+
+/*
+ * Layout of the live state exported with --export NAME, for the tools
+ * mapping the POSIX shared memory object NAME read-only.
+ *
+ * The object starts with an ExportHeader followed by num_frames frames of
+ * frame_size bytes, the first one at frame_offset. The frames form a ring:
+ * each completed step is written in the frame following the last one and
+ * head is then set to the number of frames written so far. The last
+ * complete frame is (head - 1) % num_frames.
+ *
+ * The writer never waits for the readers. Each frame is protected by a
+ * sequence count, odd while the frame is written: a reader reads the frame
+ * in place between export_read_begin() and export_read_retry() and starts
+ * again if the frame was overwritten meanwhile.
+ */
+
+#define EXPORT_MAGIC      0x53444942	/* "BIDS" */
+#define EXPORT_VERSION    1
+#define EXPORT_NUM_FRAMES 4
+
+typedef struct {
+	guint32 id;
+	gfloat x;
+	gfloat y;
+	gfloat vx;
+	gfloat vy;
+} ExportBoid;
+
+typedef struct {
+	guint32 seq;
+	guint32 num_boids;
+	guint64 step;
+	guint32 width;
+	guint32 height;
+	ExportBoid boids[];
+} ExportFrame;
+
+typedef struct {
+	guint32 magic;
+	guint32 version;
+	guint32 num_frames;
+	guint32 max_boids;
+	guint64 frame_offset;
+	guint64 frame_size;
+	guint64 head;
+} ExportHeader;
+
+static inline ExportFrame *export_frame(ExportHeader *hdr, guint64 n)
+{
+	return (ExportFrame *)((guchar *)hdr + hdr->frame_offset +
+			       (n % hdr->num_frames) * hdr->frame_size);
+}
+
+/* Last complete frame, NULL before the first one */
+static inline ExportFrame *export_last_frame(ExportHeader *hdr)
+{
+	guint64 head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+
+	return head ? export_frame(hdr, head - 1) : NULL;
+}
+
+static inline guint32 export_read_begin(ExportFrame *frame)
+{
+	return __atomic_load_n(&frame->seq, __ATOMIC_ACQUIRE);
+}
+
+/* TRUE if the frame changed since export_read_begin() returned seq */
+static inline gboolean export_read_retry(ExportFrame *frame, guint32 seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return (seq & 1) || __atomic_load_n(&frame->seq, __ATOMIC_RELAXED) != seq;
+}
+
+#endif /* __EXPORT_H__ */
@@ -0,0 +1,242 @@
+/* SPDX-License-Identifier: MIT */
+#include "boids.h"
+
+/*
+ * Uniform grid spatial index.
+ * Boid indices are bucketed by cell with a counting sort so the build is
+ * linear in the number of boids. The boids of cell c are then
+ * cell_boids[cell_start[c]] to cell_boids[cell_start[c + 1] - 1].
+ *
+ * The cells are stretched so that they tile the world exactly. On a
+ * periodic grid, the cells past an edge are then the cells of the opposite
+ * edge and the neighbor searches wrap around at no extra cost.
+ */
+
+static inline gint grid_coord(gdouble v, gdouble cell_size, gint max)
+{
+	gint c = v / cell_size;
+
+	if (c < 0)
+		return 0;
+	if (c >= max)
+		return max - 1;
+
+	return c;
+}
+
+void grid_build(Grid *grid, GArray *boids, gint width, gint height,
+		gdouble cell_size, gboolean periodic)
+{
+	guint num_boids = boids->len;
+	guint num_cells;
+	guint i;
+	guint c;
+	Boid *b;
+
+	grid->cols = MAX(1, (gint)(width / cell_size));
+	grid->rows = MAX(1, (gint)(height / cell_size));
+	grid->cell_w = (gdouble)width / grid->cols;
+	grid->cell_h = (gdouble)height / grid->rows;
+	grid->cell_size = MIN(grid->cell_w, grid->cell_h);
+	grid->periodic = periodic;
+
+	/* Cell offsets reaching each cell exactly once on a periodic grid */
+	grid->wrap_cols[0] = (grid->cols - 1) / 2;
+	grid->wrap_cols[1] = grid->cols - 1 - grid->wrap_cols[0];
+	grid->wrap_rows[0] = (grid->rows - 1) / 2;
+	grid->wrap_rows[1] = grid->rows - 1 - grid->wrap_rows[0];
+
+	if (periodic)
+		grid->max_ring = MAX(grid->wrap_cols[1], grid->wrap_rows[1]);
+	else
+		grid->max_ring = MAX(grid->cols, grid->rows);
+
+	num_cells = grid->cols * grid->rows;
+
+	if (num_cells + 1 > grid->cells_alloc) {
+		grid->cells_alloc = num_cells + 1;
+		grid->cell_start = g_renew(guint, grid->cell_start,
+					   grid->cells_alloc);
+	}
+
+	if (num_boids > grid->boids_alloc) {
+		grid->boids_alloc = num_boids;
+		grid->cell_boids = g_renew(guint, grid->cell_boids,
+					   grid->boids_alloc);
+		grid->boid_cell = g_renew(guint, grid->boid_cell,
+					  grid->boids_alloc);
+	}
+
+	memset(grid->cell_start, 0, sizeof(guint) * (num_cells + 1));
+
+	for (i = 0; i < num_boids; i++) {
+		b = &g_array_index(boids, Boid, i);
+		c = grid_coord(b->pos.y, grid->cell_h, grid->rows) * grid->cols +
+		    grid_coord(b->pos.x, grid->cell_w, grid->cols);
+		grid->boid_cell[i] = c;
+		grid->cell_start[c + 1]++;
+	}
+
+	for (c = 0; c < num_cells; c++)
+		grid->cell_start[c + 1] += grid->cell_start[c];
+
+	/* cell_start[c] is used as insertion cursor then restored */
+	for (i = 0; i < num_boids; i++)
+		grid->cell_boids[grid->cell_start[grid->boid_cell[i]]++] = i;
+
+	for (c = num_cells; c > 0; c--)
+		grid->cell_start[c] = grid->cell_start[c - 1];
+	grid->cell_start[0] = 0;
+}
+
+void grid_get_cell(Grid *grid, gdouble x, gdouble y, gint *col, gint *row)
+{
+	*col = grid_coord(x, grid->cell_w, grid->cols);
+	*row = grid_coord(y, grid->cell_h, grid->rows);
+}
+
+#define grid_sat(grid, col, row) \
+	(&(grid)->sat[(row) * ((grid)->cols + 1) + (col)])
+
+/*
+ * Aggregate the boids of each cell and build the summed-area table so
+ * the aggregate of any range of cells is obtained with 4 lookups.
+ * sat(col, row) holds the sum of the cells above and left of (col, row).
+ * grid_build() must have been called first.
+ */
+void grid_build_aggregates(Grid *grid, GArray *boids)
+{
+	guint num_cells = grid->cols * grid->rows;
+	guint num_sat = (grid->cols + 1) * (grid->rows + 1);
+	CellAggregate *a;
+	CellAggregate *s;
+	Boid *b;
+	guint i;
+	gint col, row;
+
+	if (num_sat > grid->aggregates_alloc) {
+		grid->aggregates_alloc = num_sat;
+		grid->cells = g_renew(CellAggregate, grid->cells, num_sat);
+		grid->sat = g_renew(CellAggregate, grid->sat, num_sat);
+	}
+
+	memset(grid->cells, 0, sizeof(CellAggregate) * num_cells);
+
+	for (i = 0; i < boids->len; i++) {
+		b = &g_array_index(boids, Boid, i);
+		a = &grid->cells[grid->boid_cell[i]];
+
+		a->count++;
+		vector_add(&a->pos, &b->pos);
+		vector_add(&a->velocity, &b->velocity);
+	}
+
+	memset(grid->sat, 0, sizeof(CellAggregate) * (grid->cols + 1));
+
+	for (row = 0; row < grid->rows; row++) {
+		memset(grid_sat(grid, 0, row + 1), 0, sizeof(CellAggregate));
+
+		for (col = 0; col < grid->cols; col++) {
+			s = grid_sat(grid, col + 1, row + 1);
+
+			*s = grid->cells[grid_cell_index(grid, col, row)];
+			cell_aggregate_add(s, grid_sat(grid, col + 1, row));
+			cell_aggregate_add(s, grid_sat(grid, col, row + 1));
+			cell_aggregate_sub(s, grid_sat(grid, col, row));
+		}
+	}
+}
+
+static void grid_aggregate_range(Grid *grid, gdouble x0, gdouble y0,
+				 gdouble x1, gdouble y1, CellAggregate *agg)
+{
+	gint c0, r0, c1, r1;
+
+	grid_get_cell(grid, x0, y0, &c0, &r0);
+	grid_get_cell(grid, x1, y1, &c1, &r1);
+
+	*agg = *grid_sat(grid, c1 + 1, r1 + 1);
+	cell_aggregate_sub(agg, grid_sat(grid, c0, r1 + 1));
+	cell_aggregate_sub(agg, grid_sat(grid, c1 + 1, r0));
+	cell_aggregate_add(agg, grid_sat(grid, c0, r0));
+}
+
+/*
+ * Split [v0, v1] into at most 2 ranges inside [0, size). Each range comes
+ * with the shift to apply to the positions it contains to bring them back
+ * next to v0.
+ */
+static gint grid_wrap_range(gdouble v0, gdouble v1, gdouble size,
+			    gdouble range[2][3])
+{
+	gdouble k;
+
+	if (v1 - v0 >= size) {
+		range[0][0] = 0;
+		range[0][1] = size;
+		range[0][2] = 0;
+		return 1;
+	}
+
+	k = floor(v0 / size) * size;
+	v0 -= k;
+	v1 -= k;
+
+	range[0][0] = v0;
+	range[0][1] = MIN(v1, size);
+	range[0][2] = k;
+
+	if (v1 < size)
+		return 1;
+
+	range[1][0] = 0;
+	range[1][1] = v1 - size;
+	range[1][2] = k + size;
+
+	return 2;
+}
+
+/*
+ * Aggregate of the cells overlapping the box (x0, y0) (x1, y1). On a
+ * periodic grid the box wraps around the edges and the aggregated positions
+ * are unwrapped next to the box. Otherwise the box is clamped to the grid.
+ */
+void grid_aggregate_box(Grid *grid, gdouble x0, gdouble y0,
+			gdouble x1, gdouble y1, CellAggregate *agg)
+{
+	gdouble xr[2][3];
+	gdouble yr[2][3];
+	CellAggregate a;
+	gint nx, ny;
+	gint i, j;
+
+	if (!grid->periodic) {
+		grid_aggregate_range(grid, x0, y0, x1, y1, agg);
+		return;
+	}
+
+	nx = grid_wrap_range(x0, x1, grid->cols * grid->cell_w, xr);
+	ny = grid_wrap_range(y0, y1, grid->rows * grid->cell_h, yr);
+
+	memset(agg, 0, sizeof(*agg));
+
+	for (j = 0; j < ny; j++) {
+		for (i = 0; i < nx; i++) {
+			grid_aggregate_range(grid, xr[i][0], yr[j][0],
+					     xr[i][1], yr[j][1], &a);
+			a.pos.x += a.count * xr[i][2];
+			a.pos.y += a.count * yr[j][2];
+			cell_aggregate_add(agg, &a);
+		}
+	}
+}
+
+void grid_free(Grid *grid)
+{
+	g_free(grid->cell_start);
+	g_free(grid->cell_boids);
+	g_free(grid->boid_cell);
+	g_free(grid->cells);
+	g_free(grid->sat);
+	memset(grid, 0, sizeof(*grid));
+}
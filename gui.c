@@ -5,6 +5,63 @@
 #include "boids.h"
 
 #define DEBUG_VECT_FACTOR 20
+/* Boids showing their steering vectors, by id */
+#define DEBUG_VECT_BOIDS  10
+
+#define CAMERA_ZOOM_MAX  8.0
+#define CAMERA_ZOOM_STEP 1.25
+/* Boids drawn around their position, in world units */
+#define BOID_DRAW_MARGIN 4
+
+/* View pixels per side of a density bin */
+#define HEATMAP_BIN 4
+/* Visible boids per view pixel switching the auto render to the heatmap */
+#define HEATMAP_AUTO_DENSITY 0.05
+
+/*
+ * Scales of the drawing surfaces against the view. In auto, the scale is
+ * changed by a step once the draw time was over the frame budget, or well
+ * under it, for RENDER_SCALE_AUTO_FRAMES frames in a row.
+ */
+#define RENDER_SCALE_MIN         0.25
+#define RENDER_SCALE_STEP        0.25
+#define RENDER_SCALE_AUTO_FRAMES 30
+
+/* Row bands of the boids surface drawn in parallel */
+#define RENDER_BANDS_MAX       16
+#define RENDER_BAND_MIN_HEIGHT 64
+
+typedef enum {
+	RENDER_AUTO = 0,
+	RENDER_BOIDS,
+	RENDER_HEATMAP,
+} RenderMode;
+
+/*
+ * Rows y0..y0 + height of the boids surface, with its own surface over
+ * them so it can be drawn by another thread, and the boids to draw there.
+ */
+typedef struct {
+	gint y0;
+	gint height;
+	cairo_surface_t *surface;
+	cairo_t *cr;
+	GArray *boids;
+} RenderBand;
+
+/*
+ * What gui_draw() reads of the swarm, copied so that the swarm can move on
+ * while it is drawn
+ */
+typedef struct {
+	GArray *boids;
+	GArray *obstacles;
+	gint width;
+	gint height;
+	gdouble speed;
+	/* Index in boids of the boids showing their steering vectors */
+	guint debug_index[DEBUG_VECT_BOIDS];
+} RenderFrame;
 
 typedef struct {
 	GtkApplication *app;
@@ -35,29 +92,123 @@ typedef struct {
 	gboolean running;
 
 	Swarm *swarm;
+	/* When set, the changes made to the swarm are recorded */
+	ScenarioRecord *record;
+
+	/*
+	 * While running, a frame is drawn by the render thread from the
+	 * previous step while the swarm computes the next one
+	 */
+	RenderFrame frame;
+	GThreadPool *render_pool;
+	GMutex render_lock;
+	GCond render_done;
+	gboolean render_pending;
+	gint64 render_time;
+
+	/*
+	 * Camera over the world: world point at the top left of the view and
+	 * view pixels per world unit. Unless the world size is fixed, it
+	 * follows the view size.
+	 */
+	gboolean fixed_world;
+	gint view_width;
+	gint view_height;
+	gdouble view_x;
+	gdouble view_y;
+	gdouble zoom;
+
+	/*
+	 * The surfaces are drawn at render_scale of the view size and scaled
+	 * up in on_draw()
+	 */
+	gdouble render_scale;
+	gboolean auto_scale;
+	gint scale_votes;
+	gboolean panning;
+	gdouble pan_x;
+	gdouble pan_y;
+	gboolean bg_dirty;
+
+	/* Frame index of the boids to draw, the visible ones */
+	GArray *visible;
+
+	/*
+	 * Density and heading sums of the visible boids binned at reduced
+	 * resolution, color mapped into heatmap_surface
+	 */
+	RenderMode render_mode;
+	gboolean heatmap;
+	cairo_surface_t *heatmap_surface;
+	gint heat_cols;
+	gint heat_rows;
+	guint *heat_count;
+	gfloat *heat_vx;
+	gfloat *heat_vy;
+
+	/* The boid bands are drawn by the calling thread and the pool */
+	RenderBand *bands;
+	guint num_bands;
+	guint max_bands;
+	gint band_height;
+	GThreadPool *band_pool;
+	GMutex band_lock;
+	GCond band_done;
+	guint bands_pending;
 
 	GtkWidget *timing_label;
 	gulong compute_time;
 	gulong draw_time;
+	gulong frame_time;
 	gint64 update_label_time;
 } BoidsGui;
 
+static inline Boid *gui_get_boid(BoidsGui *gui, guint n)
+{
+	return &g_array_index(gui->frame.boids, Boid, n);
+}
+
+/* Surface pixels per world unit */
+static inline gdouble gui_render_zoom(BoidsGui *gui)
+{
+	return gui->zoom * gui->render_scale;
+}
+
 static void gui_draw_obstacles(BoidsGui *gui)
 {
-	int i;
+	GArray *obstacles = gui->frame.obstacles;
+	guint i;
 
 	cairo_set_source_rgba(gui->cr, 0.3, 0.3, 0.3, 1.0);
-	for (i = 0; i < swarm_num_obstacles(gui->swarm); i++) {
-		Obstacle *o = swarm_get_obstacle(gui->swarm, i);
+	for (i = 0; i < obstacles->len; i++) {
+		Obstacle *o = &g_array_index(obstacles, Obstacle, i);
 
 		if (o->type == OBSTACLE_TYPE_WALL ||
 		    o->type == OBSTACLE_TYPE_SCARY_MOUSE ||
-		    o->type == OBSTACLE_TYPE_PREDATOR)
+		    o->type == OBSTACLE_TYPE_PREDATOR ||
+		    o->shape == OBSTACLE_SHAPE_SEGMENT)
 			continue;
 
 		cairo_arc(gui->cr, o->pos.x, o->pos.y, OBSTACLE_RADIUS, 0, 2 * G_PI);
 		cairo_fill(gui->cr);
 	}
+
+	/* All the polygon segments in one stroke */
+	for (i = 0; i < obstacles->len; i++) {
+		Obstacle *o = &g_array_index(obstacles, Obstacle, i);
+
+		if (o->shape != OBSTACLE_SHAPE_SEGMENT)
+			continue;
+
+		cairo_move_to(gui->cr, o->pos.x, o->pos.y);
+		cairo_line_to(gui->cr, o->end.x, o->end.y);
+	}
+
+	cairo_save(gui->cr);
+	cairo_set_line_width(gui->cr, OBSTACLE_RADIUS / 2);
+	cairo_set_line_cap(gui->cr, CAIRO_LINE_CAP_ROUND);
+	cairo_stroke(gui->cr);
+	cairo_restore(gui->cr);
 }
 
 static void gui_draw_boid(cairo_t *cr, Boid *b)
@@ -80,6 +231,139 @@ static void gui_draw_boid(cairo_t *cr, Boid *b)
 	cairo_stroke(cr);
 }
 
+static void gui_hsv_to_rgb(gdouble h, gdouble s, gdouble v, gdouble rgb[3])
+{
+	gdouble f = h * 6 - floor(h * 6);
+	gdouble p = v * (1 - s);
+	gdouble q = v * (1 - s * f);
+	gdouble t = v * (1 - s * (1 - f));
+	gdouble sectors[6][3] = {
+		{ v, t, p }, { q, v, p }, { p, v, t },
+		{ p, q, v }, { t, p, v }, { v, p, q },
+	};
+	gint i = (gint)(h * 6) % 6;
+
+	memcpy(rgb, sectors[i], sizeof(sectors[i]));
+}
+
+/*
+ * Draw the boids as a density texture instead of one by one.
+ * The visible boids are binned with a few additions each, then each bin
+ * is colored: the opacity grows with the log of the boid count, the hue
+ * gives the mean heading and the saturation how aligned the boids are.
+ */
+static void gui_draw_heatmap(BoidsGui *gui)
+{
+	gint cols = gui->heat_cols;
+	gint rows = gui->heat_rows;
+	gdouble scale = gui_render_zoom(gui) / HEATMAP_BIN;
+	gdouble speed = gui->frame.speed;
+	gdouble rgb[3];
+	gdouble norm;
+	gdouble a, h, sat;
+	guint max_count = 0;
+	guint32 *row;
+	guchar *data;
+	gint stride;
+	gint x, y, c;
+	guint i;
+	Boid *b;
+
+	memset(gui->heat_count, 0, sizeof(guint) * cols * rows);
+	memset(gui->heat_vx, 0, sizeof(gfloat) * cols * rows);
+	memset(gui->heat_vy, 0, sizeof(gfloat) * cols * rows);
+
+	TRACE_BEGIN("bin");
+	for (i = 0; i < gui->visible->len; i++) {
+		b = gui_get_boid(gui, g_array_index(gui->visible, guint, i));
+		x = floor((b->pos.x - gui->view_x) * scale);
+		y = floor((b->pos.y - gui->view_y) * scale);
+		if (x < 0 || x >= cols || y < 0 || y >= rows)
+			continue;
+
+		c = y * cols + x;
+		gui->heat_count[c]++;
+		gui->heat_vx[c] += b->velocity.x;
+		gui->heat_vy[c] += b->velocity.y;
+	}
+
+	for (c = 0; c < cols * rows; c++)
+		max_count = MAX(max_count, gui->heat_count[c]);
+	TRACE_END("bin");
+
+	TRACE_BEGIN("colormap");
+	norm = max_count ? 1 / log1p(max_count) : 0;
+
+	cairo_surface_flush(gui->heatmap_surface);
+	data = cairo_image_surface_get_data(gui->heatmap_surface);
+	stride = cairo_image_surface_get_stride(gui->heatmap_surface);
+
+	for (y = 0; y < rows; y++) {
+		row = (guint32 *)(data + y * stride);
+
+		for (x = 0; x < cols; x++) {
+			c = y * cols + x;
+			if (!gui->heat_count[c]) {
+				row[x] = 0;
+				continue;
+			}
+
+			a = 0.3 + 0.7 * log1p(gui->heat_count[c]) * norm;
+			h = atan2(gui->heat_vy[c], gui->heat_vx[c]) / (2 * G_PI) + 0.5;
+			sat = hypot(gui->heat_vx[c], gui->heat_vy[c]) /
+			      (gui->heat_count[c] * speed);
+			gui_hsv_to_rgb(h, CLAMP(sat, 0, 1), 0.9, rgb);
+
+			/* Premultiplied ARGB */
+			row[x] = (guint32)(a * 255) << 24 |
+				 (guint32)(a * rgb[0] * 255) << 16 |
+				 (guint32)(a * rgb[1] * 255) << 8 |
+				 (guint32)(a * rgb[2] * 255);
+		}
+	}
+
+	cairo_surface_mark_dirty(gui->heatmap_surface);
+	TRACE_END("colormap");
+
+	cairo_save(gui->boids_cr);
+	cairo_identity_matrix(gui->boids_cr);
+	cairo_scale(gui->boids_cr, HEATMAP_BIN, HEATMAP_BIN);
+	cairo_set_source_surface(gui->boids_cr, gui->heatmap_surface, 0, 0);
+	cairo_pattern_set_filter(cairo_get_source(gui->boids_cr),
+				 CAIRO_FILTER_FAST);
+	cairo_set_operator(gui->boids_cr, CAIRO_OPERATOR_SOURCE);
+	cairo_paint(gui->boids_cr);
+	cairo_restore(gui->boids_cr);
+}
+
+/*
+ * In auto mode, switch to the heatmap when the visible boids are too dense
+ * to be told apart, and back when they are much less dense.
+ */
+static gboolean gui_use_heatmap(BoidsGui *gui)
+{
+	gdouble density;
+
+	switch (gui->render_mode) {
+	case RENDER_BOIDS:
+		gui->heatmap = FALSE;
+		break;
+	case RENDER_HEATMAP:
+		gui->heatmap = TRUE;
+		break;
+	default:
+		density = (gdouble)gui->visible->len /
+			  (gui->view_width * gui->view_height);
+		if (gui->heatmap)
+			gui->heatmap = (density > HEATMAP_AUTO_DENSITY / 2);
+		else
+			gui->heatmap = (density > HEATMAP_AUTO_DENSITY);
+		break;
+	}
+
+	return gui->heatmap;
+}
+
 static void gui_draw_predator(BoidsGui *gui)
 {
 	gdouble predator_rgb[][3] = {
@@ -88,13 +372,19 @@ static void gui_draw_predator(BoidsGui *gui)
 		[BG_COLOR_GREENISH] = { 1.0, 0.0, 0.8 },
 		[BG_COLOR_BLUISH]   = { 1.0, 1.0, 0.0 },
 	};
-	Obstacle *predator;
+	GArray *obstacles = gui->frame.obstacles;
+	Obstacle *predator = NULL;
 	Vector top;
 	Vector bottom;
 	Vector length;
 	gdouble *rgb;
+	guint i;
 
-	predator = swarm_get_obstacle_by_type(gui->swarm, OBSTACLE_TYPE_PREDATOR);
+	for (i = 0; i < obstacles->len && !predator; i++) {
+		if (g_array_index(obstacles, Obstacle, i).type ==
+		    OBSTACLE_TYPE_PREDATOR)
+			predator = &g_array_index(obstacles, Obstacle, i);
+	}
 	if (!predator)
 		return;
 
@@ -114,6 +404,93 @@ static void gui_draw_predator(BoidsGui *gui)
 	cairo_stroke(gui->boids_cr);
 }
 
+static void gui_set_camera(BoidsGui *gui, cairo_t *cr, gdouble zoom)
+{
+	cairo_identity_matrix(cr);
+	cairo_scale(cr, zoom, zoom);
+	cairo_translate(cr, -gui->view_x, -gui->view_y);
+}
+
+static void gui_screen_to_world(BoidsGui *gui, gdouble *x, gdouble *y)
+{
+	*x = *x / gui->zoom + gui->view_x;
+	*y = *y / gui->zoom + gui->view_y;
+}
+
+/*
+ * Keep the zoom between showing the whole world and CAMERA_ZOOM_MAX, and
+ * the view inside the world. A world smaller than the view is centered.
+ */
+static void gui_camera_clamp(BoidsGui *gui)
+{
+	gdouble min_zoom;
+	gdouble w, h;
+	gint width, height;
+
+	swarm_get_sizes(gui->swarm, &width, &height);
+
+	min_zoom = MIN((gdouble)gui->view_width / width,
+		       (gdouble)gui->view_height / height);
+	gui->zoom = CLAMP(gui->zoom, MIN(min_zoom, 1.0), CAMERA_ZOOM_MAX);
+
+	w = gui->view_width / gui->zoom;
+	h = gui->view_height / gui->zoom;
+
+	if (w >= width)
+		gui->view_x = (width - w) / 2;
+	else
+		gui->view_x = CLAMP(gui->view_x, 0, width - w);
+
+	if (h >= height)
+		gui->view_y = (height - h) / 2;
+	else
+		gui->view_y = CLAMP(gui->view_y, 0, height - h);
+}
+
+static void gui_camera_changed(BoidsGui *gui)
+{
+	gui_camera_clamp(gui);
+
+	/* The trails are in view space, restart them */
+	cairo_save(gui->boids_cr);
+	cairo_set_operator(gui->boids_cr, CAIRO_OPERATOR_CLEAR);
+	cairo_paint(gui->boids_cr);
+	cairo_restore(gui->boids_cr);
+
+	gui_set_camera(gui, gui->cr, gui_render_zoom(gui));
+	gui_set_camera(gui, gui->boids_cr, gui_render_zoom(gui));
+	gui->bg_dirty = TRUE;
+}
+
+/* Zoom by factor keeping the world point under (x, y) in the view */
+static void gui_camera_zoom(BoidsGui *gui, gdouble x, gdouble y,
+			    gdouble factor)
+{
+	gdouble wx = x, wy = y;
+
+	gui_screen_to_world(gui, &wx, &wy);
+
+	gui->zoom *= factor;
+	gui_camera_clamp(gui);
+
+	gui->view_x = wx - x / gui->zoom;
+	gui->view_y = wy - y / gui->zoom;
+	gui_camera_changed(gui);
+}
+
+static void gui_camera_reset(BoidsGui *gui)
+{
+	gui->zoom = 1;
+	gui->view_x = 0;
+	gui->view_y = 0;
+
+	/* A fixed world larger than the view is shown whole at first */
+	if (gui->fixed_world)
+		gui->zoom = 0;
+
+	gui_camera_changed(gui);
+}
+
 static void gui_draw_background(BoidsGui *gui)
 {
 	gdouble rgb[3];
@@ -123,12 +500,17 @@ static void gui_draw_background(BoidsGui *gui)
 	int bg_color;
 	cairo_t *bg_cr;
 	cairo_pattern_t *pattern = NULL;
-	int width, height;
-
-	swarm_get_sizes(gui->swarm, &width, &height);
+	int width = gui->frame.width;
+	int height = gui->frame.height;
 
 	bg_cr = cairo_create(gui->bg_surface);
 
+	/* Out of the world, when it is smaller than the view */
+	cairo_set_source_rgb(bg_cr, 0.15, 0.15, 0.15);
+	cairo_paint(bg_cr);
+
+	gui_set_camera(gui, bg_cr, gui_render_zoom(gui));
+
 	/*
 	 * Get the dominant color
 	 * The 2 others vary with x and y, from .2 to .7
@@ -200,16 +582,211 @@ static void gui_draw_background(BoidsGui *gui)
 	cairo_pattern_destroy(pattern);
 
 	cairo_destroy(bg_cr);
+
+	gui->bg_dirty = FALSE;
+}
+
+/*
+ * When the view shows only a part of the world, only the boids within the
+ * view box are drawn. A single pass over the positions is cheaper than
+ * building an index of the frame for one query.
+ */
+static void gui_get_visible_boids(BoidsGui *gui)
+{
+	RenderFrame *frame = &gui->frame;
+	Boid *b;
+	gdouble x0 = gui->view_x - BOID_DRAW_MARGIN;
+	gdouble y0 = gui->view_y - BOID_DRAW_MARGIN;
+	gdouble x1 = gui->view_x + gui->view_width / gui->zoom + BOID_DRAW_MARGIN;
+	gdouble y1 = gui->view_y + gui->view_height / gui->zoom + BOID_DRAW_MARGIN;
+	guint i;
+
+	g_array_set_size(gui->visible, 0);
+
+	if (x0 <= 0 && y0 <= 0 && x1 >= frame->width && y1 >= frame->height) {
+		for (i = 0; i < frame->boids->len; i++)
+			g_array_append_val(gui->visible, i);
+		return;
+	}
+
+	TRACE_BEGIN("cull");
+	for (i = 0; i < frame->boids->len; i++) {
+		b = gui_get_boid(gui, i);
+		if (b->pos.x >= x0 && b->pos.x <= x1 &&
+		    b->pos.y >= y0 && b->pos.y <= y1)
+			g_array_append_val(gui->visible, i);
+	}
+	TRACE_END("cull");
+}
+
+/*
+ * A boid is drawn in all the bands its BOID_DRAW_MARGIN crosses, each band
+ * clipping it to its rows.
+ */
+static void gui_bin_boids(BoidsGui *gui)
+{
+	gdouble zoom = gui_render_zoom(gui);
+	gdouble margin = BOID_DRAW_MARGIN * zoom;
+	gdouble y;
+	gint first, last, k;
+	guint i, idx;
+
+	for (k = 0; k < (gint)gui->num_bands; k++)
+		g_array_set_size(gui->bands[k].boids, 0);
+
+	for (i = 0; i < gui->visible->len; i++) {
+		idx = g_array_index(gui->visible, guint, i);
+		y = (gui_get_boid(gui, idx)->pos.y - gui->view_y) * zoom;
+
+		first = MAX(floor((y - margin) / gui->band_height), 0);
+		last = MIN(floor((y + margin) / gui->band_height),
+			   (gint)gui->num_bands - 1);
+
+		for (k = first; k <= last; k++)
+			g_array_append_val(gui->bands[k].boids, idx);
+	}
+}
+
+/* Fade the trails of the band, then draw its boids unless in heatmap */
+static void gui_draw_band(BoidsGui *gui, RenderBand *band)
+{
+	cairo_t *cr = band->cr;
+	guint i;
+
+	cairo_save(cr);
+	cairo_set_operator(cr, gui->boids_cr_operator);
+	cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, gui->boids_cr_alpha);
+	cairo_paint(cr);
+	cairo_restore(cr);
+
+	cairo_identity_matrix(cr);
+	cairo_translate(cr, 0, -band->y0);
+	cairo_scale(cr, gui_render_zoom(gui), gui_render_zoom(gui));
+	cairo_translate(cr, -gui->view_x, -gui->view_y);
+
+	for (i = 0; i < band->boids->len; i++)
+		gui_draw_boid(cr, gui_get_boid(gui,
+					g_array_index(band->boids, guint, i)));
+
+	cairo_surface_flush(band->surface);
+}
+
+static void gui_band_worker(gpointer data, gpointer user_data)
+{
+	BoidsGui *gui = user_data;
+
+	gui_draw_band(gui, data);
+
+	g_mutex_lock(&gui->band_lock);
+	if (!--gui->bands_pending)
+		g_cond_signal(&gui->band_done);
+	g_mutex_unlock(&gui->band_lock);
+}
+
+/*
+ * The bands write directly in the rows of the boids surface, there is
+ * nothing to composite once they are all drawn.
+ */
+static void gui_draw_bands(BoidsGui *gui, gboolean heatmap)
+{
+	guint k;
+
+	if (heatmap) {
+		for (k = 0; k < gui->num_bands; k++)
+			g_array_set_size(gui->bands[k].boids, 0);
+	} else {
+		TRACE_BEGIN("bin");
+		gui_bin_boids(gui);
+		TRACE_END("bin");
+	}
+
+	cairo_surface_flush(gui->boids_surface);
+
+	gui->bands_pending = gui->num_bands - 1;
+	for (k = 1; k < gui->num_bands; k++)
+		g_thread_pool_push(gui->band_pool, &gui->bands[k], NULL);
+
+	gui_draw_band(gui, &gui->bands[0]);
+
+	g_mutex_lock(&gui->band_lock);
+	while (gui->bands_pending)
+		g_cond_wait(&gui->band_done, &gui->band_lock);
+	g_mutex_unlock(&gui->band_lock);
+
+	cairo_surface_mark_dirty(gui->boids_surface);
+}
+
+static void gui_free_bands(BoidsGui *gui)
+{
+	guint k;
+
+	for (k = 0; k < gui->num_bands; k++) {
+		cairo_destroy(gui->bands[k].cr);
+		cairo_surface_destroy(gui->bands[k].surface);
+		g_array_free(gui->bands[k].boids, TRUE);
+	}
+	g_free(gui->bands);
+	gui->bands = NULL;
+	gui->num_bands = 0;
+}
+
+/* Split the boids surface in bands of at least RENDER_BAND_MIN_HEIGHT rows */
+static void gui_init_bands(BoidsGui *gui)
+{
+	gint width = cairo_image_surface_get_width(gui->boids_surface);
+	gint height = cairo_image_surface_get_height(gui->boids_surface);
+	gint stride = cairo_image_surface_get_stride(gui->boids_surface);
+	guchar *data = cairo_image_surface_get_data(gui->boids_surface);
+	RenderBand *band;
+	guint k;
+
+	gui_free_bands(gui);
+
+	gui->num_bands = CLAMP(height / RENDER_BAND_MIN_HEIGHT, 1,
+			       gui->max_bands);
+	gui->band_height = MAX((height + gui->num_bands - 1) / gui->num_bands,
+			       1);
+	/* Rounding up may leave the last bands without rows */
+	gui->num_bands = MAX((height + gui->band_height - 1) / gui->band_height,
+			     1);
+	gui->bands = g_new0(RenderBand, gui->num_bands);
+
+	for (k = 0; k < gui->num_bands; k++) {
+		band = &gui->bands[k];
+		band->y0 = k * gui->band_height;
+		band->height = MIN(gui->band_height, height - band->y0);
+		band->surface = cairo_image_surface_create_for_data(
+					data + (gsize)band->y0 * stride,
+					CAIRO_FORMAT_ARGB32, width,
+					band->height, stride);
+		band->cr = cairo_create(band->surface);
+		band->boids = g_array_new(FALSE, FALSE, sizeof(guint));
+	}
 }
 
 static void gui_draw(BoidsGui *gui)
 {
-	int i;
+	gboolean heatmap;
 
+	TRACE_BEGIN("gui_draw");
+
+	if (gui->bg_dirty)
+		gui_draw_background(gui);
+
+	TRACE_BEGIN("background");
+	cairo_save(gui->cr);
+	cairo_identity_matrix(gui->cr);
 	cairo_set_source_surface(gui->cr, gui->bg_surface, 0, 0);
 	cairo_paint(gui->cr);
+	cairo_restore(gui->cr);
+	TRACE_END("background");
 
+	TRACE_BEGIN("obstacles");
 	gui_draw_obstacles(gui);
+	TRACE_END("obstacles");
+
+	gui_get_visible_boids(gui);
+	heatmap = gui_use_heatmap(gui);
 
 	/*
 	 * Draw the boid trail effect.
@@ -222,22 +799,26 @@ static void gui_draw(BoidsGui *gui)
 	 * If the swarm is not running, the operator is set to CLEAR with full
 	 * opacity. This will erase the boid trails when the swarm is stopped.
 	 * See gui_set_boids_draw_operator()
+	 * Both are done band by band in parallel, see gui_draw_bands().
 	 */
-	cairo_save(gui->boids_cr);
-	cairo_set_operator(gui->boids_cr, gui->boids_cr_operator);
-	cairo_set_source_rgba(gui->boids_cr, 1.0, 1.0, 1.0, gui->boids_cr_alpha);
-	cairo_paint(gui->boids_cr);
-	cairo_restore(gui->boids_cr);
+	TRACE_BEGIN("boids");
+	gui_draw_bands(gui, heatmap);
 
-	for (i = 0; i < swarm_get_num_boids(gui->swarm); i++) {
-		Boid *b = swarm_get_boid(gui->swarm, i);
-		gui_draw_boid(gui->boids_cr, b);
-	}
+	if (heatmap)
+		gui_draw_heatmap(gui);
 
 	gui_draw_predator(gui);
+	TRACE_END("boids");
 
+	TRACE_BEGIN("composite");
+	cairo_save(gui->cr);
+	cairo_identity_matrix(gui->cr);
 	cairo_set_source_surface(gui->cr, gui->boids_surface, 0, 0);
 	cairo_paint(gui->cr);
+	cairo_restore(gui->cr);
+	TRACE_END("composite");
+
+	TRACE_END("gui_draw");
 }
 
 static void gui_set_boids_draw_operator(BoidsGui *gui)
@@ -253,23 +834,137 @@ static void gui_set_boids_draw_operator(BoidsGui *gui)
 
 static void gui_set_bg_color(BoidsGui *gui, gint bg_color)
 {
-	if (bg_color < BG_COLOR_MIN || bg_color > BG_COLOR_MAX)
-		bg_color = g_random_int_range(BG_COLOR_RND_MIN,
-					      BG_COLOR_RND_MAX + 1);
+	GRand *rand;
+
+	/* Not from g_random, the boids of a replayed scenario depend on it */
+	if (bg_color < BG_COLOR_MIN || bg_color > BG_COLOR_MAX) {
+		rand = g_rand_new();
+		bg_color = g_rand_int_range(rand, BG_COLOR_RND_MIN,
+					    BG_COLOR_RND_MAX + 1);
+		g_rand_free(rand);
+	}
 
 	gui->bg_color = bg_color;
 }
 
+static void gui_record(BoidsGui *gui, const gchar *key)
+{
+	if (gui->record)
+		scenario_record(gui->record, gui->swarm, key);
+}
+
+static void gui_snapshot(BoidsGui *gui)
+{
+	Swarm *swarm = gui->swarm;
+	RenderFrame *frame = &gui->frame;
+	guint i;
+
+	TRACE_BEGIN("snapshot");
+	g_array_set_size(frame->boids, swarm_get_num_boids(swarm));
+	memcpy(frame->boids->data, swarm->boids->data,
+	       sizeof(Boid) * frame->boids->len);
+
+	g_array_set_size(frame->obstacles, swarm_num_obstacles(swarm));
+	memcpy(frame->obstacles->data, swarm->obstacles->data,
+	       sizeof(Obstacle) * frame->obstacles->len);
+
+	for (i = 0; i < DEBUG_VECT_BOIDS && i < frame->boids->len; i++)
+		frame->debug_index[i] = swarm->boid_index[i];
+
+	swarm_get_sizes(swarm, &frame->width, &frame->height);
+	frame->speed = swarm_get_speed(swarm);
+	TRACE_END("snapshot");
+}
+
+/* Draw the current swarm right away */
+static void gui_redraw(BoidsGui *gui)
+{
+	gui_snapshot(gui);
+	gui_draw(gui);
+}
+
+static void gui_render_worker(gpointer data, gpointer user_data)
+{
+	BoidsGui *gui = user_data;
+	gint64 start = g_get_monotonic_time();
+
+	gui_draw(gui);
+	gui->render_time = g_get_monotonic_time() - start;
+
+	g_mutex_lock(&gui->render_lock);
+	gui->render_pending = FALSE;
+	g_cond_signal(&gui->render_done);
+	g_mutex_unlock(&gui->render_lock);
+}
+
+/*
+ * Draw the current swarm in the render thread. Until gui_render_wait(),
+ * only the swarm can be changed.
+ */
+static void gui_render_start(BoidsGui *gui)
+{
+	gui_snapshot(gui);
+
+	gui->render_pending = TRUE;
+	g_thread_pool_push(gui->render_pool, gui, NULL);
+}
+
+static void gui_render_wait(BoidsGui *gui)
+{
+	g_mutex_lock(&gui->render_lock);
+	while (gui->render_pending)
+		g_cond_wait(&gui->render_done, &gui->render_lock);
+	g_mutex_unlock(&gui->render_lock);
+}
+
 static void gui_update(BoidsGui *gui)
 {
 	if (!gui->running) {
-		gui_draw(gui);
+		gui_redraw(gui);
 		gtk_widget_queue_draw(gui->drawing_area);
 	}
 }
 
 #define DELAY 20000
 
+static void gui_init(BoidsGui *gui);
+
+static void gui_set_render_scale(BoidsGui *gui, gdouble scale)
+{
+	if (scale == gui->render_scale)
+		return;
+
+	gui->render_scale = scale;
+	gui->scale_votes = 0;
+
+	/* Once the view size is known */
+	if (gui->surface)
+		gui_init(gui);
+}
+
+/*
+ * The draw time is taken as growing with the surface area, the scale is
+ * raised only if it should still fit in 3/4 of the budget.
+ */
+static void gui_auto_render_scale(BoidsGui *gui, gint64 draw_time)
+{
+	gdouble scale = gui->render_scale;
+	gdouble next = MIN(scale + RENDER_SCALE_STEP, 1.0);
+
+	if (draw_time > DELAY)
+		gui->scale_votes = MIN(gui->scale_votes, 0) - 1;
+	else if (scale < 1 && draw_time * POW2(next / scale) < DELAY * 3 / 4)
+		gui->scale_votes = MAX(gui->scale_votes, 0) + 1;
+	else
+		gui->scale_votes = 0;
+
+	if (gui->scale_votes <= -RENDER_SCALE_AUTO_FRAMES)
+		gui_set_render_scale(gui, MAX(scale - RENDER_SCALE_STEP,
+					      RENDER_SCALE_MIN));
+	else if (gui->scale_votes >= RENDER_SCALE_AUTO_FRAMES)
+		gui_set_render_scale(gui, next);
+}
+
 static gboolean gui_animate(BoidsGui *gui)
 {
 	static gint64 last_time = 0;
@@ -287,28 +982,60 @@ static gboolean gui_animate(BoidsGui *gui)
 
 	last_time = now;
 
-	swarm_move(gui->swarm);
-	compute_time = g_get_monotonic_time() - now;
+	TRACE_BEGIN("gui_animate");
 
-	gui_draw(gui);
-	draw_time = g_get_monotonic_time() - now - compute_time;
+	/*
+	 * While running, the shown frame is one step late: the current step
+	 * is drawn while the next one is computed. A single step is shown
+	 * once computed.
+	 */
+	if (gui->running) {
+		gui_render_start(gui);
+		swarm_move(gui->swarm);
+		compute_time = g_get_monotonic_time() - now;
+		gui_render_wait(gui);
+	} else {
+		swarm_move(gui->swarm);
+		compute_time = g_get_monotonic_time() - now;
+		gui_render_start(gui);
+		gui_render_wait(gui);
+	}
+	draw_time = gui->render_time;
+
+	if (gui->auto_scale)
+		gui_auto_render_scale(gui, draw_time);
 
 	if (swarm_show_debug_controls(gui->swarm)) {
 		curr_time = g_get_monotonic_time();
-		total_time = compute_time + draw_time;
+		total_time = curr_time - now;
 
 		if (curr_time - gui->update_label_time > G_USEC_PER_SEC ||
-		    total_time > gui->compute_time + gui->draw_time) {
-			gchar label[32];
+		    total_time > gui->frame_time) {
+			gchar label[80];
+			gint len;
 
 			gui->update_label_time = curr_time;
 			gui->compute_time = compute_time;
 			gui->draw_time = draw_time;
-
-			g_snprintf(label, 32, "c: %2ldms d: %2ldms %ld fps",
-				   compute_time / 1000,
-				   draw_time / 1000,
-				   total_time ? 1000000 / total_time : 0);
+			gui->frame_time = total_time;
+
+			len = g_snprintf(label, sizeof(label),
+					 "c: %2ldms d: %2ldms %ld fps",
+					 compute_time / 1000,
+					 draw_time / 1000,
+					 total_time ? 1000000 / total_time : 0);
+
+			if (perf_enabled) {
+				PerfStats stats;
+				guint n = swarm_get_num_boids(gui->swarm);
+
+				perf_get_last(PERF_PHASE_STEP, &stats);
+				g_snprintf(label + len, sizeof(label) - len,
+					   " IPC: %.2f L1D: %.1f LLC: %.1f /boid",
+					   perf_ipc(&stats),
+					   perf_per_boid(&stats, PERF_L1D_MISSES, n),
+					   perf_per_boid(&stats, PERF_LLC_MISSES, n));
+			}
 
 			gtk_label_set_text(GTK_LABEL(gui->timing_label), label);
 		}
@@ -316,23 +1043,26 @@ static gboolean gui_animate(BoidsGui *gui)
 
 	gtk_widget_queue_draw(gui->drawing_area);
 
+	TRACE_END("gui_animate");
+
 	return TRUE;
 }
 
 static void gui_init(BoidsGui *gui)
 {
-	gint width;
-	gint height;
-
-	swarm_get_sizes(gui->swarm, &width, &height);
+	gint width = MAX(ceil(gui->view_width * gui->render_scale), 1);
+	gint height = MAX(ceil(gui->view_height * gui->render_scale), 1);
 
 	cairo_destroy(gui->cr);
 	cairo_surface_destroy(gui->surface);
 
+	/* Over the rows of the boids surface */
+	gui_free_bands(gui);
 	cairo_destroy(gui->boids_cr);
 	cairo_surface_destroy(gui->boids_surface);
 
 	cairo_surface_destroy(gui->bg_surface);
+	cairo_surface_destroy(gui->heatmap_surface);
 
 	gui->surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
 						  width, height);
@@ -342,15 +1072,28 @@ static void gui_init(BoidsGui *gui)
 							width, height);
 
 	gui->boids_cr = cairo_create(gui->boids_surface);
+	gui_init_bands(gui);
 
 	gui->bg_surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
 						     width, height);
 
+	gui->heat_cols = (width + HEATMAP_BIN - 1) / HEATMAP_BIN;
+	gui->heat_rows = (height + HEATMAP_BIN - 1) / HEATMAP_BIN;
+	gui->heatmap_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+							  gui->heat_cols,
+							  gui->heat_rows);
+	gui->heat_count = g_renew(guint, gui->heat_count,
+				  gui->heat_cols * gui->heat_rows);
+	gui->heat_vx = g_renew(gfloat, gui->heat_vx,
+			       gui->heat_cols * gui->heat_rows);
+	gui->heat_vy = g_renew(gfloat, gui->heat_vy,
+			       gui->heat_cols * gui->heat_rows);
+
 	gui_set_boids_draw_operator(gui);
 
-	gui_draw_background(gui);
+	gui_camera_changed(gui);
 
-	gui_draw(gui);
+	gui_redraw(gui);
 }
 
 static gboolean gui_hide_mouse_cursor(BoidsGui *gui)
@@ -425,14 +1168,23 @@ static void gui_simulation_stop(BoidsGui *gui)
 
 static void on_draw(GtkDrawingArea *da, cairo_t *cr, BoidsGui *gui)
 {
+	TRACE_BEGIN("on_draw");
+
+	cairo_save(cr);
+	cairo_scale(cr, 1 / gui->render_scale, 1 / gui->render_scale);
 	cairo_set_source_surface(cr, gui->surface, 0, 0);
+	cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_BILINEAR);
 	cairo_paint(cr);
+	cairo_restore(cr);
 
 	if (swarm_show_debug_vectors(gui->swarm)) {
 		int i;
 
-		for (i = 0; i < 10 && i < swarm_get_num_boids(gui->swarm); i++) {
-			Boid *b = swarm_get_boid(gui->swarm, i);
+		gui_set_camera(gui, cr, gui->zoom);
+
+		/* From the frame drawn, the swarm may be one step ahead */
+		for (i = 0; i < DEBUG_VECT_BOIDS && i < gui->frame.boids->len; i++) {
+			Boid *b = gui_get_boid(gui, gui->frame.debug_index[i]);
 			Vector v = b->pos;
 			Vector avoid, align, cohes, obst, veloc;
 
@@ -483,6 +1235,8 @@ static void on_draw(GtkDrawingArea *da, cairo_t *cr, BoidsGui *gui)
 			cairo_stroke(cr);
 		}
 	}
+
+	TRACE_END("on_draw");
 }
 
 static void on_start_clicked(GtkButton *button, BoidsGui *gui)
@@ -509,6 +1263,7 @@ static void on_avoid_clicked(GtkToggleButton *button, BoidsGui *gui)
 	gboolean active = gtk_toggle_button_get_active(button);
 
 	swarm_set_rule_active(gui->swarm, RULE_AVOID, active);
+	gui_record(gui, "avoid");
 }
 
 static void on_align_clicked(GtkToggleButton *button, BoidsGui *gui)
@@ -516,6 +1271,7 @@ static void on_align_clicked(GtkToggleButton *button, BoidsGui *gui)
 	gboolean active = gtk_toggle_button_get_active(button);
 
 	swarm_set_rule_active(gui->swarm, RULE_ALIGN, active);
+	gui_record(gui, "align");
 }
 
 static void on_cohesion_clicked(GtkToggleButton *button, BoidsGui *gui)
@@ -523,11 +1279,13 @@ static void on_cohesion_clicked(GtkToggleButton *button, BoidsGui *gui)
 	gboolean active = gtk_toggle_button_get_active(button);
 
 	swarm_set_rule_active(gui->swarm, RULE_COHESION, active);
+	gui_record(gui, "cohesion");
 }
 
 static void on_walls_clicked(GtkToggleButton *button, BoidsGui *gui)
 {
 	swarm_set_walls_enable(gui->swarm, gtk_toggle_button_get_active(button));
+	gui_record(gui, "walls");
 
 	gui_update(gui);
 }
@@ -541,9 +1299,29 @@ static void on_bg_color_changed(GtkComboBox *combo, BoidsGui *gui)
 	gui_update(gui);
 }
 
+static void on_render_mode_changed(GtkComboBox *combo, BoidsGui *gui)
+{
+	gui->render_mode = gtk_combo_box_get_active(combo);
+
+	gui_update(gui);
+}
+
+/* Auto first, then from 1 down to RENDER_SCALE_MIN by RENDER_SCALE_STEP */
+static void on_render_scale_changed(GtkComboBox *combo, BoidsGui *gui)
+{
+	gint active = gtk_combo_box_get_active(combo);
+
+	gui->auto_scale = !active;
+	if (active)
+		gui_set_render_scale(gui, 1 - (active - 1) * RENDER_SCALE_STEP);
+
+	gui_update(gui);
+}
+
 static void on_num_boids_changed(GtkSpinButton *spin, BoidsGui *gui)
 {
 	swarm_set_num_boids(gui->swarm, gtk_spin_button_get_value_as_int(spin));
+	gui_record(gui, "boids");
 
 	gui_update(gui);
 }
@@ -552,22 +1330,50 @@ static void on_dead_angle_clicked(GtkToggleButton *button, BoidsGui *gui)
 {
 	swarm_set_rule_active(gui->swarm, RULE_DEAD_ANGLE,
 			      gtk_toggle_button_get_active(button));
+	gui_record(gui, "dead_angle");
 }
 
 static void on_dead_angle_changed(GtkSpinButton *spin, BoidsGui *gui)
 {
 	swarm_set_dead_angle(gui->swarm, gtk_spin_button_get_value_as_int(spin));
+	gui_record(gui, "dead_angle");
 }
 
 static void on_speed_changed(GtkSpinButton *spin, BoidsGui *gui)
 {
 	swarm_set_speed(gui->swarm, gtk_spin_button_get_value(spin));
+	gui_record(gui, "speed");
+}
+
+static void on_interaction_changed(GtkComboBox *combo, BoidsGui *gui)
+{
+	swarm_set_interaction_mode(gui->swarm, gtk_combo_box_get_active(combo));
+	gui_record(gui, "interaction");
+}
+
+static void on_neighbor_index_changed(GtkComboBox *combo, BoidsGui *gui)
+{
+	swarm_set_neighbor_index(gui->swarm, gtk_combo_box_get_active(combo));
+	gui_record(gui, "index");
+}
+
+static void on_steer_interval_changed(GtkSpinButton *spin, BoidsGui *gui)
+{
+	swarm_set_steer_interval(gui->swarm, gtk_spin_button_get_value_as_int(spin));
+	gui_record(gui, "steer_interval");
+}
+
+static void on_knn_changed(GtkSpinButton *spin, BoidsGui *gui)
+{
+	swarm_set_knn(gui->swarm, gtk_spin_button_get_value_as_int(spin));
+	gui_record(gui, "knn");
 }
 
 static void on_mouse_mode_clicked(GtkToggleButton *button, BoidsGui *gui,
 				  MouseMode mode)
 {
 	swarm_set_mouse_mode(gui->swarm, mode);
+	gui_record(gui, "mouse_mode");
 }
 
 static void on_mouse_mode_none_clicked(GtkToggleButton *button, BoidsGui *gui)
@@ -598,37 +1404,84 @@ static gboolean on_mouse_event(GtkWidget *da, GdkEvent *event, BoidsGui *gui)
 	case GDK_BUTTON_PRESS:
 		x = event->button.x;
 		y = event->button.y;
+
+		/* Middle or right button drags the camera */
+		if (event->button.button == 2 || event->button.button == 3) {
+			gui->panning = TRUE;
+			gui->pan_x = x;
+			gui->pan_y = y;
+			return TRUE;
+		}
+
 		button1 = (event->button.button == 1);
 		control = ((event->button.state & GDK_CONTROL_MASK) != 0);
 		break;
+	case GDK_BUTTON_RELEASE:
+		if (event->button.button == 2 || event->button.button == 3)
+			gui->panning = FALSE;
+		return FALSE;
 	case GDK_MOTION_NOTIFY:
 		gui_show_mouse_cursor(gui);
 		x = event->motion.x;
 		y = event->motion.y;
+
+		if (gui->panning) {
+			gui->view_x -= (x - gui->pan_x) / gui->zoom;
+			gui->view_y -= (y - gui->pan_y) / gui->zoom;
+			gui->pan_x = x;
+			gui->pan_y = y;
+			gui_camera_changed(gui);
+			gui_update(gui);
+			return TRUE;
+		}
+
 		button1 = ((event->motion.state & GDK_BUTTON1_MASK) != 0);
 		control = ((event->motion.state & GDK_CONTROL_MASK) != 0);
 		break;
+	case GDK_SCROLL:
+		if (event->scroll.direction == GDK_SCROLL_UP)
+			gui_camera_zoom(gui, event->scroll.x, event->scroll.y,
+					CAMERA_ZOOM_STEP);
+		else if (event->scroll.direction == GDK_SCROLL_DOWN)
+			gui_camera_zoom(gui, event->scroll.x, event->scroll.y,
+					1 / CAMERA_ZOOM_STEP);
+		gui_update(gui);
+		return TRUE;
 	case GDK_ENTER_NOTIFY:
 		x = event->motion.x;
 		y = event->motion.y;
 		break;
 	case GDK_LEAVE_NOTIFY:
-		x = -1000;
-		y = -1000;
-		break;
+		if (gui->swarm->scenario)
+			return FALSE;
+		swarm_set_mouse_pos(gui->swarm, -1000, -1000);
+		gui_record(gui, "mouse");
+		return FALSE;
 	default:
 		return FALSE;
 	}
 
+	/* The scenario being replayed drives the mouse */
+	if (gui->swarm->scenario)
+		return FALSE;
+
+	gui_screen_to_world(gui, &x, &y);
 	swarm_set_mouse_pos(gui->swarm, x, y);
+	gui_record(gui, "mouse");
 
 	if (!button1)
 		return FALSE;
 
-	if (control)
-		swarm_remove_obstacle(gui->swarm, x, y);
-	else
+	if (control) {
+		if (swarm_remove_obstacle(gui->swarm, x, y) && gui->record)
+			scenario_record_obstacle(gui->record, gui->swarm,
+						 x, y, TRUE);
+	} else {
 		swarm_add_obstacle(gui->swarm, x, y, OBSTACLE_TYPE_IN_FIELD);
+		if (gui->record)
+			scenario_record_obstacle(gui->record, gui->swarm,
+						 x, y, FALSE);
+	}
 
 	gui_update(gui);
 
@@ -644,6 +1497,7 @@ static void on_predator_clicked(GtkToggleButton *button, BoidsGui *gui)
 	gtk_widget_set_sensitive(GTK_WIDGET(gui->walls_check), !enable);
 
 	swarm_set_predator_enable(gui->swarm, enable);
+	gui_record(gui, "predator");
 
 	gui_update(gui);
 }
@@ -656,16 +1510,19 @@ static void on_debug_vectors_clicked(GtkToggleButton *button, BoidsGui *gui)
 static void on_avoid_dist_changed(GtkSpinButton *spin, BoidsGui *gui)
 {
 	swarm_set_rule_dist(gui->swarm, RULE_AVOID, gtk_spin_button_get_value_as_int(spin));
+	gui_record(gui, "avoid_dist");
 }
 
 static void on_align_dist_changed(GtkSpinButton *spin, BoidsGui *gui)
 {
 	swarm_set_rule_dist(gui->swarm, RULE_ALIGN, gtk_spin_button_get_value_as_int(spin));
+	gui_record(gui, "align_dist");
 }
 
 static void on_cohesion_dist_changed(GtkSpinButton *spin, BoidsGui *gui)
 {
 	swarm_set_rule_dist(gui->swarm, RULE_COHESION, gtk_spin_button_get_value_as_int(spin));
+	gui_record(gui, "cohesion_dist");
 }
 
 static void on_destroy(GtkWindow *win, BoidsGui *gui)
@@ -676,7 +1533,15 @@ static void on_destroy(GtkWindow *win, BoidsGui *gui)
 static gboolean on_configure_event(GtkWidget *widget, GdkEventConfigure *event,
 				   BoidsGui *gui)
 {
-	swarm_set_sizes(gui->swarm, event->width, event->height);
+	gui->view_width = event->width;
+	gui->view_height = event->height;
+
+	if (!gui->fixed_world) {
+		swarm_set_sizes(gui->swarm, event->width, event->height);
+		gui_record(gui, "width");
+		gui_record(gui, "height");
+	}
+
 	gui_init(gui);
 
 	return FALSE;
@@ -734,6 +1599,10 @@ static gboolean on_keypress(GtkWidget *widget, GdkEventKey *event,
 	case GDK_KEY_KP_Subtract:
 		g_signal_emit_by_name(G_OBJECT(gui->num_boids_spin), "change-value", GTK_SCROLL_STEP_DOWN);
 		return TRUE;
+	case GDK_KEY_Home:
+		gui_camera_reset(gui);
+		gui_update(gui);
+		return TRUE;
 	default:
 		return FALSE;
 	}
@@ -809,6 +1678,7 @@ static void gui_activate(GtkApplication* app, BoidsGui *gui)
 	GtkWidget *combo;
 	GtkAdjustment *adj;
 	gboolean active;
+	gdouble scale;
 	gint width;
 	gint height;
 
@@ -828,12 +1698,15 @@ static void gui_activate(GtkApplication* app, BoidsGui *gui)
 	drawing_area = gtk_drawing_area_new();
 	gui->drawing_area = g_object_ref(drawing_area);
 	swarm_get_sizes(gui->swarm, &width, &height);
-	gtk_widget_set_size_request(drawing_area, width, height);
+	gtk_widget_set_size_request(drawing_area, MIN(width, DEFAULT_WIDTH),
+				    MIN(height, DEFAULT_HEIGHT));
 	gtk_box_pack_start(GTK_BOX(main_vbox), drawing_area, TRUE, TRUE, 0);
 	g_signal_connect(G_OBJECT(drawing_area), "draw",
 			 G_CALLBACK(on_draw), gui);
 	gtk_widget_add_events(drawing_area, GDK_STRUCTURE_MASK |
 					    GDK_BUTTON_PRESS_MASK |
+					    GDK_BUTTON_RELEASE_MASK |
+					    GDK_SCROLL_MASK |
 					    GDK_POINTER_MOTION_MASK |
 					    GDK_ENTER_NOTIFY_MASK |
 					    GDK_LEAVE_NOTIFY_MASK);
@@ -841,6 +1714,10 @@ static void gui_activate(GtkApplication* app, BoidsGui *gui)
 			 G_CALLBACK(on_configure_event), gui);
 	g_signal_connect(G_OBJECT(drawing_area), "button-press-event",
 			 G_CALLBACK(on_mouse_event), gui);
+	g_signal_connect(G_OBJECT(drawing_area), "button-release-event",
+			 G_CALLBACK(on_mouse_event), gui);
+	g_signal_connect(G_OBJECT(drawing_area), "scroll-event",
+			 G_CALLBACK(on_mouse_event), gui);
 	g_signal_connect(G_OBJECT(drawing_area), "motion-notify-event",
 			 G_CALLBACK(on_mouse_event), gui);
 	g_signal_connect(G_OBJECT(drawing_area), "enter-notify-event",
@@ -916,6 +1793,35 @@ static void gui_activate(GtkApplication* app, BoidsGui *gui)
 			 G_CALLBACK(on_bg_color_changed), gui);
 	gtk_box_pack_start(GTK_BOX(hbox), combo, FALSE, FALSE, 0);
 
+	label = gtk_label_new("Render:");
+	gtk_box_pack_start(GTK_BOX(hbox), label, FALSE, FALSE, 0);
+
+	combo = gtk_combo_box_text_new();
+	gtk_combo_box_text_insert(GTK_COMBO_BOX_TEXT(combo), RENDER_AUTO, NULL, "Auto");
+	gtk_combo_box_text_insert(GTK_COMBO_BOX_TEXT(combo), RENDER_BOIDS, NULL, "Boids");
+	gtk_combo_box_text_insert(GTK_COMBO_BOX_TEXT(combo), RENDER_HEATMAP, NULL, "Density");
+	gtk_combo_box_set_active(GTK_COMBO_BOX(combo), gui->render_mode);
+	g_signal_connect(G_OBJECT(combo), "changed",
+			 G_CALLBACK(on_render_mode_changed), gui);
+	gtk_box_pack_start(GTK_BOX(hbox), combo, FALSE, FALSE, 0);
+
+	label = gtk_label_new("Scale:");
+	gtk_box_pack_start(GTK_BOX(hbox), label, FALSE, FALSE, 0);
+
+	combo = gtk_combo_box_text_new();
+	gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(combo), "Auto");
+	for (scale = 1; scale >= RENDER_SCALE_MIN; scale -= RENDER_SCALE_STEP) {
+		gchar text[8];
+
+		g_snprintf(text, sizeof(text), "%d%%", (gint)(scale * 100));
+		gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(combo), text);
+	}
+	gtk_combo_box_set_active(GTK_COMBO_BOX(combo), gui->auto_scale ? 0 :
+		(gint)round((1 - gui->render_scale) / RENDER_SCALE_STEP) + 1);
+	g_signal_connect(G_OBJECT(combo), "changed",
+			 G_CALLBACK(on_render_scale_changed), gui);
+	gtk_box_pack_start(GTK_BOX(hbox), combo, FALSE, FALSE, 0);
+
 	hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
 	gtk_box_set_spacing(GTK_BOX(hbox), 5);
 	gtk_box_pack_start(GTK_BOX(vbox), hbox, FALSE, FALSE, 0);
@@ -973,6 +1879,49 @@ static void gui_activate(GtkApplication* app, BoidsGui *gui)
 	gtk_box_pack_start(GTK_BOX(hbox), spin, FALSE, FALSE, 0);
 	gui->speed_spin = spin;
 
+	label = gtk_label_new("Neighbors:");
+	gtk_label_set_xalign(GTK_LABEL(label), 1.0);
+	gtk_box_pack_start(GTK_BOX(hbox), label, FALSE, FALSE, 0);
+
+	combo = gtk_combo_box_text_new();
+	gtk_combo_box_text_insert(GTK_COMBO_BOX_TEXT(combo), INTERACTION_METRIC, NULL, "All");
+	gtk_combo_box_text_insert(GTK_COMBO_BOX_TEXT(combo), INTERACTION_TOPOLOGICAL, NULL, "Nearest k");
+	gtk_combo_box_text_insert(GTK_COMBO_BOX_TEXT(combo), INTERACTION_APPROXIMATE, NULL, "Approximate");
+	gtk_combo_box_set_active(GTK_COMBO_BOX(combo), swarm_get_interaction_mode(gui->swarm));
+	g_signal_connect(G_OBJECT(combo), "changed",
+			 G_CALLBACK(on_interaction_changed), gui);
+	gtk_box_pack_start(GTK_BOX(hbox), combo, FALSE, FALSE, 0);
+
+	label = gtk_label_new("k:");
+	gtk_box_pack_start(GTK_BOX(hbox), label, FALSE, FALSE, 0);
+
+	spin = gtk_spin_button_new_with_range(KNN_MIN, KNN_MAX, 1);
+	gtk_spin_button_set_value(GTK_SPIN_BUTTON(spin), swarm_get_knn(gui->swarm));
+	g_signal_connect(G_OBJECT(spin), "value-changed",
+			 G_CALLBACK(on_knn_changed), gui);
+	gtk_box_pack_start(GTK_BOX(hbox), spin, FALSE, FALSE, 0);
+
+	label = gtk_label_new("Index:");
+	gtk_box_pack_start(GTK_BOX(hbox), label, FALSE, FALSE, 0);
+
+	combo = gtk_combo_box_text_new();
+	gtk_combo_box_text_insert(GTK_COMBO_BOX_TEXT(combo), NEIGHBOR_INDEX_BRUTE_FORCE, NULL, "Brute force");
+	gtk_combo_box_text_insert(GTK_COMBO_BOX_TEXT(combo), NEIGHBOR_INDEX_VERLET, NULL, "Verlet lists");
+	gtk_combo_box_text_insert(GTK_COMBO_BOX_TEXT(combo), NEIGHBOR_INDEX_QUADTREE, NULL, "Quadtree");
+	gtk_combo_box_set_active(GTK_COMBO_BOX(combo), swarm_get_neighbor_index(gui->swarm));
+	g_signal_connect(G_OBJECT(combo), "changed",
+			 G_CALLBACK(on_neighbor_index_changed), gui);
+	gtk_box_pack_start(GTK_BOX(hbox), combo, FALSE, FALSE, 0);
+
+	label = gtk_label_new("Steer every:");
+	gtk_box_pack_start(GTK_BOX(hbox), label, FALSE, FALSE, 0);
+
+	spin = gtk_spin_button_new_with_range(1, STEER_INTERVAL_MAX, 1);
+	gtk_spin_button_set_value(GTK_SPIN_BUTTON(spin), swarm_get_steer_interval(gui->swarm));
+	g_signal_connect(G_OBJECT(spin), "value-changed",
+			 G_CALLBACK(on_steer_interval_changed), gui);
+	gtk_box_pack_start(GTK_BOX(hbox), spin, FALSE, FALSE, 0);
+
 	hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
 	gtk_box_set_spacing(GTK_BOX(hbox), 5);
 	gtk_box_pack_start(GTK_BOX(vbox), hbox, FALSE, FALSE, 0);
@@ -1016,15 +1965,40 @@ static void gui_activate(GtkApplication* app, BoidsGui *gui)
 		gui_simulation_start(gui);
 }
 
-int gui_run(Swarm *swarm, int bg_color, gboolean start)
+int gui_run(Swarm *swarm, int bg_color, gboolean start, gboolean fixed_world,
+	    ScenarioRecord *record, gdouble render_scale)
 {
 	BoidsGui *gui;
 
 	gui = g_malloc0(sizeof(*gui));
 	gui->swarm = swarm;
+	gui->record = record;
 	gui->running = start;
+	gui->fixed_world = fixed_world;
+	gui->zoom = fixed_world ? 0 : 1;
+	/* 0 for auto, starting at full scale */
+	gui->auto_scale = render_scale <= 0;
+	gui->render_scale = gui->auto_scale ? 1 :
+		CLAMP(round(render_scale / RENDER_SCALE_STEP) * RENDER_SCALE_STEP,
+		      RENDER_SCALE_MIN, 1);
+	gui->visible = g_array_new(FALSE, FALSE, sizeof(guint));
 	gui_set_bg_color(gui, bg_color);
 
+	gui->frame.boids = g_array_new(FALSE, FALSE, sizeof(Boid));
+	gui->frame.obstacles = g_array_new(FALSE, FALSE, sizeof(Obstacle));
+	g_mutex_init(&gui->render_lock);
+	g_cond_init(&gui->render_done);
+	gui->render_pool = g_thread_pool_new(gui_render_worker, gui, 1, TRUE,
+					     NULL);
+
+	gui->max_bands = CLAMP(g_get_num_processors(), 1, RENDER_BANDS_MAX);
+	g_mutex_init(&gui->band_lock);
+	g_cond_init(&gui->band_done);
+	if (gui->max_bands > 1)
+		gui->band_pool = g_thread_pool_new(gui_band_worker, gui,
+						   gui->max_bands - 1, TRUE,
+						   NULL);
+
 	gui->app = gtk_application_new("org.escande.boids", G_APPLICATION_NON_UNIQUE);
 	g_signal_connect(gui->app, "activate", G_CALLBACK(gui_activate), gui);
 
@@ -1034,11 +2008,27 @@ int gui_run(Swarm *swarm, int bg_color, gboolean start)
 		g_object_unref(gui->timing_label);
 
 	g_object_unref(gui->drawing_area);
+	g_thread_pool_free(gui->render_pool, FALSE, TRUE);
+	g_mutex_clear(&gui->render_lock);
+	g_cond_clear(&gui->render_done);
+	g_array_free(gui->frame.boids, TRUE);
+	g_array_free(gui->frame.obstacles, TRUE);
+	if (gui->band_pool)
+		g_thread_pool_free(gui->band_pool, FALSE, TRUE);
+	gui_free_bands(gui);
+	g_mutex_clear(&gui->band_lock);
+	g_cond_clear(&gui->band_done);
 	cairo_destroy(gui->boids_cr);
 	cairo_surface_destroy(gui->boids_surface);
 	cairo_destroy(gui->cr);
 	cairo_surface_destroy(gui->surface);
 	cairo_surface_destroy(gui->bg_surface);
+	cairo_surface_destroy(gui->heatmap_surface);
+	g_free(gui->heat_count);
+	g_free(gui->heat_vx);
+	g_free(gui->heat_vy);
+
+	g_array_free(gui->visible, TRUE);
 
 	g_object_unref(gui->app);
 
@@ -0,0 +1,386 @@
+/* SPDX-License-Identifier: MIT */
+#include "boids.h"
+
+/*
+ * Microbenchmarks of --microbench: the vector.h primitives and the
+ * steering kernels, each over a few input distributions. Each case is
+ * warmed up while calibrating the passes per sample, then timed over
+ * MICROBENCH_SAMPLES samples.
+ */
+
+#define MICROBENCH_NUM       4096
+#define MICROBENCH_SAMPLES   25
+/* Calibrated passes per sample take at least this long */
+#define MICROBENCH_SAMPLE_US 2000
+
+typedef enum {
+	INPUT_UNIT = 0,
+	INPUT_SPEED,
+	INPUT_WIDE,
+	NUM_VECTOR_INPUTS,
+} VectorInput;
+
+static const gchar *vector_input_names[] = {
+	/* Random directions */
+	[INPUT_UNIT]  = "unit",
+	/* Magnitudes around the default speed, as the boid velocities */
+	[INPUT_SPEED] = "speed",
+	/* Log-uniform magnitudes from 1e-3 to 1e3 */
+	[INPUT_WIDE]  = "wide",
+};
+
+typedef enum {
+	/* Within the rule distance, or the obstacles avoid radius */
+	INPUT_INSIDE = 0,
+	/* Spread over twice the cohesion distance, or the whole field */
+	INPUT_MIXED,
+	/* Beyond the cohesion distance, or away from the obstacles */
+	INPUT_OUTSIDE,
+	NUM_KERNEL_INPUTS,
+} KernelInput;
+
+static const gchar *kernel_input_names[] = {
+	[INPUT_INSIDE]  = "inside",
+	[INPUT_MIXED]   = "mixed",
+	[INPUT_OUTSIDE] = "outside",
+};
+
+static const gchar *kernel_names[NUM_KERNELS] = {
+	[KERNEL_AVOID]      = "avoid",
+	[KERNEL_ALIGN]      = "align",
+	[KERNEL_COHESION]   = "cohesion",
+	[KERNEL_DEAD_ANGLE] = "dead_angle",
+	[KERNEL_OBSTACLE]   = "obstacle",
+};
+
+typedef struct {
+	Vector *in;
+	Vector *in2;
+	Vector *out;
+	gdouble *res;
+
+	Swarm *swarm;
+	SwarmKernel kernel;
+	Boid *boids;
+} Microbench;
+
+typedef void (*MicrobenchFunc)(Microbench *mb);
+
+/*
+ * Make the compiler assume p is read and memory changed, so the results
+ * are stored and the inputs loaded again at each pass.
+ */
+static inline void microbench_escape(gpointer p)
+{
+	__asm__ volatile("" : : "g"(p) : "memory");
+}
+
+static void mb_copy(Microbench *mb)
+{
+	guint i;
+
+	for (i = 0; i < MICROBENCH_NUM; i++)
+		mb->out[i] = mb->in[i];
+	microbench_escape(mb->out);
+}
+
+static void mb_mag(Microbench *mb)
+{
+	guint i;
+
+	for (i = 0; i < MICROBENCH_NUM; i++)
+		mb->res[i] = vector_mag(&mb->in[i]);
+	microbench_escape(mb->res);
+}
+
+static void mb_dot(Microbench *mb)
+{
+	guint i;
+
+	for (i = 0; i < MICROBENCH_NUM; i++)
+		mb->res[i] = vector_dot(&mb->in[i], &mb->in2[i]);
+	microbench_escape(mb->res);
+}
+
+static void mb_cos_angle(Microbench *mb)
+{
+	guint i;
+
+	for (i = 0; i < MICROBENCH_NUM; i++)
+		mb->res[i] = vector_cos_angle(&mb->in[i], &mb->in2[i]);
+	microbench_escape(mb->res);
+}
+
+/* In place on a copy, the inputs must stay the same */
+static void mb_normalize(Microbench *mb)
+{
+	guint i;
+
+	for (i = 0; i < MICROBENCH_NUM; i++) {
+		mb->out[i] = mb->in[i];
+		vector_normalize(&mb->out[i]);
+	}
+	microbench_escape(mb->out);
+}
+
+static void mb_set_mag(Microbench *mb)
+{
+	guint i;
+
+	for (i = 0; i < MICROBENCH_NUM; i++) {
+		mb->out[i] = mb->in[i];
+		vector_set_mag(&mb->out[i], DEFAULT_SPEED);
+	}
+	microbench_escape(mb->out);
+}
+
+static const struct {
+	const gchar *name;
+	MicrobenchFunc func;
+} vector_funcs[] = {
+	/* Baseline of the in place ones */
+	{ "copy",             mb_copy },
+	{ "vector_mag",       mb_mag },
+	{ "vector_dot",       mb_dot },
+	{ "vector_cos_angle", mb_cos_angle },
+	{ "vector_normalize", mb_normalize },
+	{ "vector_set_mag",   mb_set_mag },
+};
+
+static void mb_kernel(Microbench *mb)
+{
+	mb->res[0] += swarm_run_kernel(mb->swarm, mb->kernel, mb->boids,
+				       MICROBENCH_NUM);
+	microbench_escape(mb->res);
+}
+
+static gint microbench_cmp(gconstpointer a, gconstpointer b)
+{
+	const gdouble *da = a;
+	const gdouble *db = b;
+
+	return *da < *db ? -1 : *da > *db;
+}
+
+/* ns per call of the primitive or kernel, calls per pass */
+static void microbench_case(const gchar *name, const gchar *input,
+			    MicrobenchFunc func, Microbench *mb, guint calls)
+{
+	gdouble samples[MICROBENCH_SAMPLES];
+	gdouble mean = 0;
+	gdouble var = 0;
+	guint passes = 1;
+	gint64 start;
+	gint64 time;
+	guint s;
+	guint i;
+
+	/* Warmup, doubling the passes until a sample is long enough */
+	for (;;) {
+		start = g_get_monotonic_time();
+		for (i = 0; i < passes; i++)
+			func(mb);
+		time = g_get_monotonic_time() - start;
+
+		if (time >= MICROBENCH_SAMPLE_US)
+			break;
+		passes *= 2;
+	}
+
+	for (s = 0; s < MICROBENCH_SAMPLES; s++) {
+		start = g_get_monotonic_time();
+		for (i = 0; i < passes; i++)
+			func(mb);
+		time = g_get_monotonic_time() - start;
+
+		samples[s] = (gdouble)time * 1000 / passes / calls;
+		mean += samples[s];
+	}
+	mean /= MICROBENCH_SAMPLES;
+
+	for (s = 0; s < MICROBENCH_SAMPLES; s++)
+		var += POW2(samples[s] - mean);
+	var /= MICROBENCH_SAMPLES - 1;
+
+	qsort(samples, MICROBENCH_SAMPLES, sizeof(gdouble), microbench_cmp);
+
+	g_printf("%-17s %-8s %8.2f %8.2f %8.2f %8.2f\n", name, input,
+		 samples[0], samples[MICROBENCH_SAMPLES / 2], mean, sqrt(var));
+}
+
+static void microbench_vector_input(Vector *v, VectorInput input)
+{
+	gdouble a = g_random_double_range(0, 2 * G_PI);
+	gdouble mag;
+
+	switch (input) {
+	case INPUT_SPEED:
+		mag = g_random_double_range(DEFAULT_SPEED - 1, DEFAULT_SPEED + 1);
+		break;
+	case INPUT_WIDE:
+		mag = pow(10, g_random_double_range(-3, 3));
+		break;
+	default:
+		mag = 1;
+		break;
+	}
+
+	vector_set(v, mag * cos(a), mag * sin(a));
+}
+
+static void microbench_vectors(Microbench *mb)
+{
+	guint input;
+	guint f;
+	guint i;
+
+	g_printf("Vector primitives, %u vectors, ns/call:\n", MICROBENCH_NUM);
+	g_printf("%-17s %-8s %8s %8s %8s %8s\n", "primitive", "input",
+		 "min", "median", "mean", "stddev");
+
+	for (input = 0; input < NUM_VECTOR_INPUTS; input++) {
+		for (i = 0; i < MICROBENCH_NUM; i++) {
+			microbench_vector_input(&mb->in[i], input);
+			microbench_vector_input(&mb->in2[i], input);
+		}
+
+		for (f = 0; f < G_N_ELEMENTS(vector_funcs); f++)
+			microbench_case(vector_funcs[f].name,
+					vector_input_names[input],
+					vector_funcs[f].func, mb,
+					MICROBENCH_NUM);
+	}
+}
+
+/* Random point between min and max from (x, y) */
+static void microbench_around(Vector *v, gdouble x, gdouble y,
+			      gdouble min, gdouble max)
+{
+	gdouble a = g_random_double_range(0, 2 * G_PI);
+	gdouble r = g_random_double_range(min, max);
+
+	vector_set(v, x + r * cos(a), y + r * sin(a));
+}
+
+static void microbench_kernel_input(Microbench *mb, SwarmKernel kernel,
+				    KernelInput input)
+{
+	Swarm *swarm = mb->swarm;
+	gdouble x = DEFAULT_WIDTH / 2;
+	gdouble y = DEFAULT_HEIGHT / 2;
+	gdouble dist;
+	Obstacle *o;
+	Boid *b;
+	guint i;
+
+	switch (kernel) {
+	case KERNEL_AVOID:
+		dist = swarm_get_rule_dist(swarm, RULE_AVOID);
+		break;
+	case KERNEL_ALIGN:
+		dist = swarm_get_rule_dist(swarm, RULE_ALIGN);
+		break;
+	default:
+		dist = swarm_get_rule_dist(swarm, RULE_COHESION);
+		break;
+	}
+
+	for (i = 0; i < MICROBENCH_NUM; i++) {
+		b = &mb->boids[i];
+		microbench_vector_input(&b->velocity, INPUT_SPEED);
+
+		if (kernel == KERNEL_OBSTACLE) {
+			o = swarm_get_obstacle(swarm, i % swarm_num_obstacles(swarm));
+			if (input == INPUT_INSIDE)
+				microbench_around(&b->pos, o->pos.x, o->pos.y,
+						  0, sqrt(o->avoid_radius));
+			else if (input == INPUT_MIXED)
+				vector_set(&b->pos,
+					   g_random_double_range(0, DEFAULT_WIDTH),
+					   g_random_double_range(0, DEFAULT_HEIGHT));
+			else
+				vector_set(&b->pos,
+					   g_random_double_range(0, DEFAULT_WIDTH),
+					   g_random_double_range(DEFAULT_HEIGHT / 2,
+								 DEFAULT_HEIGHT));
+			continue;
+		}
+
+		/* Around boids[0], at the center */
+		if (!i)
+			vector_set(&b->pos, x, y);
+		else if (input == INPUT_INSIDE)
+			microbench_around(&b->pos, x, y, 1, dist);
+		else if (input == INPUT_MIXED)
+			microbench_around(&b->pos, x, y, 1,
+					  2 * swarm_get_rule_dist(swarm, RULE_COHESION));
+		else
+			microbench_around(&b->pos, x, y,
+					  swarm_get_rule_dist(swarm, RULE_COHESION) + 1,
+					  DEFAULT_HEIGHT / 2);
+	}
+}
+
+static void microbench_kernels(Microbench *mb)
+{
+	Swarm *swarm = mb->swarm;
+	guint kernel;
+	guint input;
+	guint i;
+
+	/* A row of obstacles in the upper half of the field */
+	for (i = 0; i < 8; i++)
+		swarm_add_obstacle(swarm, 64 + i * 128, DEFAULT_HEIGHT / 4,
+				   OBSTACLE_TYPE_IN_FIELD);
+
+	g_printf("Steering kernels, %u boids, ns/pair or ns/boid:\n",
+		 MICROBENCH_NUM);
+	g_printf("%-17s %-8s %8s %8s %8s %8s\n", "kernel", "input",
+		 "min", "median", "mean", "stddev");
+
+	for (kernel = 0; kernel < NUM_KERNELS; kernel++) {
+		/* Only the rule of the kernel */
+		swarm_set_rule_active(swarm, RULE_AVOID, kernel == KERNEL_AVOID);
+		swarm_set_rule_active(swarm, RULE_ALIGN, kernel == KERNEL_ALIGN);
+		swarm_set_rule_active(swarm, RULE_COHESION,
+				      kernel == KERNEL_COHESION);
+		swarm_set_rule_active(swarm, RULE_DEAD_ANGLE,
+				      kernel == KERNEL_DEAD_ANGLE);
+		mb->kernel = kernel;
+
+		for (input = 0; input < NUM_KERNEL_INPUTS; input++) {
+			microbench_kernel_input(mb, kernel, input);
+			microbench_case(kernel_names[kernel],
+					kernel_input_names[input], mb_kernel,
+					mb, kernel == KERNEL_OBSTACLE ?
+					MICROBENCH_NUM : MICROBENCH_NUM - 1);
+		}
+	}
+}
+
+int microbench_run(void)
+{
+	Microbench mb;
+
+	g_random_set_seed(MICROBENCH_NUM);
+
+	mb.in = g_new(Vector, MICROBENCH_NUM);
+	mb.in2 = g_new(Vector, MICROBENCH_NUM);
+	mb.out = g_new(Vector, MICROBENCH_NUM);
+	mb.res = g_new0(gdouble, MICROBENCH_NUM);
+	mb.boids = g_new0(Boid, MICROBENCH_NUM);
+	mb.swarm = swarm_alloc();
+
+	microbench_vectors(&mb);
+	g_printf("\n");
+	microbench_kernels(&mb);
+
+	swarm_free(mb.swarm);
+	g_free(mb.boids);
+	g_free(mb.res);
+	g_free(mb.out);
+	g_free(mb.in2);
+	g_free(mb.in);
+
+	return 0;
+}
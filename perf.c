@@ -0,0 +1,286 @@
+/* SPDX-License-Identifier: MIT */
+#include <glib/gprintf.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "perf.h"
+
+/* Counters of one thread, read together through the leader */
+typedef struct {
+	gint fd[PERF_NUM_COUNTERS];
+	gint leader;
+} PerfGroup;
+
+typedef struct {
+	PerfGroup main;
+	/* Groups of the threads working for the steps, see perf_thread_init() */
+	GArray *threads;
+	GMutex threads_lock;
+	/* Position of the counter value in the group read, -1 if unavailable */
+	gint index[PERF_NUM_COUNTERS];
+	gint num_open;
+
+	guint64 start[PERF_NUM_PHASES][PERF_NUM_COUNTERS];
+	PerfStats last[PERF_NUM_PHASES];
+	PerfStats total[PERF_NUM_PHASES];
+} Perf;
+
+gboolean perf_enabled = FALSE;
+
+static Perf perf;
+
+const gchar *perf_phase_name(PerfPhase phase)
+{
+	static const gchar *names[PERF_NUM_PHASES] = {
+		[PERF_PHASE_STEP]      = "step",
+		[PERF_PHASE_PREDATOR]  = "predator",
+		[PERF_PHASE_INDEX]     = "index",
+		[PERF_PHASE_STEER]     = "steer",
+		[PERF_PHASE_INTEGRATE] = "integrate",
+		[PERF_PHASE_SORT]      = "sort",
+	};
+
+	return names[phase];
+}
+
+gboolean perf_counter_available(PerfCounter counter)
+{
+	return perf_enabled && perf.index[counter] >= 0;
+}
+
+#ifdef __linux__
+static void perf_read_group(PerfGroup *group, guint64 *val)
+{
+	guint64 buf[1 + PERF_NUM_COUNTERS];
+	int i;
+
+	if (read(group->leader, buf, sizeof(buf)) < 0)
+		return;
+
+	for (i = 0; i < PERF_NUM_COUNTERS; i++) {
+		if (perf.index[i] >= 0)
+			val[i] += buf[1 + perf.index[i]];
+	}
+}
+#endif
+
+/* Sum of the main thread and the worker threads */
+static void perf_read(guint64 *val)
+{
+#ifdef __linux__
+	guint i;
+#endif
+
+	memset(val, 0, sizeof(guint64) * PERF_NUM_COUNTERS);
+
+#ifdef __linux__
+	perf_read_group(&perf.main, val);
+
+	g_mutex_lock(&perf.threads_lock);
+	for (i = 0; i < perf.threads->len; i++)
+		perf_read_group(&g_array_index(perf.threads, PerfGroup, i), val);
+	g_mutex_unlock(&perf.threads_lock);
+#endif
+}
+
+void perf_phase_begin(PerfPhase phase)
+{
+	perf_read(perf.start[phase]);
+}
+
+void perf_phase_end(PerfPhase phase)
+{
+	guint64 val[PERF_NUM_COUNTERS];
+	PerfStats *last = &perf.last[phase];
+	PerfStats *total = &perf.total[phase];
+	int i;
+
+	perf_read(val);
+
+	for (i = 0; i < PERF_NUM_COUNTERS; i++) {
+		last->val[i] = val[i] - perf.start[phase][i];
+		total->val[i] += last->val[i];
+	}
+
+	last->samples = 1;
+	total->samples++;
+}
+
+void perf_get_last(PerfPhase phase, PerfStats *stats)
+{
+	*stats = perf.last[phase];
+}
+
+void perf_get_total(PerfPhase phase, PerfStats *stats)
+{
+	*stats = perf.total[phase];
+}
+
+void perf_reset(void)
+{
+	memset(perf.last, 0, sizeof(perf.last));
+	memset(perf.total, 0, sizeof(perf.total));
+}
+
+#ifdef __linux__
+static gint perf_open_counter(guint32 type, guint64 config, gint group_fd)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = (group_fd == -1);
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+
+	return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+static const struct {
+	guint32 type;
+	guint64 config;
+} perf_counters[PERF_NUM_COUNTERS] = {
+	[PERF_CYCLES] = {
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES
+	},
+	[PERF_INSTRUCTIONS] = {
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS
+	},
+	[PERF_L1D_MISSES] = {
+		PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+			(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			(PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+	},
+	[PERF_LLC_MISSES] = {
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES
+	},
+	[PERF_BRANCH_MISSES] = {
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES
+	},
+};
+
+static void perf_close_group(PerfGroup *group)
+{
+	int i;
+
+	for (i = 0; i < PERF_NUM_COUNTERS; i++) {
+		if (group->fd[i] >= 0)
+			close(group->fd[i]);
+	}
+}
+
+/*
+ * Open the counters of the calling thread. The first time, the unavailable
+ * counters are left out of the group read. Then the group must have the
+ * same counters to be read the same way.
+ */
+static gboolean perf_open_group(PerfGroup *group, gboolean first)
+{
+	int i;
+
+	group->leader = -1;
+
+	for (i = 0; i < PERF_NUM_COUNTERS; i++) {
+		group->fd[i] = -1;
+		if (!first && perf.index[i] < 0)
+			continue;
+
+		group->fd[i] = perf_open_counter(perf_counters[i].type,
+						 perf_counters[i].config,
+						 group->leader);
+		if (group->fd[i] < 0) {
+			if (first) {
+				perf.index[i] = -1;
+				continue;
+			}
+			perf_close_group(group);
+			return FALSE;
+		}
+
+		if (group->leader < 0)
+			group->leader = group->fd[i];
+
+		if (first)
+			perf.index[i] = perf.num_open++;
+	}
+
+	if (group->leader < 0)
+		return FALSE;
+
+	ioctl(group->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(group->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+	return TRUE;
+}
+#endif
+
+gboolean perf_init(void)
+{
+#ifdef __linux__
+	perf.num_open = 0;
+
+	if (!perf_open_group(&perf.main, TRUE)) {
+		g_fprintf(stderr, "Hardware performance counters unavailable\n");
+		return FALSE;
+	}
+
+	perf.threads = g_array_new(FALSE, FALSE, sizeof(PerfGroup));
+
+	perf_reset();
+	perf_enabled = TRUE;
+
+	return TRUE;
+#else
+	g_fprintf(stderr, "Hardware performance counters not supported\n");
+	return FALSE;
+#endif
+}
+
+/*
+ * A thread working for the steps counts from its first call, its counters
+ * are kept after it exits.
+ */
+void perf_thread_init(void)
+{
+#ifdef __linux__
+	static __thread gboolean counted;
+	PerfGroup group;
+
+	if (counted)
+		return;
+
+	counted = TRUE;
+
+	if (!perf_open_group(&group, FALSE))
+		return;
+
+	g_mutex_lock(&perf.threads_lock);
+	g_array_append_val(perf.threads, group);
+	g_mutex_unlock(&perf.threads_lock);
+#endif
+}
+
+void perf_finish(void)
+{
+#ifdef __linux__
+	guint i;
+
+	if (!perf_enabled)
+		return;
+
+	perf_enabled = FALSE;
+
+	perf_close_group(&perf.main);
+	for (i = 0; i < perf.threads->len; i++)
+		perf_close_group(&g_array_index(perf.threads, PerfGroup, i));
+	g_array_free(perf.threads, TRUE);
+#endif
+}
@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef __PERF_H__
+#define __PERF_H__
+
+#include <glib.h>
+
+typedef enum {
+	PERF_PHASE_STEP = 0,
+	PERF_PHASE_PREDATOR,
+	PERF_PHASE_INDEX,
+	PERF_PHASE_STEER,
+	PERF_PHASE_INTEGRATE,
+	PERF_PHASE_SORT,
+	PERF_NUM_PHASES,
+} PerfPhase;
+
+typedef enum {
+	PERF_CYCLES = 0,
+	PERF_INSTRUCTIONS,
+	PERF_L1D_MISSES,
+	PERF_LLC_MISSES,
+	PERF_BRANCH_MISSES,
+	PERF_NUM_COUNTERS,
+} PerfCounter;
+
+typedef struct {
+	guint64 val[PERF_NUM_COUNTERS];
+	guint64 samples;
+} PerfStats;
+
+/*
+ * Hardware counters are read with perf_event_open() around each simulation
+ * step and each of its phases. When the counters can't be opened (no kernel
+ * support, perf_event_paranoid, virtual machine...) perf_init() returns
+ * FALSE and PERF_BEGIN()/PERF_END() do nothing.
+ */
+extern gboolean perf_enabled;
+
+void perf_phase_begin(PerfPhase phase);
+void perf_phase_end(PerfPhase phase);
+
+#define PERF_BEGIN(phase)				\
+	do {						\
+		if (G_UNLIKELY(perf_enabled))		\
+			perf_phase_begin(phase);	\
+	} while (0)
+
+#define PERF_END(phase)					\
+	do {						\
+		if (G_UNLIKELY(perf_enabled))		\
+			perf_phase_end(phase);		\
+	} while (0)
+
+/* The threads of a step count with the main thread */
+void perf_thread_init(void);
+
+#define PERF_THREAD_INIT()				\
+	do {						\
+		if (G_UNLIKELY(perf_enabled))		\
+			perf_thread_init();		\
+	} while (0)
+
+gboolean perf_init(void);
+void perf_finish(void);
+
+const gchar *perf_phase_name(PerfPhase phase);
+gboolean perf_counter_available(PerfCounter counter);
+
+/* Counters of the last completed begin/end interval of a phase */
+void perf_get_last(PerfPhase phase, PerfStats *stats);
+/* Counters accumulated over all intervals of a phase since perf_reset() */
+void perf_get_total(PerfPhase phase, PerfStats *stats);
+void perf_reset(void);
+
+static inline gdouble perf_ipc(PerfStats *stats)
+{
+	if (!stats->val[PERF_CYCLES])
+		return 0;
+
+	return (gdouble)stats->val[PERF_INSTRUCTIONS] / stats->val[PERF_CYCLES];
+}
+
+static inline gdouble perf_per_boid(PerfStats *stats, PerfCounter counter,
+				    guint num_boids)
+{
+	if (!stats->samples || !num_boids)
+		return 0;
+
+	return (gdouble)stats->val[counter] / stats->samples / num_boids;
+}
+
+#endif /* __PERF_H__ */
@@ -0,0 +1,197 @@
+/* SPDX-License-Identifier: MIT */
+#include "boids.h"
+
+/*
+ * Adaptive quadtree index.
+ * The boids are sorted by Morton code with a radix sort, then a node is
+ * split into the quadrants given by the next 2 bits of the codes, which
+ * are contiguous ranges of the sorted boids. Only the non-empty quadrants
+ * of the nodes holding more than QUADTREE_LEAF_SIZE boids get a child, so
+ * the tree is deep in the dense clumps and shallow in the empty space.
+ */
+
+#define RADIX_BITS 8
+#define RADIX_SIZE (1 << RADIX_BITS)
+
+static void quadtree_sort(QuadTree *qt, guint num_boids)
+{
+	guint count[RADIX_SIZE];
+	guint32 *codes;
+	guint *boids;
+	guint shift;
+	guint sum;
+	guint d;
+	guint i;
+
+	for (shift = 0; shift < 32; shift += RADIX_BITS) {
+		memset(count, 0, sizeof(count));
+
+		for (i = 0; i < num_boids; i++)
+			count[(qt->codes[i] >> shift) & (RADIX_SIZE - 1)]++;
+
+		for (sum = 0, d = 0; d < RADIX_SIZE; d++) {
+			i = count[d];
+			count[d] = sum;
+			sum += i;
+		}
+
+		for (i = 0; i < num_boids; i++) {
+			d = count[(qt->codes[i] >> shift) & (RADIX_SIZE - 1)]++;
+			qt->tmp_codes[d] = qt->codes[i];
+			qt->tmp_boids[d] = qt->boids[i];
+		}
+
+		codes = qt->codes;
+		qt->codes = qt->tmp_codes;
+		qt->tmp_codes = codes;
+
+		boids = qt->boids;
+		qt->boids = qt->tmp_boids;
+		qt->tmp_boids = boids;
+	}
+}
+
+static guint quadtree_alloc_nodes(QuadTree *qt, guint num)
+{
+	guint first = qt->num_nodes;
+
+	if (qt->num_nodes + num > qt->nodes_alloc) {
+		qt->nodes_alloc = MAX(qt->nodes_alloc * 2, qt->num_nodes + num);
+		qt->nodes = g_renew(QuadNode, qt->nodes, qt->nodes_alloc);
+	}
+
+	qt->num_nodes += num;
+
+	return first;
+}
+
+static void quadtree_leaf_bounds(QuadTree *qt, QuadNode *node, GArray *boids)
+{
+	Boid *b;
+	guint i;
+
+	node->x0 = node->y0 = G_MAXDOUBLE;
+	node->x1 = node->y1 = -G_MAXDOUBLE;
+
+	for (i = node->start; i < node->end; i++) {
+		b = &g_array_index(boids, Boid, qt->boids[i]);
+		node->x0 = MIN(node->x0, b->pos.x);
+		node->y0 = MIN(node->y0, b->pos.y);
+		node->x1 = MAX(node->x1, b->pos.x);
+		node->y1 = MAX(node->y1, b->pos.y);
+	}
+}
+
+/* The nodes array may be reallocated, nodes are referenced by index */
+static void quadtree_build_node(QuadTree *qt, guint idx, GArray *boids,
+				guint level)
+{
+	guint start[4];
+	guint end[4];
+	guint num_children = 0;
+	guint first;
+	guint shift;
+	guint q;
+	guint i;
+	QuadNode *node = &qt->nodes[idx];
+	QuadNode *child;
+
+	node->num_children = 0;
+
+	if (node->end - node->start <= QUADTREE_LEAF_SIZE ||
+	    level == QUADTREE_MAX_DEPTH) {
+		quadtree_leaf_bounds(qt, node, boids);
+		return;
+	}
+
+	shift = 2 * (QUADTREE_MAX_DEPTH - 1 - level);
+
+	for (i = node->start; i < node->end; num_children++) {
+		q = (qt->codes[i] >> shift) & 3;
+		start[num_children] = i;
+		while (i < node->end && ((qt->codes[i] >> shift) & 3) == q)
+			i++;
+		end[num_children] = i;
+	}
+
+	/* All the boids in one quadrant, go down without adding a node */
+	if (num_children == 1) {
+		quadtree_build_node(qt, idx, boids, level + 1);
+		return;
+	}
+
+	first = quadtree_alloc_nodes(qt, num_children);
+
+	for (q = 0; q < num_children; q++) {
+		child = &qt->nodes[first + q];
+		child->start = start[q];
+		child->end = end[q];
+		quadtree_build_node(qt, first + q, boids, level + 1);
+	}
+
+	node = &qt->nodes[idx];
+	node->first_child = first;
+	node->num_children = num_children;
+
+	child = &qt->nodes[first];
+	node->x0 = child->x0;
+	node->y0 = child->y0;
+	node->x1 = child->x1;
+	node->y1 = child->y1;
+
+	for (q = 1; q < num_children; q++) {
+		child = &qt->nodes[first + q];
+		node->x0 = MIN(node->x0, child->x0);
+		node->y0 = MIN(node->y0, child->y0);
+		node->x1 = MAX(node->x1, child->x1);
+		node->y1 = MAX(node->y1, child->y1);
+	}
+}
+
+void quadtree_build(QuadTree *qt, GArray *boids, gint width, gint height,
+		    gboolean periodic)
+{
+	guint num_boids = boids->len;
+	QuadNode *root;
+	Boid *b;
+	guint i;
+
+	qt->width = width;
+	qt->height = height;
+	qt->periodic = periodic;
+
+	if (num_boids > qt->boids_alloc) {
+		qt->boids_alloc = num_boids;
+		qt->boids = g_renew(guint, qt->boids, num_boids);
+		qt->codes = g_renew(guint32, qt->codes, num_boids);
+		qt->tmp_boids = g_renew(guint, qt->tmp_boids, num_boids);
+		qt->tmp_codes = g_renew(guint32, qt->tmp_codes, num_boids);
+	}
+
+	for (i = 0; i < num_boids; i++) {
+		b = &g_array_index(boids, Boid, i);
+		qt->boids[i] = i;
+		qt->codes[i] = morton_code(b->pos.x, b->pos.y, width, height);
+	}
+
+	quadtree_sort(qt, num_boids);
+
+	qt->num_nodes = 0;
+	quadtree_alloc_nodes(qt, 1);
+
+	root = &qt->nodes[0];
+	root->start = 0;
+	root->end = num_boids;
+
+	quadtree_build_node(qt, 0, boids, 0);
+}
+
+void quadtree_free(QuadTree *qt)
+{
+	g_free(qt->boids);
+	g_free(qt->codes);
+	g_free(qt->tmp_boids);
+	g_free(qt->tmp_codes);
+	g_free(qt->nodes);
+	memset(qt, 0, sizeof(*qt));
+}
@@ -0,0 +1,892 @@
+/* SPDX-License-Identifier: MIT */
+#include "boids.h"
+
+/*
+ * Scenario files, for identical workloads in the GUI and with --bench.
+ * A scenario is a key file. The [scenario] group gives the initial
+ * setup, each [step N] group the changes to make before step N:
+ *
+ *   [scenario]
+ *   width=2048
+ *   height=1024
+ *   seed=42
+ *   boids=1000
+ *   obstacles=300,200;600,500
+ *
+ *   [step 500]
+ *   cohesion_dist=150
+ *   mouse_mode=scary
+ *   mouse=100,100;900,500;100,900
+ *   mouse_steps=50
+ *
+ * seed is only read from [scenario]. The other keys can be used in any
+ * group:
+ *   width, height (resize the field),
+ *   boids, speed, dead_angle (0 disables the rule),
+ *   avoid, align, cohesion (true or false),
+ *   avoid_dist, align_dist, cohesion_dist,
+ *   interaction (metric, topological or approximate), knn,
+ *   index (brute, verlet or quadtree), steer_interval,
+ *   walls, predator (true or false),
+ *   obstacles (list of x,y added to the field),
+ *   remove_obstacles (list of x,y removed from the field, before adding),
+ *   polygons (lists of x,y added to the field, separated by an empty
+ *   item, i.e. 0,0;100,0;0,100;;300,300;400,400 for a triangle and a
+ *   segment, the polygons are closed),
+ *   mouse_mode (none, scary or attractive),
+ *   mouse (list of x,y the mouse goes through, mouse_steps steps from one
+ *   point to the next, 1 by default).
+ * Groups of the same step, i.e. [step 500 #1], are applied in the file
+ * order. The file is parsed once, then the changes are applied by
+ * swarm_move() as the steps go.
+ *
+ * The GUI records the changes made by the user in the same format.
+ */
+
+#define SCENARIO_GROUP "scenario"
+
+enum {
+	SCENARIO_BOIDS          = 1 << 0,
+	SCENARIO_SPEED          = 1 << 1,
+	SCENARIO_DEAD_ANGLE     = 1 << 2,
+	SCENARIO_AVOID          = 1 << 3,
+	SCENARIO_ALIGN          = 1 << 4,
+	SCENARIO_COHESION       = 1 << 5,
+	SCENARIO_AVOID_DIST     = 1 << 6,
+	SCENARIO_ALIGN_DIST     = 1 << 7,
+	SCENARIO_COHESION_DIST  = 1 << 8,
+	SCENARIO_WALLS          = 1 << 9,
+	SCENARIO_PREDATOR       = 1 << 10,
+	SCENARIO_MOUSE_MODE     = 1 << 11,
+	SCENARIO_WIDTH          = 1 << 12,
+	SCENARIO_HEIGHT         = 1 << 13,
+	SCENARIO_INTERACTION    = 1 << 14,
+	SCENARIO_INDEX          = 1 << 15,
+	SCENARIO_KNN            = 1 << 16,
+	SCENARIO_STEER_INTERVAL = 1 << 17,
+};
+
+static const gchar *scenario_mouse_modes[] = {
+	[MOUSE_MODE_NONE]       = "none",
+	[MOUSE_MODE_SCARY]      = "scary",
+	[MOUSE_MODE_ATTRACTIVE] = "attractive",
+};
+
+static const gchar *scenario_interactions[] = {
+	[INTERACTION_METRIC]      = "metric",
+	[INTERACTION_TOPOLOGICAL] = "topological",
+	[INTERACTION_APPROXIMATE] = "approximate",
+};
+
+static const gchar *scenario_indexes[] = {
+	[NEIGHBOR_INDEX_BRUTE_FORCE] = "brute",
+	[NEIGHBOR_INDEX_VERLET]      = "verlet",
+	[NEIGHBOR_INDEX_QUADTREE]    = "quadtree",
+};
+
+/* Keys of the setup written by scenario_record_start() */
+static const gchar *scenario_keys[] = {
+	"width", "height", "boids", "speed", "dead_angle",
+	"avoid", "align", "cohesion",
+	"avoid_dist", "align_dist", "cohesion_dist",
+	"interaction", "knn", "index", "steer_interval",
+	"walls", "predator", "mouse_mode", "mouse",
+};
+
+/* Keys of a group in the order scenario_apply() applies them */
+static const gchar *scenario_apply_order[] = {
+	"width", "height", "boids", "speed", "dead_angle",
+	"avoid", "align", "cohesion",
+	"avoid_dist", "align_dist", "cohesion_dist",
+	"interaction", "knn", "index", "steer_interval",
+	"walls", "predator", "mouse_mode",
+	"remove_obstacles", "obstacles", "polygons", "mouse",
+};
+
+typedef struct {
+	guint64 step;
+	/* Position of the group in the file */
+	guint order;
+	guint set;
+
+	guint width;
+	guint height;
+	guint num_boids;
+	gdouble speed;
+	guint dead_angle;
+	gboolean avoid;
+	gboolean align;
+	gboolean cohesion;
+	guint avoid_dist;
+	guint align_dist;
+	guint cohesion_dist;
+	guint interaction;
+	guint knn;
+	guint index;
+	guint steer_interval;
+	gboolean walls;
+	gboolean predator;
+	guint mouse_mode;
+
+	/* Vector, empty if unset */
+	GArray *obstacles;
+	GArray *removed;
+	/* GArray of Vector */
+	GPtrArray *polygons;
+	GArray *mouse;
+	guint mouse_steps;
+} ScenarioEvent;
+
+struct _Scenario {
+	guint seed;
+
+	ScenarioEvent setup;
+	/* By step */
+	GArray *events;
+
+	/* Replay state, steps relative to the start of the replay */
+	guint64 start;
+	guint next;
+	ScenarioEvent *mouse;
+	guint64 mouse_start;
+};
+
+struct _ScenarioRecord {
+	GKeyFile *kf;
+	guint64 start;
+
+	/* Group of the changes of the current step */
+	gchar *group;
+	guint64 group_step;
+	guint group_num;
+	/* Last key of the group in the apply order */
+	guint group_rank;
+};
+
+static gboolean scenario_get_bool(GKeyFile *kf, const gchar *group,
+				  const gchar *key, gboolean *val)
+{
+	GError *error = NULL;
+	gboolean v;
+
+	v = g_key_file_get_boolean(kf, group, key, &error);
+	if (error) {
+		g_error_free(error);
+		return FALSE;
+	}
+
+	*val = v;
+	return TRUE;
+}
+
+static gboolean scenario_get_uint(GKeyFile *kf, const gchar *group,
+				  const gchar *key, guint *val)
+{
+	GError *error = NULL;
+	gint v;
+
+	v = g_key_file_get_integer(kf, group, key, &error);
+	if (error || v < 0) {
+		g_clear_error(&error);
+		return FALSE;
+	}
+
+	*val = v;
+	return TRUE;
+}
+
+static gboolean scenario_get_enum(GKeyFile *kf, const gchar *group,
+				  const gchar *key, const gchar **names,
+				  guint num, guint *val)
+{
+	gchar *name;
+	guint i;
+
+	name = g_key_file_get_string(kf, group, key, NULL);
+	if (!name)
+		return FALSE;
+
+	for (i = 0; i < num; i++) {
+		if (!g_strcmp0(name, names[i]))
+			break;
+	}
+	if (i == num)
+		g_fprintf(stderr, "Scenario: invalid %s %s in [%s]\n", key,
+			  name, group);
+	else
+		*val = i;
+	g_free(name);
+
+	return i < num;
+}
+
+/* "x,y;x,y;..." */
+static gboolean scenario_parse_point(const gchar *str, Vector *p)
+{
+	gchar *end;
+
+	p->x = g_ascii_strtod(str, &end);
+	if (end == str || *end != ',')
+		return FALSE;
+
+	p->y = g_ascii_strtod(end + 1, &end);
+
+	return !*end;
+}
+
+static GArray *scenario_get_points(GKeyFile *kf, const gchar *group,
+				   const gchar *key)
+{
+	GArray *points = g_array_new(FALSE, FALSE, sizeof(Vector));
+	gchar **list;
+	Vector p;
+	gsize num;
+	gsize i;
+
+	list = g_key_file_get_string_list(kf, group, key, &num, NULL);
+	for (i = 0; list && i < num; i++) {
+		if (scenario_parse_point(list[i], &p))
+			g_array_append_val(points, p);
+		else
+			g_fprintf(stderr, "Scenario: invalid point %s in [%s] %s\n",
+				  list[i], group, key);
+	}
+	g_strfreev(list);
+
+	return points;
+}
+
+static void scenario_add_polygon(GPtrArray *polygons, GArray *points,
+				 const gchar *group)
+{
+	if (points->len >= 2) {
+		g_ptr_array_add(polygons, points);
+		return;
+	}
+
+	if (points->len)
+		g_fprintf(stderr, "Scenario: polygon of 1 point in [%s]\n",
+			  group);
+	g_array_free(points, TRUE);
+}
+
+static GPtrArray *scenario_get_polygons(GKeyFile *kf, const gchar *group,
+					const gchar *key)
+{
+	GPtrArray *polygons = g_ptr_array_new();
+	GArray *points = g_array_new(FALSE, FALSE, sizeof(Vector));
+	gchar **list;
+	Vector p;
+	gsize num;
+	gsize i;
+
+	list = g_key_file_get_string_list(kf, group, key, &num, NULL);
+	for (i = 0; list && i < num; i++) {
+		if (!*list[i]) {
+			scenario_add_polygon(polygons, points, group);
+			points = g_array_new(FALSE, FALSE, sizeof(Vector));
+		} else if (scenario_parse_point(list[i], &p)) {
+			g_array_append_val(points, p);
+		} else {
+			g_fprintf(stderr, "Scenario: invalid point %s in [%s] %s\n",
+				  list[i], group, key);
+		}
+	}
+	g_strfreev(list);
+
+	scenario_add_polygon(polygons, points, group);
+
+	return polygons;
+}
+
+static void scenario_parse_event(GKeyFile *kf, const gchar *group,
+				 ScenarioEvent *ev)
+{
+	const struct {
+		const gchar *key;
+		guint flag;
+		gboolean *val;
+	} bools[] = {
+		{ "avoid",    SCENARIO_AVOID,    &ev->avoid },
+		{ "align",    SCENARIO_ALIGN,    &ev->align },
+		{ "cohesion", SCENARIO_COHESION, &ev->cohesion },
+		{ "walls",    SCENARIO_WALLS,    &ev->walls },
+		{ "predator", SCENARIO_PREDATOR, &ev->predator },
+	};
+	const struct {
+		const gchar *key;
+		guint flag;
+		guint *val;
+	} uints[] = {
+		{ "width",          SCENARIO_WIDTH,          &ev->width },
+		{ "height",         SCENARIO_HEIGHT,         &ev->height },
+		{ "boids",          SCENARIO_BOIDS,          &ev->num_boids },
+		{ "dead_angle",     SCENARIO_DEAD_ANGLE,     &ev->dead_angle },
+		{ "avoid_dist",     SCENARIO_AVOID_DIST,     &ev->avoid_dist },
+		{ "align_dist",     SCENARIO_ALIGN_DIST,     &ev->align_dist },
+		{ "cohesion_dist",  SCENARIO_COHESION_DIST,  &ev->cohesion_dist },
+		{ "knn",            SCENARIO_KNN,            &ev->knn },
+		{ "steer_interval", SCENARIO_STEER_INTERVAL, &ev->steer_interval },
+	};
+	const struct {
+		const gchar *key;
+		guint flag;
+		guint *val;
+		const gchar **names;
+		guint num;
+	} enums[] = {
+		{ "interaction", SCENARIO_INTERACTION, &ev->interaction,
+		  scenario_interactions, G_N_ELEMENTS(scenario_interactions) },
+		{ "index",       SCENARIO_INDEX,       &ev->index,
+		  scenario_indexes, G_N_ELEMENTS(scenario_indexes) },
+		{ "mouse_mode",  SCENARIO_MOUSE_MODE,  &ev->mouse_mode,
+		  scenario_mouse_modes, G_N_ELEMENTS(scenario_mouse_modes) },
+	};
+	GError *error = NULL;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(bools); i++) {
+		if (scenario_get_bool(kf, group, bools[i].key, bools[i].val))
+			ev->set |= bools[i].flag;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS(uints); i++) {
+		if (scenario_get_uint(kf, group, uints[i].key, uints[i].val))
+			ev->set |= uints[i].flag;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS(enums); i++) {
+		if (scenario_get_enum(kf, group, enums[i].key, enums[i].names,
+				      enums[i].num, enums[i].val))
+			ev->set |= enums[i].flag;
+	}
+
+	ev->speed = g_key_file_get_double(kf, group, "speed", &error);
+	if (!error)
+		ev->set |= SCENARIO_SPEED;
+	g_clear_error(&error);
+
+	ev->obstacles = scenario_get_points(kf, group, "obstacles");
+	ev->removed = scenario_get_points(kf, group, "remove_obstacles");
+	ev->polygons = scenario_get_polygons(kf, group, "polygons");
+	ev->mouse = scenario_get_points(kf, group, "mouse");
+	if (!scenario_get_uint(kf, group, "mouse_steps", &ev->mouse_steps) ||
+	    !ev->mouse_steps)
+		ev->mouse_steps = 1;
+}
+
+static gint scenario_event_cmp(gconstpointer a, gconstpointer b)
+{
+	const ScenarioEvent *ea = a;
+	const ScenarioEvent *eb = b;
+
+	if (ea->step != eb->step)
+		return ea->step < eb->step ? -1 : 1;
+
+	return ea->order < eb->order ? -1 : ea->order > eb->order;
+}
+
+Scenario *scenario_load(const gchar *filename)
+{
+	GError *error = NULL;
+	GKeyFile *kf;
+	Scenario *sc;
+	ScenarioEvent ev;
+	gchar **groups;
+	guint64 step;
+	guint i;
+
+	kf = g_key_file_new();
+	if (!g_key_file_load_from_file(kf, filename, G_KEY_FILE_NONE, &error)) {
+		g_fprintf(stderr, "Failed to read %s: %s\n", filename,
+			  error->message);
+		g_error_free(error);
+		g_key_file_free(kf);
+		return NULL;
+	}
+
+	sc = g_new0(Scenario, 1);
+	sc->events = g_array_new(FALSE, FALSE, sizeof(ScenarioEvent));
+
+	scenario_get_uint(kf, SCENARIO_GROUP, "seed", &sc->seed);
+	scenario_parse_event(kf, SCENARIO_GROUP, &sc->setup);
+
+	groups = g_key_file_get_groups(kf, NULL);
+	for (i = 0; groups[i]; i++) {
+		if (!g_strcmp0(groups[i], SCENARIO_GROUP))
+			continue;
+
+		if (sscanf(groups[i], "step %" G_GUINT64_FORMAT, &step) != 1) {
+			g_fprintf(stderr, "Scenario: unknown group [%s]\n",
+				  groups[i]);
+			continue;
+		}
+
+		memset(&ev, 0, sizeof(ev));
+		ev.step = step;
+		ev.order = i;
+		scenario_parse_event(kf, groups[i], &ev);
+		g_array_append_val(sc->events, ev);
+	}
+	g_strfreev(groups);
+
+	g_array_sort(sc->events, scenario_event_cmp);
+
+	g_key_file_free(kf);
+
+	return sc;
+}
+
+static void scenario_apply(Scenario *sc, Swarm *swarm, ScenarioEvent *ev)
+{
+	gint width, height;
+	GArray *points;
+	Vector *p;
+	guint i;
+
+	/* First the sizes, the new boids are spread over the field */
+	if (ev->set & (SCENARIO_WIDTH | SCENARIO_HEIGHT)) {
+		swarm_get_sizes(swarm, &width, &height);
+		if (ev->set & SCENARIO_WIDTH)
+			width = ev->width;
+		if (ev->set & SCENARIO_HEIGHT)
+			height = ev->height;
+		swarm_set_sizes(swarm, CLAMP(width, 1, WORLD_SIZE_MAX),
+				CLAMP(height, 1, WORLD_SIZE_MAX));
+	}
+
+	if (ev->set & SCENARIO_BOIDS)
+		swarm_set_num_boids(swarm, ev->num_boids);
+	if (ev->set & SCENARIO_SPEED)
+		swarm_set_speed(swarm, ev->speed);
+	if (ev->set & SCENARIO_DEAD_ANGLE) {
+		swarm_set_rule_active(swarm, RULE_DEAD_ANGLE, ev->dead_angle > 0);
+		if (ev->dead_angle)
+			swarm_set_dead_angle(swarm, ev->dead_angle);
+	}
+	if (ev->set & SCENARIO_AVOID)
+		swarm_set_rule_active(swarm, RULE_AVOID, ev->avoid);
+	if (ev->set & SCENARIO_ALIGN)
+		swarm_set_rule_active(swarm, RULE_ALIGN, ev->align);
+	if (ev->set & SCENARIO_COHESION)
+		swarm_set_rule_active(swarm, RULE_COHESION, ev->cohesion);
+	if (ev->set & SCENARIO_AVOID_DIST)
+		swarm_set_rule_dist(swarm, RULE_AVOID, ev->avoid_dist);
+	if (ev->set & SCENARIO_ALIGN_DIST)
+		swarm_set_rule_dist(swarm, RULE_ALIGN, ev->align_dist);
+	if (ev->set & SCENARIO_COHESION_DIST)
+		swarm_set_rule_dist(swarm, RULE_COHESION, ev->cohesion_dist);
+	if (ev->set & SCENARIO_INTERACTION)
+		swarm_set_interaction_mode(swarm, ev->interaction);
+	if (ev->set & SCENARIO_KNN)
+		swarm_set_knn(swarm, CLAMP(ev->knn, KNN_MIN, KNN_MAX));
+	if (ev->set & SCENARIO_INDEX)
+		swarm_set_neighbor_index(swarm, ev->index);
+	if (ev->set & SCENARIO_STEER_INTERVAL)
+		swarm_set_steer_interval(swarm, CLAMP(ev->steer_interval, 1,
+						      STEER_INTERVAL_MAX));
+
+	/* These add or remove obstacles, only on actual changes */
+	if ((ev->set & SCENARIO_WALLS) &&
+	    ev->walls != swarm_get_walls_enable(swarm))
+		swarm_set_walls_enable(swarm, ev->walls);
+	if ((ev->set & SCENARIO_PREDATOR) &&
+	    ev->predator != swarm_get_predator_enable(swarm))
+		swarm_set_predator_enable(swarm, ev->predator);
+	if ((ev->set & SCENARIO_MOUSE_MODE) &&
+	    ev->mouse_mode != swarm_get_mouse_mode(swarm))
+		swarm_set_mouse_mode(swarm, ev->mouse_mode);
+
+	for (i = 0; i < ev->removed->len; i++) {
+		p = &g_array_index(ev->removed, Vector, i);
+		swarm_remove_obstacle(swarm, p->x, p->y);
+	}
+
+	for (i = 0; i < ev->obstacles->len; i++) {
+		p = &g_array_index(ev->obstacles, Vector, i);
+		swarm_add_obstacle(swarm, p->x, p->y, OBSTACLE_TYPE_IN_FIELD);
+	}
+
+	for (i = 0; i < ev->polygons->len; i++) {
+		points = g_ptr_array_index(ev->polygons, i);
+		swarm_add_polygon(swarm, (Vector *)points->data, points->len);
+	}
+
+	if (ev->mouse->len) {
+		sc->mouse = ev;
+		sc->mouse_start = swarm->step;
+	}
+}
+
+/* Move the mouse along the current path, it stays at the last point */
+static void scenario_move_mouse(Scenario *sc, Swarm *swarm)
+{
+	GArray *path = sc->mouse->mouse;
+	gdouble t = (gdouble)(swarm->step - sc->mouse_start) /
+		    sc->mouse->mouse_steps;
+	guint seg = t;
+	Vector *p0, *p1;
+
+	if (seg + 1 >= path->len) {
+		p0 = &g_array_index(path, Vector, path->len - 1);
+		swarm_set_mouse_pos(swarm, p0->x, p0->y);
+		sc->mouse = NULL;
+		return;
+	}
+
+	t -= seg;
+	p0 = &g_array_index(path, Vector, seg);
+	p1 = &g_array_index(path, Vector, seg + 1);
+	swarm_set_mouse_pos(swarm, p0->x + (p1->x - p0->x) * t,
+			    p0->y + (p1->y - p0->y) * t);
+}
+
+gboolean scenario_get_world_size(Scenario *sc, gint *width, gint *height)
+{
+	if (!(sc->setup.set & SCENARIO_WIDTH) ||
+	    !(sc->setup.set & SCENARIO_HEIGHT))
+		return FALSE;
+
+	*width = CLAMP(sc->setup.width, 1, WORLD_SIZE_MAX);
+	*height = CLAMP(sc->setup.height, 1, WORLD_SIZE_MAX);
+
+	return TRUE;
+}
+
+/*
+ * Apply the initial setup over the current settings and start the
+ * replay. The swarm takes the scenario over.
+ */
+void scenario_setup(Scenario *sc, Swarm *swarm)
+{
+	sc->start = swarm->step;
+	sc->next = 0;
+	sc->mouse = NULL;
+
+	scenario_apply(sc, swarm, &sc->setup);
+
+	if (sc->seed)
+		g_random_set_seed(sc->seed);
+	swarm_reset_boids(swarm);
+
+	swarm->scenario = sc;
+}
+
+/* Called by swarm_move() before each step */
+void scenario_update(Swarm *swarm)
+{
+	Scenario *sc = swarm->scenario;
+	ScenarioEvent *ev;
+
+	while (sc->next < sc->events->len) {
+		ev = &g_array_index(sc->events, ScenarioEvent, sc->next);
+		if (ev->step > swarm->step - sc->start)
+			break;
+
+		scenario_apply(sc, swarm, ev);
+		sc->next++;
+	}
+
+	if (sc->mouse)
+		scenario_move_mouse(sc, swarm);
+}
+
+static void scenario_free_event(ScenarioEvent *ev)
+{
+	guint i;
+
+	g_array_free(ev->obstacles, TRUE);
+	g_array_free(ev->removed, TRUE);
+	for (i = 0; i < ev->polygons->len; i++)
+		g_array_free(g_ptr_array_index(ev->polygons, i), TRUE);
+	g_ptr_array_free(ev->polygons, TRUE);
+	g_array_free(ev->mouse, TRUE);
+}
+
+void scenario_free(Scenario *sc)
+{
+	guint i;
+
+	if (!sc)
+		return;
+
+	scenario_free_event(&sc->setup);
+	for (i = 0; i < sc->events->len; i++)
+		scenario_free_event(&g_array_index(sc->events, ScenarioEvent, i));
+	g_array_free(sc->events, TRUE);
+	g_free(sc);
+}
+
+/* Exact and locale independent "x,y" */
+static gchar *scenario_point_to_string(gdouble x, gdouble y)
+{
+	gchar bx[G_ASCII_DTOSTR_BUF_SIZE];
+	gchar by[G_ASCII_DTOSTR_BUF_SIZE];
+
+	return g_strdup_printf("%s,%s", g_ascii_dtostr(bx, sizeof(bx), x),
+			       g_ascii_dtostr(by, sizeof(by), y));
+}
+
+static void scenario_append_point(GKeyFile *kf, const gchar *group,
+				  const gchar *key, gdouble x, gdouble y)
+{
+	gchar *point = scenario_point_to_string(x, y);
+	gchar *list = g_key_file_get_string(kf, group, key, NULL);
+	gchar *val;
+
+	val = list ? g_strconcat(list, ";", point, NULL) : g_strdup(point);
+	g_key_file_set_string(kf, group, key, val);
+
+	g_free(val);
+	g_free(list);
+	g_free(point);
+}
+
+/* Write the current value of the setting key of the swarm */
+static void scenario_write_key(GKeyFile *kf, const gchar *group,
+			       Swarm *swarm, const gchar *key)
+{
+	gint width, height;
+	gchar *point;
+
+	swarm_get_sizes(swarm, &width, &height);
+
+	if (!g_strcmp0(key, "width"))
+		g_key_file_set_integer(kf, group, key, width);
+	else if (!g_strcmp0(key, "height"))
+		g_key_file_set_integer(kf, group, key, height);
+	else if (!g_strcmp0(key, "boids"))
+		g_key_file_set_integer(kf, group, key,
+				       swarm_get_num_boids(swarm));
+	else if (!g_strcmp0(key, "speed"))
+		g_key_file_set_double(kf, group, key, swarm_get_speed(swarm));
+	else if (!g_strcmp0(key, "dead_angle"))
+		g_key_file_set_integer(kf, group, key,
+			swarm_get_rule_active(swarm, RULE_DEAD_ANGLE) ?
+			swarm_get_dead_angle(swarm) : 0);
+	else if (!g_strcmp0(key, "avoid"))
+		g_key_file_set_boolean(kf, group, key,
+			swarm_get_rule_active(swarm, RULE_AVOID));
+	else if (!g_strcmp0(key, "align"))
+		g_key_file_set_boolean(kf, group, key,
+			swarm_get_rule_active(swarm, RULE_ALIGN));
+	else if (!g_strcmp0(key, "cohesion"))
+		g_key_file_set_boolean(kf, group, key,
+			swarm_get_rule_active(swarm, RULE_COHESION));
+	else if (!g_strcmp0(key, "avoid_dist"))
+		g_key_file_set_integer(kf, group, key,
+			swarm_get_rule_dist(swarm, RULE_AVOID));
+	else if (!g_strcmp0(key, "align_dist"))
+		g_key_file_set_integer(kf, group, key,
+			swarm_get_rule_dist(swarm, RULE_ALIGN));
+	else if (!g_strcmp0(key, "cohesion_dist"))
+		g_key_file_set_integer(kf, group, key,
+			swarm_get_rule_dist(swarm, RULE_COHESION));
+	else if (!g_strcmp0(key, "interaction"))
+		g_key_file_set_string(kf, group, key,
+			scenario_interactions[swarm_get_interaction_mode(swarm)]);
+	else if (!g_strcmp0(key, "knn"))
+		g_key_file_set_integer(kf, group, key, swarm_get_knn(swarm));
+	else if (!g_strcmp0(key, "index"))
+		g_key_file_set_string(kf, group, key,
+			scenario_indexes[swarm_get_neighbor_index(swarm)]);
+	else if (!g_strcmp0(key, "steer_interval"))
+		g_key_file_set_integer(kf, group, key,
+			swarm_get_steer_interval(swarm));
+	else if (!g_strcmp0(key, "walls"))
+		g_key_file_set_boolean(kf, group, key,
+			swarm_get_walls_enable(swarm));
+	else if (!g_strcmp0(key, "predator"))
+		g_key_file_set_boolean(kf, group, key,
+			swarm_get_predator_enable(swarm));
+	else if (!g_strcmp0(key, "mouse_mode"))
+		g_key_file_set_string(kf, group, key,
+			scenario_mouse_modes[swarm_get_mouse_mode(swarm)]);
+	else if (!g_strcmp0(key, "mouse")) {
+		point = scenario_point_to_string(swarm->mouse_pos.x,
+						 swarm->mouse_pos.y);
+		g_key_file_set_string(kf, group, key, point);
+		g_free(point);
+	} else {
+		g_warn_if_reached();
+	}
+}
+
+/* The segments of a polygon follow each other in the obstacles */
+static void scenario_write_polygons(GKeyFile *kf, const gchar *group,
+				    Swarm *swarm)
+{
+	GString *val = g_string_new(NULL);
+	Obstacle *prev = NULL;
+	Obstacle *next;
+	Obstacle *o;
+	gchar *point;
+	guint n = swarm_num_obstacles(swarm);
+	guint i;
+
+	for (i = 0; i < n; i++, prev = o) {
+		o = swarm_get_obstacle(swarm, i);
+		if (o->shape != OBSTACLE_SHAPE_SEGMENT)
+			continue;
+
+		if (prev && prev->polygon == o->polygon)
+			g_string_append_c(val, ';');
+		else if (val->len)
+			g_string_append(val, ";;");
+
+		point = scenario_point_to_string(o->pos.x, o->pos.y);
+		g_string_append(val, point);
+		g_free(point);
+
+		/* A single segment, the polygons are closed */
+		next = i + 1 < n ? swarm_get_obstacle(swarm, i + 1) : NULL;
+		if ((!prev || prev->polygon != o->polygon) &&
+		    (!next || next->polygon != o->polygon)) {
+			point = scenario_point_to_string(o->end.x, o->end.y);
+			g_string_append_printf(val, ";%s", point);
+			g_free(point);
+		}
+	}
+
+	if (val->len)
+		g_key_file_set_string(kf, group, "polygons", val->str);
+
+	g_string_free(val, TRUE);
+}
+
+/*
+ * Start recording the changes made to the swarm from now on. The boids
+ * are placed again from a new seed so the recording can be replayed from
+ * the very same state.
+ */
+ScenarioRecord *scenario_record_start(Swarm *swarm)
+{
+	ScenarioRecord *rec;
+	Vector *p;
+	guint seed;
+	guint i;
+
+	rec = g_new0(ScenarioRecord, 1);
+	rec->kf = g_key_file_new();
+	rec->start = swarm->step;
+
+	seed = g_random_int_range(1, G_MAXINT32);
+	g_random_set_seed(seed);
+	swarm_reset_boids(swarm);
+
+	g_key_file_set_integer(rec->kf, SCENARIO_GROUP, "seed", seed);
+	for (i = 0; i < G_N_ELEMENTS(scenario_keys); i++)
+		scenario_write_key(rec->kf, SCENARIO_GROUP, swarm,
+				   scenario_keys[i]);
+
+	for (i = 0; i < swarm_num_obstacles(swarm); i++) {
+		if (swarm_get_obstacle_type(swarm, i) != OBSTACLE_TYPE_IN_FIELD)
+			continue;
+
+		if (swarm_get_obstacle(swarm, i)->shape == OBSTACLE_SHAPE_SEGMENT)
+			continue;
+
+		p = swarm_get_obstacle_pos(swarm, i);
+		scenario_append_point(rec->kf, SCENARIO_GROUP, "obstacles",
+				      p->x, p->y);
+	}
+
+	scenario_write_polygons(rec->kf, SCENARIO_GROUP, swarm);
+
+	return rec;
+}
+
+static guint scenario_apply_rank(const gchar *key)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(scenario_apply_order); i++) {
+		if (!g_strcmp0(key, scenario_apply_order[i]))
+			return i;
+	}
+
+	g_warn_if_reached();
+	return 0;
+}
+
+/*
+ * The changes of a step go in one group as long as replaying the group
+ * makes them in the same order. Otherwise, i.e. a setting changed twice or
+ * an obstacle added before enabling the predator, a new group of the same
+ * step is started. The lists of points only grow, they can be appended to.
+ * Only the last mouse position before the step matters, it overwrites the
+ * one of the group unless a key was recorded after it.
+ */
+static const gchar *scenario_record_group(ScenarioRecord *rec, Swarm *swarm,
+					  const gchar *key)
+{
+	guint64 step = swarm->step - rec->start;
+	guint rank = scenario_apply_rank(key);
+	gboolean list = !g_strcmp0(key, "obstacles") ||
+			!g_strcmp0(key, "remove_obstacles");
+	gboolean latest = !g_strcmp0(key, "mouse") && rank == rec->group_rank;
+
+	if (!rec->group || rec->group_step != step) {
+		rec->group_step = step;
+		rec->group_num = 0;
+	} else if (rank < rec->group_rank ||
+		   (!list && !latest &&
+		    g_key_file_has_key(rec->kf, rec->group, key, NULL))) {
+		rec->group_num++;
+	} else {
+		rec->group_rank = rank;
+		return rec->group;
+	}
+
+	rec->group_rank = rank;
+
+	g_free(rec->group);
+	if (rec->group_num)
+		rec->group = g_strdup_printf("step %" G_GUINT64_FORMAT " #%u",
+					     step, rec->group_num);
+	else
+		rec->group = g_strdup_printf("step %" G_GUINT64_FORMAT, step);
+
+	return rec->group;
+}
+
+/* Record the current value of a setting, called after changing it */
+void scenario_record(ScenarioRecord *rec, Swarm *swarm, const gchar *key)
+{
+	scenario_write_key(rec->kf, scenario_record_group(rec, swarm, key),
+			   swarm, key);
+}
+
+/* Record an obstacle added to or removed from the field */
+void scenario_record_obstacle(ScenarioRecord *rec, Swarm *swarm,
+			      gdouble x, gdouble y, gboolean removed)
+{
+	const gchar *key = removed ? "remove_obstacles" : "obstacles";
+
+	scenario_append_point(rec->kf, scenario_record_group(rec, swarm, key),
+			      key, x, y);
+}
+
+gboolean scenario_record_save(ScenarioRecord *rec, const gchar *filename)
+{
+	GError *error = NULL;
+
+	if (!g_key_file_save_to_file(rec->kf, filename, &error)) {
+		g_fprintf(stderr, "Failed to write %s: %s\n", filename,
+			  error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+void scenario_record_free(ScenarioRecord *rec)
+{
+	if (!rec)
+		return;
+
+	g_key_file_free(rec->kf);
+	g_free(rec->group);
+	g_free(rec);
+}
@@ -1,202 +1,1577 @@
 /* SPDX-License-Identifier: MIT */
 #include "boids.h"
 
-static gboolean swarm_avoid_obstacles(Swarm *swarm, Boid *boid, Vector *direction)
+/* Closest point of the obstacle to p */
+static inline void obstacle_closest_point(Obstacle *o, Vector *p, Vector *q)
+{
+	gdouble dx, dy;
+	gdouble len;
+	gdouble t = 0;
+
+	if (o->shape != OBSTACLE_SHAPE_SEGMENT) {
+		*q = o->pos;
+		return;
+	}
+
+	dx = o->end.x - o->pos.x;
+	dy = o->end.y - o->pos.y;
+	len = POW2(dx) + POW2(dy);
+	if (len > 0)
+		t = CLAMP(((p->x - o->pos.x) * dx + (p->y - o->pos.y) * dy) / len,
+			  0.0, 1.0);
+
+	vector_set(q, o->pos.x + t * dx, o->pos.y + t * dy);
+}
+
+static inline void swarm_set_mag(gboolean fast_math, Vector *v, gdouble mag)
+{
+	if (fast_math)
+		vector_fast_set_mag(v, mag);
+	else
+		vector_set_mag(v, mag);
+}
+
+static inline void swarm_avoid_obstacle(Obstacle *obs, Boid *boid,
+					Vector *direction, gboolean fast_math)
 {
-	int i;
 	gdouble dx, dy;
 	gdouble dist;
-	Obstacle *obs;
+	Vector q;
 	Vector v;
 
+	obstacle_closest_point(obs, &boid->pos, &q);
+
+	dx = q.x - boid->pos.x;
+	dy = q.y - boid->pos.y;
+	dist = POW2(dx) + POW2(dy);
+	if (dist >= obs->avoid_radius)
+		return;
+
+	v = boid->pos;
+	vector_sub(&v, &q);
+	if (fast_math)
+		vector_mult(&v, 4 * vector_rsqrt(dist));
+	else
+		vector_div(&v, sqrt(dist) / 4);
+	vector_add(direction, &v);
+}
+
+static gboolean swarm_avoid_obstacles(Swarm *swarm, Boid *boid, Vector *direction)
+{
+	BvhNode *leaf;
+	BvhIter it;
+	Obstacle *obs;
+	guint i;
+
 	vector_init(direction);
 
+	/* The moving obstacles are prepended and not in the hierarchy */
 	for (i = 0; i < swarm->obstacles->len; i++) {
 		obs = swarm_get_obstacle(swarm, i);
+		if (obs->type != OBSTACLE_TYPE_SCARY_MOUSE &&
+		    obs->type != OBSTACLE_TYPE_PREDATOR)
+			break;
+
+		swarm_avoid_obstacle(obs, boid, direction, swarm->fast_math);
+	}
+
+	bvh_iter_init(&swarm->bvh, &it);
+	while ((leaf = bvh_iter_next(&swarm->bvh, &it,
+				     boid->pos.x, boid->pos.y))) {
+		for (i = leaf->first; i < leaf->first + leaf->count; i++)
+			swarm_avoid_obstacle(swarm_get_obstacle(swarm,
+						swarm->bvh.items[i]),
+					     boid, direction, swarm->fast_math);
+	}
+
+	if (vector_is_null(direction))
+		return FALSE;
+
+	swarm_set_mag(swarm->fast_math, direction, 5);
+
+	return TRUE;
+}
 
-		dx = obs->pos.x - boid->pos.x;
-		dy = obs->pos.y - boid->pos.y;
+static void swarm_update_bvh(Swarm *swarm)
+{
+	if (!swarm->bvh_dirty)
+		return;
+
+	bvh_build(&swarm->bvh, swarm->obstacles);
+	swarm->bvh_dirty = FALSE;
+}
+
+/*
+ * The boids wrap around the field edges so the distance between 2 boids is
+ * the shortest one among the periodic images, unless the walls make the
+ * field closed.
+ */
+static inline void swarm_wrap_delta(Swarm *swarm, gdouble *dx, gdouble *dy)
+{
+	if (swarm->walls)
+		return;
+
+	if (*dx > swarm->width * 0.5)
+		*dx -= swarm->width;
+	else if (*dx < -swarm->width * 0.5)
+		*dx += swarm->width;
+
+	if (*dy > swarm->height * 0.5)
+		*dy -= swarm->height;
+	else if (*dy < -swarm->height * 0.5)
+		*dy += swarm->height;
+}
+
+static void swarm_move_predator(Swarm *swarm)
+{
+	Obstacle *predator;
+	Vector cohesion;
+	Boid *b;
+	int i;
+	int cohesion_n;
+	gdouble dx, dy;
+	gdouble dist;
+
+	if (!swarm->predator)
+		return;
+
+	predator = swarm_get_obstacle_by_type(swarm, OBSTACLE_TYPE_PREDATOR);
+
+	vector_init(&cohesion);
+	cohesion_n = 0;
+
+	for (i = 0; i < swarm_get_num_boids(swarm); i++) {
+		b = swarm_get_boid(swarm, i);
+
+		dx = b->pos.x - predator->pos.x;
+		dy = b->pos.y - predator->pos.y;
+		swarm_wrap_delta(swarm, &dx, &dy);
 		dist = POW2(dx) + POW2(dy);
-		if (dist >= obs->avoid_radius)
+		if (dist >= POW2(swarm->cohesion_dist))
 			continue;
 
-		dist = sqrt(dist);
+		/* Sum of the offsets to the boids rather than their positions */
+		cohesion_n++;
+		cohesion.x += dx;
+		cohesion.y += dy;
+	}
+
+	if (cohesion_n) {
+		vector_div(&cohesion, cohesion_n);
+		vector_set_mag(&cohesion, 0.5);
+	} else {
+		cohesion = predator->velocity;
+	}
+
+	vector_add(&predator->velocity, &cohesion);
+	vector_set_mag(&predator->velocity,
+		       swarm->speed * (cohesion_n ? 1.2 : 0.8));
+	vector_add(&predator->pos, &predator->velocity);
+
+	predator->pos.x = fmod(predator->pos.x + swarm->width, swarm->width);
+	predator->pos.y = fmod(predator->pos.y + swarm->height, swarm->height);
+}
+
+typedef struct {
+	Vector avoid;
+	Vector align;
+	/* Sum of the offsets to the cohesion neighbors */
+	Vector cohesion;
+	gint cohesion_n;
+} Steering;
+
+typedef struct {
+	/* Squared distance, the heap is ordered on it */
+	gdouble dist;
+	guint idx;
+} KnnEntry;
+
+/*
+ * Rules and options of a step. The steering kernels are instantiated for each
+ * combination with constant flags, so the tests of the inactive rules are
+ * folded away at compile time. The kernel is selected once per step.
+ */
+enum {
+	STEER_AVOID       = 1 << 0,
+	STEER_ALIGN       = 1 << 1,
+	STEER_COHESION    = 1 << 2,
+	STEER_DEAD_ANGLE  = 1 << 3,
+	STEER_DEBUG       = 1 << 4,
+	STEER_FAST_MATH   = 1 << 5,
+	STEER_NUM_KERNELS = 1 << 6,
+};
+
+/* Inlined in each kernel, even with many instances */
+#define STEER_INLINE static inline __attribute__((always_inline))
+
+static inline guint swarm_steer_flags(Swarm *swarm)
+{
+	return (swarm->avoid ? STEER_AVOID : 0) |
+	       (swarm->align ? STEER_ALIGN : 0) |
+	       (swarm->cohesion ? STEER_COHESION : 0) |
+	       (swarm->dead_angle ? STEER_DEAD_ANGLE : 0) |
+	       (swarm->debug_vectors ? STEER_DEBUG : 0) |
+	       (swarm->fast_math ? STEER_FAST_MATH : 0);
+}
 
-		v = boid->pos;
-		vector_sub(&v, &obs->pos);
-		vector_div(&v, dist / 4);
-		vector_add(direction, &v);
+STEER_INLINE gboolean swarm_boid_sees(Swarm *swarm, guint flags, Boid *b,
+				      gdouble dx, gdouble dy)
+{
+	gdouble dot, mag2, cos2;
+	Vector v;
+
+	if (!(flags & STEER_DEAD_ANGLE))
+		return TRUE;
+
+	vector_set(&v, dx, dy);
+
+	/* Squared cosine against the squared cosine of the dead angle */
+	if (flags & STEER_FAST_MATH) {
+		dot = vector_dot(&b->velocity, &v);
+		mag2 = vector_dot(&b->velocity, &b->velocity) *
+		       vector_dot(&v, &v);
+		/* The cosine of a null vector is NaN */
+		if (!mag2)
+			return FALSE;
+
+		cos2 = POW2(swarm->cos_dead_angle) * mag2;
+		if (dot >= 0)
+			return swarm->cos_dead_angle <= 0 || POW2(dot) >= cos2;
+
+		return swarm->cos_dead_angle < 0 && POW2(dot) <= cos2;
+	}
+
+	return vector_cos_angle(&b->velocity, &v) >= swarm->cos_dead_angle;
+}
+
+/* Distance from its square, and its inverse with the fast math */
+STEER_INLINE gdouble swarm_steer_dist(guint flags, gdouble dist2,
+				      gdouble *inv_dist)
+{
+	if (flags & STEER_FAST_MATH) {
+		*inv_dist = vector_rsqrt(dist2);
+		return dist2 * *inv_dist;
+	}
+
+	*inv_dist = 0;
+
+	return sqrt(dist2);
+}
+
+STEER_INLINE void swarm_steer_div(guint flags, Vector *v, gdouble dist,
+				  gdouble inv_dist)
+{
+	if (flags & STEER_FAST_MATH)
+		vector_mult(v, inv_dist);
+	else
+		vector_div(v, dist);
+}
+
+/*
+ * The approximate distance would move the neighbors close to a rule
+ * distance to the next rule, the fast math compares the squares.
+ */
+STEER_INLINE gboolean swarm_steer_within(guint flags, gdouble dist2,
+					 gdouble dist, guint rule_dist)
+{
+	if (flags & STEER_FAST_MATH)
+		return dist2 < POW2((gdouble)rule_dist);
+
+	return dist < rule_dist;
+}
+
+/*
+ * (dx, dy) is the offset from the steered boid to its neighbor b2, at the
+ * squared distance dist2, dist and inv_dist are from swarm_steer_dist().
+ */
+STEER_INLINE void swarm_steer_add(Swarm *swarm, guint flags, Steering *st,
+				  Boid *b2, gdouble dx, gdouble dy,
+				  gdouble dist2, gdouble dist, gdouble inv_dist)
+{
+	Vector v;
+
+	if ((flags & STEER_AVOID) &&
+	    swarm_steer_within(flags, dist2, dist, swarm->avoid_dist)) {
+		vector_set(&v, -dx, -dy);
+		swarm_steer_div(flags, &v, dist, inv_dist);
+		vector_add(&st->avoid, &v);
+	} else if ((flags & STEER_ALIGN) &&
+		   swarm_steer_within(flags, dist2, dist, swarm->align_dist)) {
+		v = b2->velocity;
+		swarm_steer_div(flags, &v, dist, inv_dist);
+		vector_add(&st->align, &v);
+	} else if ((flags & STEER_COHESION) &&
+		   swarm_steer_within(flags, dist2, dist,
+				      swarm->cohesion_dist)) {
+		st->cohesion_n++;
+		st->cohesion.x += dx;
+		st->cohesion.y += dy;
+	}
+}
+
+STEER_INLINE void swarm_steer_normalize(guint flags, Boid *b, Steering *st)
+{
+	if (!vector_is_null(&st->align))
+		swarm_set_mag(flags & STEER_FAST_MATH, &st->align, 3.5);
+
+	if (st->cohesion_n) {
+		vector_div(&st->cohesion, st->cohesion_n);
+		swarm_set_mag(flags & STEER_FAST_MATH, &st->cohesion, 0.5);
+	}
+}
+
+STEER_INLINE void swarm_steer_finish(Swarm *swarm, guint flags, Boid *b,
+				     Steering *st)
+{
+	swarm_steer_normalize(flags, b, st);
+
+	b->steer = st->avoid;
+	vector_add(&b->steer, &st->align);
+	vector_add(&b->steer, &st->cohesion);
+
+	if (flags & STEER_DEBUG) {
+		b->avoid = st->avoid;
+		b->align = st->align;
+		b->cohesion = st->cohesion;
+	}
+}
+
+/* Steer b1 with b2 if it sees it within the cohesion distance */
+STEER_INLINE void swarm_steer_neighbor(Swarm *swarm, guint flags,
+				       Steering *st, Boid *b1, Boid *b2)
+{
+	gdouble inv_dist;
+	gdouble dist2;
+	gdouble dist;
+	gdouble dx, dy;
+
+	if (!(flags & (STEER_AVOID | STEER_ALIGN | STEER_COHESION)))
+		return;
+
+	/* Avoid a bunch os useless sqrt */
+	dx = b2->pos.x - b1->pos.x;
+	dy = b2->pos.y - b1->pos.y;
+	swarm_wrap_delta(swarm, &dx, &dy);
+	dist2 = POW2(dx) + POW2(dy);
+	if (dist2 >= POW2(swarm->cohesion_dist))
+		return;
+
+	if (!swarm_boid_sees(swarm, flags, b1, dx, dy))
+		return;
+
+	/* Do the sqrt only when really needed */
+	dist = swarm_steer_dist(flags, dist2, &inv_dist);
+	swarm_steer_add(swarm, flags, st, b2, dx, dy, dist2, dist, inv_dist);
+}
+
+STEER_INLINE void swarm_steer_metric(Swarm *swarm, guint flags, guint i,
+				     Steering *st)
+{
+	Boid *b1 = swarm_get_boid(swarm, i);
+	guint j;
+
+	for (j = 0; j < swarm_get_num_boids(swarm); j++) {
+		if (j == i)
+			continue;
+
+		swarm_steer_neighbor(swarm, flags, st, b1,
+				     swarm_get_boid(swarm, j));
+	}
+}
+
+struct _SteerWorker {
+	Swarm *swarm;
+	guint id;
+	/* Thread private steering of each boid, reduced after the join */
+	Steering *acc;
+	guint acc_alloc;
+};
+
+/*
+ * Steer i and j with each other. The distance is computed once for both,
+ * but the dead angle is checked from each side as it depends on the
+ * heading of the steered boid.
+ */
+STEER_INLINE void swarm_steer_pair(Swarm *swarm, guint flags, Steering *acc,
+				   guint i, guint j)
+{
+	Boid *b1 = swarm_get_boid(swarm, i);
+	Boid *b2 = swarm_get_boid(swarm, j);
+	gboolean sees1, sees2;
+	gdouble inv_dist;
+	gdouble dist2;
+	gdouble dist;
+	gdouble dx, dy;
+
+	dx = b2->pos.x - b1->pos.x;
+	dy = b2->pos.y - b1->pos.y;
+	swarm_wrap_delta(swarm, &dx, &dy);
+	dist2 = POW2(dx) + POW2(dy);
+	if (dist2 >= POW2(swarm->cohesion_dist))
+		return;
+
+	sees1 = swarm_boid_sees(swarm, flags, b1, dx, dy);
+	sees2 = swarm_boid_sees(swarm, flags, b2, -dx, -dy);
+	if (!sees1 && !sees2)
+		return;
+
+	dist = swarm_steer_dist(flags, dist2, &inv_dist);
+
+	if (sees1)
+		swarm_steer_add(swarm, flags, &acc[i], b2, dx, dy, dist2, dist,
+				inv_dist);
+	if (sees2)
+		swarm_steer_add(swarm, flags, &acc[j], b1, -dx, -dy, dist2,
+				dist, inv_dist);
+}
+
+/* The quadtree stands in for the Verlet lists over their budget */
+static inline NeighborIndex swarm_step_index(Swarm *swarm)
+{
+	if (swarm->index == NEIGHBOR_INDEX_VERLET && swarm->verlet.overflow)
+		return NEIGHBOR_INDEX_QUADTREE;
+
+	return swarm->index;
+}
+
+/* Pairs (i, j > i) of the rows of a worker */
+STEER_INLINE void swarm_steer_rows(SteerWorker *w, guint flags)
+{
+	Swarm *swarm = w->swarm;
+	VerletList *vl = &swarm->verlet;
+	guint num_boids = swarm_get_num_boids(swarm);
+	guint i, j;
+
+	TRACE_BEGIN("steer_rows");
+
+	memset(w->acc, 0, sizeof(Steering) * num_boids);
+
+	/* Interleaved rows balance the shorter rows of the last boids */
+	for (i = w->id; i < num_boids; i += swarm->num_threads) {
+		if (swarm_step_index(swarm) == NEIGHBOR_INDEX_VERLET) {
+			for (j = vl->start[i]; j < vl->start[i + 1]; j++) {
+				if (vl->neighbors[j] > i)
+					swarm_steer_pair(swarm, flags, w->acc,
+							 i, vl->neighbors[j]);
+			}
+		} else {
+			for (j = i + 1; j < num_boids; j++)
+				swarm_steer_pair(swarm, flags, w->acc, i, j);
+		}
+	}
+
+	TRACE_END("steer_rows");
+}
+
+STEER_INLINE void swarm_steer_quadtree(Swarm *swarm, guint flags, guint i,
+				       Steering *st)
+{
+	guint stack[QUADTREE_STACK_SIZE];
+	QuadTree *qt = &swarm->quadtree;
+	QuadNode *node;
+	Boid *b1 = swarm_get_boid(swarm, i);
+	gdouble max_dist = POW2(swarm->cohesion_dist);
+	guint n = 0;
+	guint j;
+
+	stack[n++] = 0;
+
+	while (n) {
+		node = &qt->nodes[stack[--n]];
+
+		if (quadtree_node_dist(qt, node, b1->pos.x, b1->pos.y) >= max_dist)
+			continue;
+
+		if (node->num_children) {
+			for (j = 0; j < node->num_children; j++)
+				stack[n++] = node->first_child + j;
+			continue;
+		}
+
+		for (j = node->start; j < node->end; j++) {
+			if (qt->boids[j] == i)
+				continue;
+
+			swarm_steer_neighbor(swarm, flags, st, b1,
+					     swarm_get_boid(swarm, qt->boids[j]));
+		}
+	}
+}
+
+static inline guint32 swarm_morton_code(Swarm *swarm, Vector *pos)
+{
+	return morton_code(pos->x, pos->y, swarm->width, swarm->height);
+}
+
+static gint morton_key_cmp(gconstpointer a, gconstpointer b)
+{
+	const MortonKey *ka = a;
+	const MortonKey *kb = b;
+
+	if (ka->code != kb->code)
+		return ka->code < kb->code ? -1 : 1;
+
+	return ka->idx < kb->idx ? -1 : (ka->idx > kb->idx);
+}
+
+STEER_INLINE void swarm_steer_verlet(Swarm *swarm, guint flags, guint i,
+				     Steering *st)
+{
+	VerletList *vl = &swarm->verlet;
+	Boid *b1 = swarm_get_boid(swarm, i);
+	guint j;
+
+	for (j = vl->start[i]; j < vl->start[i + 1]; j++)
+		swarm_steer_neighbor(swarm, flags, st, b1,
+				     swarm_get_boid(swarm, vl->neighbors[j]));
+}
+
+static void swarm_verlet_overflow(Swarm *swarm)
+{
+	VerletList *vl = &swarm->verlet;
+
+	if (!vl->overflow)
+		g_fprintf(stderr, "Verlet lists over %u neighbors, using the "
+			  "quadtree\n", VERLET_MAX_NEIGHBORS);
+
+	vl->valid = FALSE;
+	vl->overflow = TRUE;
+	vl->overflow_step = swarm->step;
+}
+
+/*
+ * Build the Verlet lists from a grid with cells as large as the list
+ * radius, so the neighbors of a boid are in the 3x3 cells around it.
+ */
+static void swarm_build_verlet(Swarm *swarm)
+{
+	VerletList *vl = &swarm->verlet;
+	Grid *grid = &swarm->grid;
+	guint num_boids = swarm_get_num_boids(swarm);
+	gdouble radius = swarm->cohesion_dist + vl->skin;
+	Boid *b1;
+	Boid *b2;
+	gdouble dx, dy;
+	guint n = 0;
+	guint i, j;
+	gint col, row;
+	gint dc, dr;
+	gint c;
+
+	TRACE_BEGIN("verlet_build");
+
+	grid_build(grid, swarm->boids, swarm->width, swarm->height, radius,
+		   !swarm->walls);
+
+	if (num_boids > vl->boids_alloc) {
+		vl->boids_alloc = num_boids;
+		vl->start = g_renew(guint, vl->start, num_boids + 1);
+		vl->build_pos = g_renew(Vector, vl->build_pos, num_boids);
+	}
+
+	for (i = 0; i < num_boids; i++) {
+		b1 = swarm_get_boid(swarm, i);
+		vl->start[i] = n;
+		vl->build_pos[i] = b1->pos;
+
+		grid_get_cell(grid, b1->pos.x, b1->pos.y, &col, &row);
+
+		for (dr = -1; dr <= 1; dr++) {
+			for (dc = -1; dc <= 1; dc++) {
+				c = grid_neighbor_cell(grid, col, row, dc, dr);
+				if (c < 0)
+					continue;
+
+				for (j = grid->cell_start[c]; j < grid->cell_start[c + 1]; j++) {
+					if (grid->cell_boids[j] == i)
+						continue;
+
+					b2 = swarm_get_boid(swarm, grid->cell_boids[j]);
+
+					dx = b2->pos.x - b1->pos.x;
+					dy = b2->pos.y - b1->pos.y;
+					swarm_wrap_delta(swarm, &dx, &dy);
+					if (POW2(dx) + POW2(dy) >= POW2(radius))
+						continue;
+
+					if (n == VERLET_MAX_NEIGHBORS) {
+						swarm_verlet_overflow(swarm);
+						TRACE_END("verlet_build");
+						return;
+					}
+
+					if (n == vl->neighbors_alloc) {
+						vl->neighbors_alloc = MIN(MAX(1024, n * 2),
+									  VERLET_MAX_NEIGHBORS);
+						vl->neighbors = g_renew(guint, vl->neighbors,
+									vl->neighbors_alloc);
+					}
+
+					vl->neighbors[n++] = grid->cell_boids[j];
+				}
+			}
+		}
+	}
+	vl->start[num_boids] = n;
+
+	vl->radius = radius;
+	vl->periodic = !swarm->walls;
+	vl->width = swarm->width;
+	vl->height = swarm->height;
+	vl->valid = TRUE;
+	vl->overflow = FALSE;
+	vl->builds++;
+
+	TRACE_END("verlet_build");
+}
+
+/*
+ * The lists hold every boid within cohesion_dist + skin. As long as no boid
+ * moved by more than skin / 2 since the build, no pair got closer than
+ * cohesion_dist without being listed.
+ */
+static void swarm_update_verlet(Swarm *swarm)
+{
+	VerletList *vl = &swarm->verlet;
+	gdouble max_move = POW2(vl->skin / 2);
+	gdouble dx, dy;
+	Boid *b;
+	guint i;
+
+	/* The quadtree steers until the next try */
+	if (vl->overflow &&
+	    swarm->step - vl->overflow_step < VERLET_RETRY_STEPS)
+		return;
+
+	vl->steps++;
+
+	if (!vl->valid || vl->radius != swarm->cohesion_dist + vl->skin ||
+	    vl->periodic != !swarm->walls || vl->width != swarm->width ||
+	    vl->height != swarm->height) {
+		swarm_build_verlet(swarm);
+		return;
+	}
+
+	for (i = 0; i < swarm_get_num_boids(swarm); i++) {
+		b = swarm_get_boid(swarm, i);
+
+		dx = b->pos.x - vl->build_pos[i].x;
+		dy = b->pos.y - vl->build_pos[i].y;
+		swarm_wrap_delta(swarm, &dx, &dy);
+		if (POW2(dx) + POW2(dy) > max_move) {
+			swarm_build_verlet(swarm);
+			return;
+		}
+	}
+}
+
+/*
+ * Renumber the Verlet lists after the boids array was reordered, new_index
+ * giving the new position of each boid of the old array.
+ */
+static void swarm_permute_verlet(Swarm *swarm, MortonKey *keys,
+				 guint *new_index)
+{
+	VerletList *vl = &swarm->verlet;
+	guint num_boids = swarm_get_num_boids(swarm);
+	guint *start;
+	guint *neighbors;
+	Vector *build_pos;
+	guint alloc;
+	guint n = 0;
+	guint i, j;
+
+	if (vl->spare_boids_alloc < vl->boids_alloc) {
+		vl->spare_boids_alloc = vl->boids_alloc;
+		vl->spare_start = g_renew(guint, vl->spare_start,
+					  vl->boids_alloc + 1);
+		vl->spare_build_pos = g_renew(Vector, vl->spare_build_pos,
+					      vl->boids_alloc);
+	}
+	if (vl->spare_neighbors_alloc < vl->neighbors_alloc) {
+		vl->spare_neighbors_alloc = vl->neighbors_alloc;
+		vl->spare_neighbors = g_renew(guint, vl->spare_neighbors,
+					      vl->neighbors_alloc);
+	}
+
+	start = vl->spare_start;
+	neighbors = vl->spare_neighbors;
+	build_pos = vl->spare_build_pos;
+
+	for (i = 0; i < num_boids; i++) {
+		start[i] = n;
+		build_pos[i] = vl->build_pos[keys[i].idx];
+
+		for (j = vl->start[keys[i].idx]; j < vl->start[keys[i].idx + 1]; j++)
+			neighbors[n++] = new_index[vl->neighbors[j]];
+	}
+	start[num_boids] = n;
+
+	vl->spare_start = vl->start;
+	vl->spare_neighbors = vl->neighbors;
+	vl->spare_build_pos = vl->build_pos;
+	vl->start = start;
+	vl->neighbors = neighbors;
+	vl->build_pos = build_pos;
+
+	alloc = vl->spare_boids_alloc;
+	vl->spare_boids_alloc = vl->boids_alloc;
+	vl->boids_alloc = alloc;
+
+	alloc = vl->spare_neighbors_alloc;
+	vl->spare_neighbors_alloc = vl->neighbors_alloc;
+	vl->neighbors_alloc = alloc;
+}
+
+/* Bounded max-heap keeping the k smallest distances seen so far */
+static void knn_heap_push(KnnEntry *heap, guint *n, guint k,
+			  gdouble dist, guint idx)
+{
+	KnnEntry e = { .dist = dist, .idx = idx };
+	guint parent;
+	guint child;
+	guint i;
+
+	if (*n < k) {
+		i = (*n)++;
+		while (i > 0) {
+			parent = (i - 1) >> 1;
+			if (heap[parent].dist >= dist)
+				break;
+			heap[i] = heap[parent];
+			i = parent;
+		}
+		heap[i] = e;
+		return;
+	}
+
+	if (dist >= heap[0].dist)
+		return;
+
+	/* Replace the farthest entry and sift it down */
+	i = 0;
+	while ((child = (i << 1) + 1) < k) {
+		if (child + 1 < k && heap[child + 1].dist > heap[child].dist)
+			child++;
+		if (heap[child].dist <= dist)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = e;
+}
+
+static void swarm_steer_topological(Swarm *swarm, guint flags, guint i,
+				    Steering *st)
+{
+	KnnEntry heap[KNN_MAX];
+	Grid *grid = &swarm->grid;
+	Boid *b1 = swarm_get_boid(swarm, i);
+	Boid *b2;
+	gdouble max_dist = POW2(swarm->cohesion_dist);
+	gdouble bound;
+	gdouble inv_dist;
+	gdouble dist;
+	gdouble dx, dy;
+	guint n = 0;
+	guint k = swarm->knn;
+	guint j;
+	gint col, row;
+	gint dc, dr;
+	gint step;
+	gint c;
+	gint r;
+
+	grid_get_cell(grid, b1->pos.x, b1->pos.y, &col, &row);
+
+	/*
+	 * Scan the cells ring by ring around the boid cell. Any boid in ring r
+	 * is at least (r - 1) cells away, so the search stops as soon as this
+	 * bound exceeds the farthest of the k neighbors already found, or the
+	 * cohesion distance.
+	 */
+	for (r = 0; r <= grid->max_ring; r++) {
+		if (r > 0) {
+			bound = POW2((r - 1) * grid->cell_size);
+			if (bound >= max_dist || (n == k && bound >= heap[0].dist))
+				break;
+		}
+
+		for (dr = -r; dr <= r; dr++) {
+			/* Inner rows of the ring only have their 2 end cells */
+			step = (dr == -r || dr == r) ? 1 : 2 * r;
+
+			for (dc = -r; dc <= r; dc += step) {
+				c = grid_neighbor_cell(grid, col, row, dc, dr);
+				if (c < 0)
+					continue;
+
+				for (j = grid->cell_start[c]; j < grid->cell_start[c + 1]; j++) {
+					if (grid->cell_boids[j] == i)
+						continue;
+
+					b2 = swarm_get_boid(swarm, grid->cell_boids[j]);
+
+					dx = b2->pos.x - b1->pos.x;
+					dy = b2->pos.y - b1->pos.y;
+					swarm_wrap_delta(swarm, &dx, &dy);
+					dist = POW2(dx) + POW2(dy);
+					if (dist >= max_dist)
+						continue;
+
+					if (!swarm_boid_sees(swarm, flags, b1,
+							     dx, dy))
+						continue;
+
+					knn_heap_push(heap, &n, k, dist,
+						      grid->cell_boids[j]);
+				}
+			}
+		}
+	}
+
+	for (j = 0; j < n; j++) {
+		b2 = swarm_get_boid(swarm, heap[j].idx);
+		dx = b2->pos.x - b1->pos.x;
+		dy = b2->pos.y - b1->pos.y;
+		swarm_wrap_delta(swarm, &dx, &dy);
+		dist = swarm_steer_dist(flags, heap[j].dist, &inv_dist);
+		swarm_steer_add(swarm, flags, st, b2, dx, dy, heap[j].dist,
+				dist, inv_dist);
+	}
+}
+
+/*
+ * Avoidance is computed exactly from the boids of the cells within the
+ * avoid distance. Alignment is approximated from the aggregated velocity of
+ * each cell within the align distance, weighted by the distance of the
+ * cell centroid. Cohesion only needs the centroid of the neighbors between
+ * the align and the cohesion distances. It is approximated by the
+ * difference of 2 summed-area table boxes, or from the cells like the
+ * alignment with the dead angle.
+ */
+/* sqrt(pi) / 2 */
+#define SQRT_PI_2 0.886226925
+
+/*
+ * The boxes would also pull a boid toward the ones in its dead angle. With
+ * the dead angle on, the cohesion sums the cells between the distances
+ * whose centroid the boid sees instead, like the alignment.
+ */
+static void swarm_cohesion_cells(Swarm *swarm, guint flags, Boid *b1,
+				 CellAggregate *self, gint col, gint row,
+				 gdouble inner_dist, Steering *st)
+{
+	Grid *grid = &swarm->grid;
+	CellAggregate agg;
+	gdouble count = 0;
+	gdouble dist;
+	gdouble dx, dy;
+	gint dc, dr;
+	gint r;
+	gint c;
+
+	r = ceil(swarm->cohesion_dist / grid->cell_size);
+
+	for (dr = -r; dr <= r; dr++) {
+		for (dc = -r; dc <= r; dc++) {
+			c = grid_neighbor_cell(grid, col, row, dc, dr);
+			if (c < 0)
+				continue;
+
+			agg = grid->cells[c];
+			if (!dc && !dr)
+				cell_aggregate_sub(&agg, self);
+
+			if (agg.count < 0.5)
+				continue;
+
+			dx = agg.pos.x / agg.count - b1->pos.x;
+			dy = agg.pos.y / agg.count - b1->pos.y;
+			swarm_wrap_delta(swarm, &dx, &dy);
+			dist = POW2(dx) + POW2(dy);
+			if (!dist || dist < POW2(inner_dist) ||
+			    dist >= POW2(swarm->cohesion_dist))
+				continue;
+
+			if (!swarm_boid_sees(swarm, flags, b1, dx, dy))
+				continue;
+
+			/* Offsets to the aggregated boids */
+			st->cohesion.x += agg.count * dx;
+			st->cohesion.y += agg.count * dy;
+			count += agg.count;
+		}
+	}
+
+	st->cohesion_n = round(count);
+}
+
+static void swarm_steer_approximate(Swarm *swarm, guint flags, guint i,
+				    Steering *st)
+{
+	Grid *grid = &swarm->grid;
+	Boid *b1 = swarm_get_boid(swarm, i);
+	Boid *b2;
+	CellAggregate self;
+	CellAggregate agg;
+	CellAggregate inner;
+	gdouble avoid_dist = swarm->avoid ? swarm->avoid_dist : 0;
+	gdouble outer_dist;
+	gdouble inner_dist;
+	gdouble root_dist;
+	gdouble inv_dist;
+	gdouble dist;
+	gdouble dx, dy;
+	Vector v;
+	gint col, row;
+	gint dc, dr;
+	gint r;
+	gint c;
+	guint j;
+
+	self.count = 1;
+	self.pos = b1->pos;
+	self.velocity = b1->velocity;
+
+	grid_get_cell(grid, b1->pos.x, b1->pos.y, &col, &row);
+
+	if (swarm->avoid) {
+		r = ceil(avoid_dist / grid->cell_size);
+
+		for (dr = -r; dr <= r; dr++) {
+			for (dc = -r; dc <= r; dc++) {
+				c = grid_neighbor_cell(grid, col, row, dc, dr);
+				if (c < 0)
+					continue;
+
+				for (j = grid->cell_start[c]; j < grid->cell_start[c + 1]; j++) {
+					if (grid->cell_boids[j] == i)
+						continue;
+
+					b2 = swarm_get_boid(swarm, grid->cell_boids[j]);
+
+					dx = b2->pos.x - b1->pos.x;
+					dy = b2->pos.y - b1->pos.y;
+					swarm_wrap_delta(swarm, &dx, &dy);
+					dist = POW2(dx) + POW2(dy);
+					if (dist >= POW2(avoid_dist))
+						continue;
+
+					if (!swarm_boid_sees(swarm, flags, b1,
+							     dx, dy))
+						continue;
+
+					root_dist = swarm_steer_dist(flags, dist,
+								     &inv_dist);
+					swarm_steer_add(swarm, flags, st, b2,
+							dx, dy, dist, root_dist,
+							inv_dist);
+				}
+			}
+		}
+	}
+
+	if (swarm->align) {
+		r = ceil(swarm->align_dist / grid->cell_size);
+
+		for (dr = -r; dr <= r; dr++) {
+			for (dc = -r; dc <= r; dc++) {
+				c = grid_neighbor_cell(grid, col, row, dc, dr);
+				if (c < 0)
+					continue;
+
+				agg = grid->cells[c];
+				if (!dc && !dr)
+					cell_aggregate_sub(&agg, &self);
+
+				if (agg.count < 0.5)
+					continue;
+
+				dx = agg.pos.x / agg.count - b1->pos.x;
+				dy = agg.pos.y / agg.count - b1->pos.y;
+				swarm_wrap_delta(swarm, &dx, &dy);
+				dist = POW2(dx) + POW2(dy);
+				if (!dist || dist < POW2(avoid_dist) ||
+				    dist >= POW2(swarm->align_dist))
+					continue;
+
+				if (!swarm_boid_sees(swarm, flags, b1, dx, dy))
+					continue;
+
+				v = agg.velocity;
+				vector_div(&v, sqrt(dist));
+				vector_add(&st->align, &v);
+			}
+		}
+	}
+
+	if (swarm->cohesion && (flags & STEER_DEAD_ANGLE)) {
+		swarm_cohesion_cells(swarm, flags, b1, &self, col, row,
+				     swarm->align ? swarm->align_dist : avoid_dist,
+				     st);
+	} else if (swarm->cohesion) {
+		/* Boxes with the same area as the circles */
+		outer_dist = swarm->cohesion_dist * SQRT_PI_2;
+		inner_dist = (swarm->align ? swarm->align_dist : avoid_dist) * SQRT_PI_2;
+
+		grid_aggregate_box(grid,
+				   b1->pos.x - outer_dist,
+				   b1->pos.y - outer_dist,
+				   b1->pos.x + outer_dist,
+				   b1->pos.y + outer_dist, &agg);
+
+		if (inner_dist) {
+			grid_aggregate_box(grid,
+					   b1->pos.x - inner_dist,
+					   b1->pos.y - inner_dist,
+					   b1->pos.x + inner_dist,
+					   b1->pos.y + inner_dist, &inner);
+			cell_aggregate_sub(&agg, &inner);
+		} else {
+			cell_aggregate_sub(&agg, &self);
+		}
+
+		if (agg.count >= 0.5) {
+			/* Offsets to the aggregated boids */
+			st->cohesion.x = agg.pos.x - agg.count * b1->pos.x;
+			st->cohesion.y = agg.pos.y - agg.count * b1->pos.y;
+			st->cohesion_n = round(agg.count);
+		}
+	}
+}
+
+static void swarm_integrate_boid(Swarm *swarm, Boid *b)
+{
+	Vector avoid_obstacle;
+	gdouble dx, dy;
+
+	vector_add(&b->velocity, &b->steer);
+
+	if (swarm->mouse_mode == MOUSE_MODE_ATTRACTIVE &&
+	    swarm->mouse_pos.x >= 0) {
+		Vector attract;
+
+		dx = swarm->mouse_pos.x - b->pos.x;
+		dy = swarm->mouse_pos.y - b->pos.y;
+
+		vector_set(&attract, dx, dy);
+		if (swarm->fast_math)
+			vector_fast_normalize(&attract);
+		else
+			vector_normalize(&attract);
+		vector_add(&b->velocity, &attract);
+	}
+
+	swarm_set_mag(swarm->fast_math, &b->velocity, swarm->speed);
+
+	if (swarm_avoid_obstacles(swarm, b, &avoid_obstacle)) {
+		vector_add(&b->velocity, &avoid_obstacle);
+		swarm_set_mag(swarm->fast_math, &b->velocity, swarm->speed);
+	}
+
+	vector_add(&b->pos, &b->velocity);
+
+	b->pos.x = fmod(b->pos.x + swarm->width, swarm->width);
+	b->pos.y = fmod(b->pos.y + swarm->height, swarm->height);
+
+	if (swarm->debug_vectors)
+		b->obstacle = avoid_obstacle;
+}
+
+/*
+ * Reorder the boids array along the Z-order curve of their positions so
+ * that boids close in the field are close in memory. The boid ids don't
+ * change and swarm->boid_index is updated accordingly.
+ */
+static void swarm_sort_boids(Swarm *swarm)
+{
+	guint num_boids = swarm_get_num_boids(swarm);
+	MortonKey *keys;
+	guint *new_index;
+	GArray *sorted;
+	Boid *b;
+	guint i;
+
+	/* The domains may hold more boids than swarm_set_num_boids() */
+	if (num_boids > swarm->sort_alloc) {
+		swarm->sort_alloc = num_boids;
+		swarm->sort_keys = g_renew(MortonKey, swarm->sort_keys,
+					   num_boids);
+		swarm->sort_index = g_renew(guint, swarm->sort_index,
+					    num_boids);
+	}
+	keys = swarm->sort_keys;
+	new_index = swarm->sort_index;
+
+	for (i = 0; i < num_boids; i++) {
+		keys[i].code = swarm_morton_code(swarm,
+						 &swarm_get_boid(swarm, i)->pos);
+		keys[i].idx = i;
+	}
+
+	qsort(keys, num_boids, sizeof(MortonKey), morton_key_cmp);
+
+	sorted = swarm->sorted;
+	g_array_set_size(sorted, num_boids);
+
+	for (i = 0; i < num_boids; i++) {
+		b = &g_array_index(sorted, Boid, i);
+		*b = *swarm_get_boid(swarm, keys[i].idx);
+		swarm->morton[i] = keys[i].code;
+		swarm->boid_index[b->id] = i;
+		new_index[keys[i].idx] = i;
+	}
+
+	if (swarm->verlet.valid)
+		swarm_permute_verlet(swarm, keys, new_index);
+
+	swarm->sorted = swarm->boids;
+	swarm->boids = sorted;
+
+	swarm->steps_since_sort = 0;
+}
+
+/*
+ * Sort the boids every sort_interval steps, or sooner when the fraction of
+ * boids which left the Z-order cell they were sorted in exceeds
+ * MORTON_SORT_DISORDER.
+ */
+static void swarm_update_order(Swarm *swarm, guint moved)
+{
+	guint num_boids = swarm_get_num_boids(swarm);
+
+	swarm->disorder = num_boids ? (gdouble)moved / num_boids : 0;
+	swarm->steps_since_sort++;
+
+	if (swarm->steps_since_sort >= swarm->sort_interval ||
+	    swarm->disorder > MORTON_SORT_DISORDER)
+		swarm_sort_boids(swarm);
+}
+
+STEER_INLINE void swarm_steer_boid(Swarm *swarm, guint flags, guint i,
+				   Steering *st)
+{
+	memset(st, 0, sizeof(*st));
+
+	switch (swarm->interaction) {
+	case INTERACTION_TOPOLOGICAL:
+		swarm_steer_topological(swarm, flags, i, st);
+		break;
+	case INTERACTION_APPROXIMATE:
+		swarm_steer_approximate(swarm, flags, i, st);
+		break;
+	default:
+		if (swarm_step_index(swarm) == NEIGHBOR_INDEX_VERLET)
+			swarm_steer_verlet(swarm, flags, i, st);
+		else if (swarm_step_index(swarm) == NEIGHBOR_INDEX_QUADTREE)
+			swarm_steer_quadtree(swarm, flags, i, st);
+		else
+			swarm_steer_metric(swarm, flags, i, st);
+		break;
 	}
+}
 
-	if (vector_is_null(direction))
+static gboolean swarm_angle_error(Vector *exact, Vector *approx,
+				  gdouble *angle)
+{
+	gdouble cos_angle;
+
+	if (vector_is_null(exact) || vector_is_null(approx))
 		return FALSE;
 
-	vector_set_mag(direction, 5);
+	cos_angle = CLAMP(vector_cos_angle(exact, approx), -1.0, 1.0);
+	*angle = rad2deg(acos(cos_angle));
 
 	return TRUE;
 }
 
-static void swarm_move_predator(Swarm *swarm)
+/* Compare the stale steering of a boid to the one it would get now */
+static void swarm_add_steer_error(Swarm *swarm, guint i)
 {
-	Obstacle *predator;
-	Vector cohesion;
-	Boid *b;
-	int i;
-	int cohesion_n;
-	gdouble dx, dy;
-	gdouble dist;
-
-	if (!swarm->predator)
-		return;
+	SteerError *err = &swarm->steer_error;
+	Boid *b = swarm_get_boid(swarm, i);
+	Steering st;
+	Vector fresh;
+	Vector diff;
+	gdouble angle;
+
+	swarm_steer_boid(swarm, swarm->steer_flags, i, &st);
+	swarm_steer_normalize(swarm->steer_flags, b, &st);
+
+	fresh = st.avoid;
+	vector_add(&fresh, &st.align);
+	vector_add(&fresh, &st.cohesion);
+
+	if (swarm_angle_error(&fresh, &b->steer, &angle)) {
+		err->angle_mean += angle;
+		err->angle_max = MAX(err->angle_max, angle);
+		err->angle_samples++;
+	}
 
-	predator = swarm_get_obstacle_by_type(swarm, OBSTACLE_TYPE_PREDATOR);
+	diff = fresh;
+	vector_sub(&diff, &b->steer);
+	err->steer_rms += POW2(diff.x) + POW2(diff.y);
+	err->samples++;
+}
 
-	vector_init(&cohesion);
-	cohesion_n = 0;
+/*
+ * With a steer_interval of k, a boid is steered every k steps, 1/k of the
+ * boids at each step, and keeps its last steering in between. The rotation
+ * follows the boid ids as the array is reordered.
+ */
+STEER_INLINE void swarm_steer_boids(Swarm *swarm, guint flags)
+{
+	guint k = swarm->steer_interval;
+	guint phase = swarm->step % k;
+	Steering st;
+	Boid *b;
+	guint i;
 
 	for (i = 0; i < swarm_get_num_boids(swarm); i++) {
 		b = swarm_get_boid(swarm, i);
 
-		dx = predator->pos.x - b->pos.x;
-		dy = predator->pos.y - b->pos.y;
-		dist = POW2(dx) + POW2(dy);
-		if (dist >= POW2(swarm->cohesion_dist))
+		if (b->id % k != phase) {
+			if (G_UNLIKELY(swarm->measure_steer_error))
+				swarm_add_steer_error(swarm, i);
 			continue;
+		}
 
-		cohesion_n++;
-		vector_add(&cohesion, &b->pos);
+		swarm_steer_boid(swarm, flags, i, &st);
+		swarm_steer_finish(swarm, flags, b, &st);
 	}
+}
 
-	if (cohesion_n) {
-		vector_div(&cohesion, cohesion_n);
-		vector_sub(&cohesion, &predator->pos);
-		vector_set_mag(&cohesion, 0.5);
-	} else {
-		cohesion = predator->velocity;
+/*
+ * The pair kernels steer boids[0] with each of the other boids, the
+ * obstacle one steers each boid away from the obstacles. The result
+ * depends on all the calls, so they can't be optimized out.
+ */
+STEER_INLINE gdouble swarm_steer_kernel(Swarm *swarm, guint flags,
+					SwarmKernel kernel, Boid *boids,
+					guint num)
+{
+	Steering st;
+	Vector dir;
+	gdouble res = 0;
+	guint i;
+
+	memset(&st, 0, sizeof(st));
+
+	switch (kernel) {
+	case KERNEL_AVOID:
+	case KERNEL_ALIGN:
+	case KERNEL_COHESION:
+		for (i = 1; i < num; i++)
+			swarm_steer_neighbor(swarm, flags, &st, &boids[0],
+					     &boids[i]);
+		res = st.avoid.x + st.align.x + st.cohesion.x + st.cohesion_n;
+		break;
+	case KERNEL_DEAD_ANGLE:
+		for (i = 1; i < num; i++)
+			res += swarm_boid_sees(swarm, flags, &boids[0],
+					       boids[i].pos.x - boids[0].pos.x,
+					       boids[i].pos.y - boids[0].pos.y);
+		break;
+	case KERNEL_OBSTACLE:
+		swarm_update_bvh(swarm);
+		for (i = 0; i < num; i++) {
+			if (swarm_avoid_obstacles(swarm, &boids[i], &dir))
+				res += dir.x;
+		}
+		break;
+	default:
+		break;
 	}
 
-	vector_add(&predator->velocity, &cohesion);
-	vector_set_mag(&predator->velocity,
-		       swarm->speed * (cohesion_n ? 1.2 : 0.8));
-	vector_add(&predator->pos, &predator->velocity);
+	return res;
+}
 
-	predator->pos.x = fmod(predator->pos.x + swarm->width, swarm->width);
-	predator->pos.y = fmod(predator->pos.y + swarm->height, swarm->height);
+typedef struct {
+	void (*boids)(Swarm *swarm);
+	void (*rows)(SteerWorker *w);
+	gdouble (*run)(Swarm *swarm, SwarmKernel kernel, Boid *boids,
+		       guint num);
+} SteerKernel;
+
+#define STEER_KERNEL_LIST(X) \
+	X(0)  X(1)  X(2)  X(3)  X(4)  X(5)  X(6)  X(7)  \
+	X(8)  X(9)  X(10) X(11) X(12) X(13) X(14) X(15) \
+	X(16) X(17) X(18) X(19) X(20) X(21) X(22) X(23) \
+	X(24) X(25) X(26) X(27) X(28) X(29) X(30) X(31) \
+	X(32) X(33) X(34) X(35) X(36) X(37) X(38) X(39) \
+	X(40) X(41) X(42) X(43) X(44) X(45) X(46) X(47) \
+	X(48) X(49) X(50) X(51) X(52) X(53) X(54) X(55) \
+	X(56) X(57) X(58) X(59) X(60) X(61) X(62) X(63)
+
+#define STEER_KERNEL_DEFINE(flags)					\
+	static void swarm_steer_boids_##flags(Swarm *swarm)		\
+	{								\
+		swarm_steer_boids(swarm, flags);			\
+	}								\
+	static void swarm_steer_rows_##flags(SteerWorker *w)		\
+	{								\
+		swarm_steer_rows(w, flags);				\
+	}								\
+	static gdouble swarm_steer_kernel_##flags(Swarm *swarm,		\
+						  SwarmKernel kernel,	\
+						  Boid *boids, guint num) \
+	{								\
+		return swarm_steer_kernel(swarm, flags, kernel, boids,	\
+					  num);				\
+	}
+
+#define STEER_KERNEL_ENTRY(flags)					\
+	[flags] = { swarm_steer_boids_##flags, swarm_steer_rows_##flags, \
+		    swarm_steer_kernel_##flags },
+
+STEER_KERNEL_LIST(STEER_KERNEL_DEFINE)
+
+static const SteerKernel swarm_steer_kernels[STEER_NUM_KERNELS] = {
+	STEER_KERNEL_LIST(STEER_KERNEL_ENTRY)
+};
+
+static void swarm_steer_worker(gpointer data, gpointer user_data)
+{
+	Swarm *swarm = user_data;
+
+	PERF_THREAD_INIT();
+
+	swarm_steer_kernels[swarm->steer_flags].rows(data);
+
+	g_mutex_lock(&swarm->pool_lock);
+	if (!--swarm->pool_pending)
+		g_cond_signal(&swarm->pool_done);
+	g_mutex_unlock(&swarm->pool_lock);
 }
 
-void swarm_move(Swarm *swarm)
+static void swarm_steer_symmetric(Swarm *swarm)
 {
-	int i;
-	int j;
-	Boid *b1;
-	Boid *b2;
-	gdouble dist;
-	guint min_dist;
-	gdouble dx, dy;
-	gdouble cos_angle;
-	int cohesion_n;
-	Vector avoid;
-	Vector avoid_obstacle;
-	Vector align;
-	Vector cohesion;
-	Vector v;
+	guint num_boids = swarm_get_num_boids(swarm);
+	SteerWorker *w;
+	Steering st;
+	guint i, t;
+
+	for (t = 0; t < swarm->num_threads; t++) {
+		w = &swarm->workers[t];
+		if (num_boids > w->acc_alloc) {
+			w->acc_alloc = num_boids;
+			w->acc = g_renew(Steering, w->acc, num_boids);
+		}
+	}
+
+	swarm->pool_pending = swarm->num_threads - 1;
+	for (t = 1; t < swarm->num_threads; t++)
+		g_thread_pool_push(swarm->pool, &swarm->workers[t], NULL);
+
+	swarm_steer_kernels[swarm->steer_flags].rows(&swarm->workers[0]);
+
+	g_mutex_lock(&swarm->pool_lock);
+	while (swarm->pool_pending)
+		g_cond_wait(&swarm->pool_done, &swarm->pool_lock);
+	g_mutex_unlock(&swarm->pool_lock);
+
+	for (i = 0; i < num_boids; i++) {
+		st = swarm->workers[0].acc[i];
+
+		for (t = 1; t < swarm->num_threads; t++) {
+			w = &swarm->workers[t];
+			vector_add(&st.avoid, &w->acc[i].avoid);
+			vector_add(&st.align, &w->acc[i].align);
+			vector_add(&st.cohesion, &w->acc[i].cohesion);
+			st.cohesion_n += w->acc[i].cohesion_n;
+		}
+
+		swarm_steer_finish(swarm, swarm->steer_flags,
+				   swarm_get_boid(swarm, i), &st);
+	}
+}
+
+/*
+ * The steering of all the boids is computed from the positions at the
+ * beginning of the step, then all the boids are moved.
+ */
+static void swarm_step(Swarm *swarm)
+{
+	Boid *b;
+	guint moved = 0;
+	guint i;
+
+	TRACE_BEGIN("swarm_move");
+	PERF_BEGIN(PERF_PHASE_STEP);
 
+	TRACE_BEGIN("predator");
+	PERF_BEGIN(PERF_PHASE_PREDATOR);
 	swarm_move_predator(swarm);
+	swarm_update_bvh(swarm);
+	PERF_END(PERF_PHASE_PREDATOR);
+	TRACE_END("predator");
+
+	TRACE_BEGIN("index");
+	PERF_BEGIN(PERF_PHASE_INDEX);
+	switch (swarm->interaction) {
+	case INTERACTION_TOPOLOGICAL:
+		grid_build(&swarm->grid, swarm->boids, swarm->width,
+			   swarm->height, GRID_KNN_CELL_SIZE, !swarm->walls);
+		break;
+	case INTERACTION_APPROXIMATE:
+		grid_build(&swarm->grid, swarm->boids, swarm->width,
+			   swarm->height, GRID_AGGREGATE_CELL_SIZE, !swarm->walls);
+		grid_build_aggregates(&swarm->grid, swarm->boids);
+		break;
+	default:
+		if (swarm->index == NEIGHBOR_INDEX_VERLET)
+			swarm_update_verlet(swarm);
+		if (swarm_step_index(swarm) == NEIGHBOR_INDEX_QUADTREE)
+			quadtree_build(&swarm->quadtree, swarm->boids,
+				       swarm->width, swarm->height,
+				       !swarm->walls);
+		break;
+	}
+	PERF_END(PERF_PHASE_INDEX);
+	TRACE_END("index");
+
+	TRACE_BEGIN("steer");
+	PERF_BEGIN(PERF_PHASE_STEER);
+	swarm->steer_flags = swarm_steer_flags(swarm);
+	if (swarm->symmetric && swarm->interaction == INTERACTION_METRIC &&
+	    swarm_step_index(swarm) != NEIGHBOR_INDEX_QUADTREE &&
+	    swarm->steer_interval == 1)
+		swarm_steer_symmetric(swarm);
+	else
+		swarm_steer_kernels[swarm->steer_flags].boids(swarm);
+	PERF_END(PERF_PHASE_STEER);
+	TRACE_END("steer");
 
+	TRACE_BEGIN("integrate");
+	PERF_BEGIN(PERF_PHASE_INTEGRATE);
 	for (i = 0; i < swarm_get_num_boids(swarm); i++) {
-		b1 = swarm_get_boid(swarm, i);
+		b = swarm_get_boid(swarm, i);
 
-		vector_init(&avoid);
-		vector_init(&align);
-		vector_init(&cohesion);
-		cohesion_n = 0;
-		min_dist = PROXIMITY_DIST;
+		swarm_integrate_boid(swarm, b);
 
-		for (j = 0; j < swarm_get_num_boids(swarm); j++) {
-			b2 = swarm_get_boid(swarm, j);
+		/* Count the boids out of their Z-order cell on the way */
+		if (swarm->sort_interval &&
+		    (swarm_morton_code(swarm, &b->pos) >> MORTON_CELL_SHIFT) !=
+		    (swarm->morton[i] >> MORTON_CELL_SHIFT))
+			moved++;
+	}
+	PERF_END(PERF_PHASE_INTEGRATE);
+	TRACE_END("integrate");
+
+	if (swarm->sort_interval) {
+		TRACE_BEGIN("sort");
+		PERF_BEGIN(PERF_PHASE_SORT);
+		swarm_update_order(swarm, moved);
+		PERF_END(PERF_PHASE_SORT);
+		TRACE_END("sort");
+	}
 
-			if (j == i)
-				continue;
+	swarm->step++;
 
-			/* Avoid a bunch os useless sqrt */
-			dx = b2->pos.x - b1->pos.x;
-			dy = b2->pos.y - b1->pos.y;
-			dist = POW2(dx) + POW2(dy);
-			if (dist >= POW2(swarm->cohesion_dist))
-				continue;
+	PERF_END(PERF_PHASE_STEP);
+	TRACE_END("swarm_move");
+}
 
-			if (swarm->dead_angle) {
-				vector_set(&v, dx, dy);
+void swarm_move(Swarm *swarm)
+{
+	if (swarm->scenario)
+		scenario_update(swarm);
 
-				cos_angle = vector_cos_angle(&b1->velocity, &v);
-				if (cos_angle < swarm->cos_dead_angle)
-					continue;
-			}
+	if (swarm->domains)
+		domain_step(swarm);
+	else
+		swarm_step(swarm);
 
-			/* Do the sqrt only when really needed */
-			dist = sqrt(dist);
-			if (dist < min_dist)
-				min_dist = dist;
-
-			if (swarm->avoid && dist < swarm->avoid_dist) {
-				v = b1->pos;
-				vector_sub(&v, &b2->pos);
-				vector_div(&v, dist);
-				vector_add(&avoid, &v);
-			} else if (swarm->align && dist < swarm->align_dist) {
-				v = b2->velocity;
-				vector_div(&v, dist);
-				vector_add(&align, &v);
-			} else if (swarm->cohesion && dist < swarm->cohesion_dist) {
-				cohesion_n++;
-				vector_add(&cohesion, &b2->pos);
-			}
-		}
+	if (swarm->export)
+		export_publish(swarm);
+}
 
-		if (!vector_is_null(&align))
-			vector_set_mag(&align, 3.5);
+/*
+ * Run a kernel of the steering as swarm_move() does, for the
+ * microbenchmarks: through the instance of the current flags, as the
+ * steps use them.
+ */
+gdouble swarm_run_kernel(Swarm *swarm, SwarmKernel kernel, Boid *boids,
+			 guint num)
+{
+	return swarm_steer_kernels[swarm_steer_flags(swarm)].run(swarm, kernel,
+								 boids, num);
+}
 
-		if (cohesion_n) {
-			vector_div(&cohesion, cohesion_n);
-			vector_sub(&cohesion, &b1->pos);
-			vector_set_mag(&cohesion, 0.5);
-		}
+/*
+ * Compare the steering of INTERACTION_APPROXIMATE against the exact metric
+ * interaction for the current boid positions. The boids are not moved.
+ */
+void swarm_get_approx_error(Swarm *swarm, ApproxError *err)
+{
+	guint flags = swarm_steer_flags(swarm);
+	Steering exact;
+	Steering approx;
+	Vector diff;
+	Boid *b;
+	gdouble angle;
+	guint align_n = 0;
+	guint cohesion_n = 0;
+	guint num_boids = swarm_get_num_boids(swarm);
+	guint i;
 
-		vector_add(&b1->velocity, &avoid);
-		vector_add(&b1->velocity, &align);
-		vector_add(&b1->velocity, &cohesion);
+	memset(err, 0, sizeof(*err));
 
-		if (swarm->mouse_mode == MOUSE_MODE_ATTRACTIVE &&
-		    swarm->mouse_pos.x >= 0) {
-			Vector attract;
+	if (!num_boids)
+		return;
 
-			dx = swarm->mouse_pos.x - b1->pos.x;
-			dy = swarm->mouse_pos.y - b1->pos.y;
+	grid_build(&swarm->grid, swarm->boids, swarm->width,
+		   swarm->height, GRID_AGGREGATE_CELL_SIZE, !swarm->walls);
+	grid_build_aggregates(&swarm->grid, swarm->boids);
 
-			vector_set(&attract, dx, dy);
-			vector_normalize(&attract);
-			vector_add(&b1->velocity, &attract);
-		}
+	for (i = 0; i < num_boids; i++) {
+		b = swarm_get_boid(swarm, i);
 
-		vector_set_mag(&b1->velocity, swarm->speed);
+		memset(&exact, 0, sizeof(exact));
+		memset(&approx, 0, sizeof(approx));
 
-		if (swarm_avoid_obstacles(swarm, b1, &avoid_obstacle)) {
-			vector_add(&b1->velocity, &avoid_obstacle);
-			vector_set_mag(&b1->velocity, swarm->speed);
-		}
+		swarm_steer_metric(swarm, flags, i, &exact);
+		swarm_steer_approximate(swarm, flags, i, &approx);
 
-		vector_add(&b1->pos, &b1->velocity);
+		swarm_steer_normalize(flags, b, &exact);
+		swarm_steer_normalize(flags, b, &approx);
 
-		b1->pos.x = fmod(b1->pos.x + swarm->width, swarm->width);
-		b1->pos.y = fmod(b1->pos.y + swarm->height, swarm->height);
+		if (swarm_angle_error(&exact.align, &approx.align, &angle)) {
+			err->align_mean += angle;
+			err->align_max = MAX(err->align_max, angle);
+			align_n++;
+		} else if (vector_is_null(&exact.align) !=
+			   vector_is_null(&approx.align)) {
+			err->align_missed++;
+		}
 
-		if (swarm->debug_vectors) {
-			b1->avoid = avoid;
-			b1->align = align;
-			b1->cohesion = cohesion;
-			b1->obstacle = avoid_obstacle;
+		if (swarm_angle_error(&exact.cohesion, &approx.cohesion, &angle)) {
+			err->cohesion_mean += angle;
+			err->cohesion_max = MAX(err->cohesion_max, angle);
+			cohesion_n++;
+		} else if (vector_is_null(&exact.cohesion) !=
+			   vector_is_null(&approx.cohesion)) {
+			err->cohesion_missed++;
 		}
+
+		vector_add(&exact.avoid, &exact.align);
+		vector_add(&exact.avoid, &exact.cohesion);
+		vector_add(&approx.avoid, &approx.align);
+		vector_add(&approx.avoid, &approx.cohesion);
+		diff = exact.avoid;
+		vector_sub(&diff, &approx.avoid);
+		err->steer_rms += vector_dot(&diff, &diff);
 	}
+
+	if (align_n)
+		err->align_mean /= align_n;
+	if (cohesion_n)
+		err->cohesion_mean /= cohesion_n;
+
+	err->align_missed /= num_boids;
+	err->cohesion_missed /= num_boids;
+	err->steer_rms = sqrt(err->steer_rms / num_boids);
 }
 
 Obstacle *swarm_get_obstacle_by_type(Swarm *swarm, guint type)
@@ -221,8 +1596,10 @@ static void swarm_remove_obstacle_by_type(Swarm *swarm, guint type)
 	i = swarm->obstacles->len;
 	while (i--) {
 		o = swarm_get_obstacle(swarm, i);
-		if (o->type == type)
+		if (o->type == type) {
 			g_array_remove_index(swarm->obstacles, i);
+			swarm->bvh_dirty = TRUE;
+		}
 	}
 }
 
@@ -246,6 +1623,7 @@ void swarm_add_obstacle(Swarm *swarm, gdouble x, gdouble y, guint type)
 			/* The scary mouse obstacle is much bigger */
 			new.avoid_radius = POW2(OBSTACLE_RADIUS * 10);
 			g_array_prepend_val(swarm->obstacles, new);
+			swarm->bvh_dirty = TRUE;
 		}
 
 		return;
@@ -266,6 +1644,7 @@ void swarm_add_obstacle(Swarm *swarm, gdouble x, gdouble y, guint type)
 		new.velocity.y = 0;
 		new.avoid_radius = POW2(OBSTACLE_RADIUS * 5);
 		g_array_prepend_val(swarm->obstacles, new);
+		swarm->bvh_dirty = TRUE;
 
 		swarm->predator = TRUE;
 
@@ -277,8 +1656,9 @@ void swarm_add_obstacle(Swarm *swarm, gdouble x, gdouble y, guint type)
 	while (i--) {
 		o = swarm_get_obstacle(swarm, i);
 
-		/* Ignore the scary mouse obstacle */
-		if (o->type == OBSTACLE_TYPE_SCARY_MOUSE)
+		/* Ignore the scary mouse obstacle and the polygons */
+		if (o->type == OBSTACLE_TYPE_SCARY_MOUSE ||
+		    o->shape == OBSTACLE_SHAPE_SEGMENT)
 			continue;
 
 		dx = o->pos.x - x;
@@ -289,32 +1669,86 @@ void swarm_add_obstacle(Swarm *swarm, gdouble x, gdouble y, guint type)
 	}
 
 	g_array_append_val(swarm->obstacles, new);
+	swarm->bvh_dirty = TRUE;
+}
+
+/*
+ * Add a polygon to the field, closed from the last point to the first
+ * one, or a single segment from 2 points. Its segments are removed
+ * together.
+ */
+void swarm_add_polygon(Swarm *swarm, const Vector *points, guint num)
+{
+	guint num_segments = num == 2 ? 1 : num;
+	guint i;
+	Obstacle new = {
+		.type = OBSTACLE_TYPE_IN_FIELD,
+		.shape = OBSTACLE_SHAPE_SEGMENT,
+		.avoid_radius = POW2(OBSTACLE_RADIUS),
+	};
+
+	if (swarm->predator || num < 2)
+		return;
+
+	new.polygon = ++swarm->num_polygons;
+
+	for (i = 0; i < num_segments; i++) {
+		new.pos = points[i];
+		new.end = points[(i + 1) % num];
+		g_array_append_val(swarm->obstacles, new);
+	}
+
+	swarm->bvh_dirty = TRUE;
 }
 
+/* Remove the last added field obstacle or polygon under (x, y) */
 gboolean swarm_remove_obstacle(Swarm *swarm, gdouble x, gdouble y)
 {
+	BvhNode *leaf;
+	BvhIter it;
 	Obstacle *o;
-	gdouble dist;
-	int i;
+	Vector p;
+	Vector q;
+	guint polygon;
+	gint hit = -1;
+	guint idx;
+	guint i;
+
+	swarm_update_bvh(swarm);
+	vector_set(&p, x, y);
+
+	bvh_iter_init(&swarm->bvh, &it);
+	while ((leaf = bvh_iter_next(&swarm->bvh, &it, x, y))) {
+		for (i = leaf->first; i < leaf->first + leaf->count; i++) {
+			idx = swarm->bvh.items[i];
+			o = swarm_get_obstacle(swarm, idx);
+			/* Remove only field obstacle */
+			if (o->type != OBSTACLE_TYPE_IN_FIELD || (gint)idx <= hit)
+				continue;
 
-	if (!swarm->obstacles->len)
-		return FALSE;
+			obstacle_closest_point(o, &p, &q);
+			if (POW2(q.x - x) + POW2(q.y - y) <= POW2(OBSTACLE_RADIUS))
+				hit = idx;
+		}
+	}
 
-	i = swarm->obstacles->len;
-	while (i--) {
-		o = swarm_get_obstacle(swarm, i);
-		/* Remove only field obstacle */
-		if (o->type != OBSTACLE_TYPE_IN_FIELD)
-			continue;
+	if (hit < 0)
+		return FALSE;
 
-		dist = POW2(o->pos.x - x) + POW2(o->pos.y - y);
-		if (dist <= POW2(OBSTACLE_RADIUS)) {
-			g_array_remove_index(swarm->obstacles, i);
-			return TRUE;
+	polygon = swarm_get_obstacle(swarm, hit)->polygon;
+	if (!polygon) {
+		g_array_remove_index(swarm->obstacles, hit);
+	} else {
+		i = swarm->obstacles->len;
+		while (i--) {
+			if (swarm_get_obstacle(swarm, i)->polygon == polygon)
+				g_array_remove_index(swarm->obstacles, i);
 		}
 	}
 
-	return FALSE;
+	swarm->bvh_dirty = TRUE;
+
+	return TRUE;
 }
 
 static void swarm_remove_walls(Swarm *swarm)
@@ -390,7 +1824,7 @@ void swarm_set_mouse_mode(Swarm *swarm, MouseMode mode)
 
 guint swarm_get_dead_angle(Swarm *swarm)
 {
-	return ceil(rad2deg((G_PI - acos(swarm->cos_dead_angle)) * 2));
+	return round(rad2deg((G_PI - acos(swarm->cos_dead_angle)) * 2));
 }
 
 void swarm_set_dead_angle(Swarm *swarm, guint angle)
@@ -431,22 +1865,89 @@ void swarm_init_boid(Swarm *swarm, Boid *boid)
 	vector_set_mag(&boid->velocity, 5);
 }
 
+/*
+ * Boid ids are kept dense: growing the swarm appends boids with the next
+ * ids and shrinking it removes the boids with the highest ids, wherever
+ * they are in the array.
+ */
 void swarm_set_num_boids(Swarm *swarm, guint num)
 {
 	GArray *boids = swarm->boids;
+	Boid *p;
 	Boid b;
+	guint i, j;
 
 	if (!num || num > MAX_BOIDS)
 		num = DEFAULT_NUM_BOIDS;
 
+	swarm->verlet.valid = FALSE;
+
+	if (num > swarm->boids_alloc) {
+		swarm->boids_alloc = num;
+		swarm->boid_index = g_renew(guint, swarm->boid_index, num);
+		swarm->morton = g_renew(guint32, swarm->morton, num);
+	}
+
 	if (num > boids->len) {
 		while (boids->len < num) {
 			swarm_init_boid(swarm, &b);
+			b.id = boids->len;
+			swarm->boid_index[b.id] = boids->len;
+			swarm->morton[boids->len] =
+				swarm_morton_code(swarm, &b.pos);
 			g_array_append_val(swarm->boids, b);
 		}
 	} else if (num < boids->len) {
-		g_array_remove_range(boids, num, boids->len - num);
+		for (i = 0, j = 0; i < boids->len; i++) {
+			p = &g_array_index(boids, Boid, i);
+			if (p->id >= num)
+				continue;
+
+			g_array_index(boids, Boid, j) = *p;
+			swarm->morton[j] = swarm->morton[i];
+			swarm->boid_index[p->id] = j;
+			j++;
+		}
+
+		g_array_set_size(boids, num);
+	}
+}
+
+/*
+ * To be called once boids were added to or removed from swarm->boids
+ * directly. Their ids must be below the number of boids of the last
+ * swarm_set_num_boids().
+ */
+void swarm_boids_changed(Swarm *swarm)
+{
+	Boid *b;
+	guint i;
+
+	swarm->verlet.valid = FALSE;
+
+	for (i = 0; i < swarm_get_num_boids(swarm); i++) {
+		b = swarm_get_boid(swarm, i);
+		swarm->boid_index[b->id] = i;
+		swarm->morton[i] = swarm_morton_code(swarm, &b->pos);
+	}
+}
+
+/*
+ * Place all the boids again over the current world size, with the ids in
+ * array order, i.e. the same boids after the same g_random_set_seed().
+ */
+void swarm_reset_boids(Swarm *swarm)
+{
+	Boid *b;
+	guint i;
+
+	for (i = 0; i < swarm_get_num_boids(swarm); i++) {
+		b = swarm_get_boid(swarm, i);
+		swarm_init_boid(swarm, b);
+		b->id = i;
 	}
+
+	swarm_boids_changed(swarm);
 }
 
 void swarm_get_sizes(Swarm *swarm, gint *width, gint *height)
@@ -582,10 +2083,183 @@ gboolean swarm_get_predator_enable(Swarm *swarm)
 	return swarm->predator;
 }
 
+InteractionMode swarm_get_interaction_mode(Swarm *swarm)
+{
+	return swarm->interaction;
+}
+
+void swarm_set_interaction_mode(Swarm *swarm, InteractionMode mode)
+{
+	swarm->interaction = mode;
+}
+
+guint swarm_get_sort_interval(Swarm *swarm)
+{
+	return swarm->sort_interval;
+}
+
+void swarm_set_sort_interval(Swarm *swarm, guint steps)
+{
+	swarm->sort_interval = steps;
+	swarm->steps_since_sort = 0;
+}
+
+NeighborIndex swarm_get_neighbor_index(Swarm *swarm)
+{
+	return swarm->index;
+}
+
+void swarm_set_neighbor_index(Swarm *swarm, NeighborIndex index)
+{
+	swarm->index = index;
+	swarm->verlet.valid = FALSE;
+}
+
+guint swarm_get_steer_interval(Swarm *swarm)
+{
+	return swarm->steer_interval;
+}
+
+void swarm_set_steer_interval(Swarm *swarm, guint steps)
+{
+	swarm->steer_interval = CLAMP(steps, 1, STEER_INTERVAL_MAX);
+}
+
+void swarm_measure_steer_error(Swarm *swarm, gboolean enable)
+{
+	swarm->measure_steer_error = enable;
+	memset(&swarm->steer_error, 0, sizeof(swarm->steer_error));
+}
+
+void swarm_get_steer_error(Swarm *swarm, SteerError *err)
+{
+	SteerError *e = &swarm->steer_error;
+
+	*err = *e;
+
+	if (e->angle_samples)
+		err->angle_mean = e->angle_mean / e->angle_samples;
+	if (e->samples)
+		err->steer_rms = sqrt(e->steer_rms / e->samples);
+}
+
+gboolean swarm_get_fast_math(Swarm *swarm)
+{
+	return swarm->fast_math;
+}
+
+void swarm_set_fast_math(Swarm *swarm, gboolean enable)
+{
+	swarm->fast_math = enable;
+}
+
+gboolean swarm_get_symmetric(Swarm *swarm)
+{
+	return swarm->symmetric;
+}
+
+void swarm_set_symmetric(Swarm *swarm, gboolean symmetric)
+{
+	swarm->symmetric = symmetric;
+}
+
+guint swarm_get_num_threads(Swarm *swarm)
+{
+	return swarm->num_threads;
+}
+
+static void swarm_free_workers(Swarm *swarm)
+{
+	guint t;
+
+	if (swarm->pool)
+		g_thread_pool_free(swarm->pool, FALSE, TRUE);
+	swarm->pool = NULL;
+
+	for (t = 0; t < swarm->num_threads; t++)
+		g_free(swarm->workers[t].acc);
+	g_free(swarm->workers);
+	swarm->workers = NULL;
+}
+
+void swarm_set_num_threads(Swarm *swarm, guint num)
+{
+	guint t;
+
+	num = CLAMP(num, 1, STEER_THREADS_MAX);
+	if (num == swarm->num_threads)
+		return;
+
+	swarm_free_workers(swarm);
+
+	swarm->num_threads = num;
+	swarm->workers = g_new0(SteerWorker, num);
+	for (t = 0; t < num; t++) {
+		swarm->workers[t].swarm = swarm;
+		swarm->workers[t].id = t;
+	}
+
+	if (num > 1)
+		swarm->pool = g_thread_pool_new(swarm_steer_worker, swarm,
+						num - 1, TRUE, NULL);
+}
+
+guint swarm_get_verlet_skin(Swarm *swarm)
+{
+	return swarm->verlet.skin;
+}
+
+void swarm_set_verlet_skin(Swarm *swarm, guint skin)
+{
+	swarm->verlet.skin = MIN(skin, VERLET_SKIN_MAX);
+	swarm->verlet.valid = FALSE;
+}
+
+void swarm_get_verlet_stats(Swarm *swarm, guint64 *builds, guint64 *steps)
+{
+	*builds = swarm->verlet.builds;
+	*steps = swarm->verlet.steps;
+}
+
+guint swarm_get_knn(Swarm *swarm)
+{
+	return swarm->knn;
+}
+
+void swarm_set_knn(Swarm *swarm, guint k)
+{
+	if (k < KNN_MIN)
+		k = KNN_MIN;
+	else if (k > KNN_MAX)
+		k = KNN_MAX;
+
+	swarm->knn = k;
+}
+
 void swarm_free(Swarm *swarm)
 {
+	domain_stop(swarm);
+	export_stop(swarm);
+	scenario_free(swarm->scenario);
 	g_array_free(swarm->boids, TRUE);
 	g_array_free(swarm->obstacles, TRUE);
+	swarm_free_workers(swarm);
+	g_mutex_clear(&swarm->pool_lock);
+	g_cond_clear(&swarm->pool_done);
+	grid_free(&swarm->grid);
+	quadtree_free(&swarm->quadtree);
+	bvh_free(&swarm->bvh);
+	g_free(swarm->verlet.start);
+	g_free(swarm->verlet.neighbors);
+	g_free(swarm->verlet.build_pos);
+	g_free(swarm->verlet.spare_start);
+	g_free(swarm->verlet.spare_neighbors);
+	g_free(swarm->verlet.spare_build_pos);
+	g_free(swarm->boid_index);
+	g_free(swarm->morton);
+	g_array_free(swarm->sorted, TRUE);
+	g_free(swarm->sort_keys);
+	g_free(swarm->sort_index);
 	g_free(swarm);
 }
 
@@ -599,6 +2273,7 @@ Swarm *swarm_alloc(void)
 	swarm->height = DEFAULT_HEIGHT;
 
 	swarm->boids = g_array_new(FALSE, FALSE, sizeof(Boid));
+	swarm->sorted = g_array_new(FALSE, FALSE, sizeof(Boid));
 	swarm->obstacles = g_array_new(FALSE, FALSE, sizeof(Obstacle));
 
 	swarm_set_num_boids(swarm, DEFAULT_NUM_BOIDS);
@@ -609,6 +2284,18 @@ Swarm *swarm_alloc(void)
 	swarm->align_dist = ALIGN_DIST_DFLT;
 	swarm->cohesion_dist = COHESION_DIST_DFLT;
 
+	swarm->interaction = INTERACTION_METRIC;
+	swarm->knn = KNN_DFLT;
+
+	swarm->sort_interval = MORTON_SORT_INTERVAL_DFLT;
+	swarm->index = NEIGHBOR_INDEX_VERLET;
+	swarm->steer_interval = STEER_INTERVAL_DFLT;
+
+	g_mutex_init(&swarm->pool_lock);
+	g_cond_init(&swarm->pool_done);
+	swarm_set_num_threads(swarm, 1);
+	swarm->verlet.skin = VERLET_SKIN_DFLT;
+
 	swarm->debug_controls = FALSE;
 
 	return swarm;
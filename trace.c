@@ -0,0 +1,150 @@
+/* SPDX-License-Identifier: MIT */
+#include <time.h>
+#include <glib/gprintf.h>
+
+#include "trace.h"
+
+#define TRACE_MAX_THREADS 64
+
+typedef struct {
+	const gchar *name;
+	gint64 ts;
+	gint tid;
+	gchar phase;
+} TraceEvent;
+
+typedef struct {
+	gchar *filename;
+	TraceEvent *events;
+	guint mask;
+	volatile gint head;
+	volatile gint num_threads;
+} Trace;
+
+gboolean trace_enabled = FALSE;
+
+static Trace trace;
+
+static __thread gint trace_tid;
+
+static inline gint64 trace_get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void trace_event(const gchar *name, gchar phase)
+{
+	TraceEvent *e;
+	guint idx;
+
+	if (G_UNLIKELY(!trace_tid))
+		trace_tid = g_atomic_int_add(&trace.num_threads, 1) + 1;
+
+	idx = (guint)g_atomic_int_add(&trace.head, 1) & trace.mask;
+
+	e = &trace.events[idx];
+	e->name = name;
+	e->ts = trace_get_time_ns();
+	e->tid = trace_tid;
+	e->phase = phase;
+}
+
+static void trace_write(FILE *f)
+{
+	gint depth[TRACE_MAX_THREADS] = { 0 };
+	TraceEvent *e;
+	guint head;
+	guint first;
+	guint count;
+	guint i;
+	gint *d;
+	gboolean sep = FALSE;
+
+	head = (guint)trace.head;
+	if (head > trace.mask + 1) {
+		first = head & trace.mask;
+		count = trace.mask + 1;
+	} else {
+		first = 0;
+		count = head;
+	}
+
+	g_fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+	for (i = 0; i < count; i++) {
+		e = &trace.events[(first + i) & trace.mask];
+		d = &depth[e->tid % TRACE_MAX_THREADS];
+
+		/*
+		 * The begin events of the oldest scopes may have been overwritten
+		 * when the ring wrapped. Drop their orphan end events.
+		 */
+		if (e->phase == 'E') {
+			if (!*d)
+				continue;
+			(*d)--;
+		} else {
+			(*d)++;
+		}
+
+		g_fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"boids\",\"ph\":\"%c\","
+			  "\"ts\":%.3f,\"pid\":1,\"tid\":%d}",
+			  sep ? ",\n" : "", e->name, e->phase,
+			  e->ts / 1000.0, e->tid);
+		sep = TRUE;
+	}
+
+	g_fprintf(f, "\n]}\n");
+}
+
+gboolean trace_init(const gchar *filename, guint num_events)
+{
+	guint size = 1;
+
+	if (!filename)
+		return FALSE;
+
+	if (!num_events)
+		num_events = TRACE_DEFAULT_EVENTS;
+
+	/* Round up to a power of 2 so the ring index is a simple mask */
+	while (size < num_events)
+		size <<= 1;
+
+	trace.filename = g_strdup(filename);
+	trace.events = g_new0(TraceEvent, size);
+	trace.mask = size - 1;
+	trace.head = 0;
+
+	trace_enabled = TRUE;
+
+	return TRUE;
+}
+
+void trace_finish(void)
+{
+	FILE *f;
+
+	if (!trace_enabled)
+		return;
+
+	trace_enabled = FALSE;
+
+	f = fopen(trace.filename, "w");
+	if (f) {
+		trace_write(f);
+		fclose(f);
+	} else {
+		g_fprintf(stderr, "Failed to write trace file %s\n",
+			  trace.filename);
+	}
+
+	g_free(trace.events);
+	g_free(trace.filename);
+	trace.events = NULL;
+	trace.filename = NULL;
+}
@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <glib.h>
+
+#define TRACE_DEFAULT_EVENTS (1 << 18)
+
+/*
+ * Begin/end events are stored in a fixed size ring buffer and only written
+ * to the Chrome trace JSON file by trace_finish(). When tracing is not
+ * enabled, the TRACE_BEGIN()/TRACE_END() cost is a single test.
+ */
+extern gboolean trace_enabled;
+
+void trace_event(const gchar *name, gchar phase);
+
+#define TRACE_BEGIN(name)				\
+	do {						\
+		if (G_UNLIKELY(trace_enabled))		\
+			trace_event(name, 'B');		\
+	} while (0)
+
+#define TRACE_END(name)					\
+	do {						\
+		if (G_UNLIKELY(trace_enabled))		\
+			trace_event(name, 'E');		\
+	} while (0)
+
+gboolean trace_init(const gchar *filename, guint num_events);
+void trace_finish(void);
+
+#endif /* __TRACE_H__ */
@@ -85,6 +85,40 @@ static inline void vector_set_mag(Vector *v, gdouble mag)
 	vector_mult(v, mag);
 }
 
+/*
+ * Fast math variants. 1 / sqrt(x) is estimated from the bits of x, then
+ * refined by one Newton step, within 2e-3 relative error (--check
+ * measures it).
+ */
+static inline gdouble vector_rsqrt(gdouble x)
+{
+	union {
+		gdouble d;
+		guint64 i;
+	} u = { .d = x };
+	gdouble y;
+
+	u.i = G_GUINT64_CONSTANT(0x5fe6eb50c7b537a9) - (u.i >> 1);
+	y = u.d;
+
+	return y * (1.5 - 0.5 * x * y * y);
+}
+
+static inline void vector_fast_set_mag(Vector *v, gdouble mag)
+{
+	gdouble mag2 = v->x * v->x + v->y * v->y;
+
+	if (!mag2)
+		return;
+
+	vector_mult(v, mag * vector_rsqrt(mag2));
+}
+
+static inline void vector_fast_normalize(Vector *v)
+{
+	vector_fast_set_mag(v, 1);
+}
+
 static inline void vector_print(Vector *v, char *name)
 {
 	if (!name)